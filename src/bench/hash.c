@@ -0,0 +1,130 @@
+/*
+	hash.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "../update/hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_HASH_NAMES  (1 << 16)
+#define BENCH_HASH_ROUNDS 64
+
+/* Previous set hash, strlen followed by byte at a time FNV-1a */
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325
+#define FNV_PRIME        0x100000001B3
+
+static hash_t
+bench_hash_fnv(const char *string, size_t *lengthp) {
+	const uint8_t *data = (const uint8_t *)string;
+	const uint8_t * const end = data + strlen(string);
+	hash_t hash = FNV_OFFSET_BASIS;
+
+	while(data != end) {
+		hash *= FNV_PRIME;
+		hash ^= *data;
+
+		data++;
+	}
+
+	*lengthp = end - (const uint8_t *)string;
+
+	return hash;
+}
+
+static double
+bench_hash_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Names look like geister or packages, sharing long prefixes, of lengths 4 to ~60 */
+static char **
+bench_hash_names(void) {
+	static const char *prefixes[] = {
+		"lib", "python3-", "perl-", "xorg-x11-", "kernel-modules-", "linux-firmware-",
+	};
+	char **names = malloc(BENCH_HASH_NAMES * sizeof(*names));
+
+	srand(0);
+	for(size_t i = 0; i < BENCH_HASH_NAMES; i++) {
+		char name[128];
+		const char * const prefix = prefixes[rand() % (sizeof(prefixes) / sizeof(*prefixes))];
+
+		if(rand() % 2 == 0) {
+			snprintf(name, sizeof(name), "%s%lx", prefix, (unsigned long)rand() % (1ul << (rand() % 32 + 1)));
+		} else {
+			snprintf(name, sizeof(name), "%s%lx-%d.%d.%d", prefix, (unsigned long)rand(), rand() % 10, rand() % 100, rand() % 1000);
+		}
+
+		names[i] = strdup(name);
+	}
+
+	return names;
+}
+
+static void
+bench_hash_run(const char *name, hash_t (*function)(const char *, size_t *), char **names) {
+	volatile hash_t sink = 0;
+	size_t totallength = 0, length;
+
+	const double begin = bench_hash_now();
+	for(unsigned int round = 0; round < BENCH_HASH_ROUNDS; round++) {
+		for(size_t i = 0; i < BENCH_HASH_NAMES; i++) {
+			sink ^= function(names[i], &length);
+			totallength += length;
+		}
+	}
+	const double elapsed = bench_hash_now() - begin;
+	const double operations = (double)BENCH_HASH_ROUNDS * BENCH_HASH_NAMES;
+
+	printf("%-8s %8.2f ns/op %8.3f ns/byte\n", name, elapsed / operations, elapsed / totallength);
+}
+
+int
+main(int argc, char **argv) {
+	char ** const names = bench_hash_names();
+	int status = EXIT_SUCCESS;
+
+	/* All kernels must agree with hash_bytes, as hashes may be stored */
+	for(const struct hash_kernel *kernel = hash_kernels; kernel->name != NULL; kernel++) {
+		if(!kernel->supported()) {
+			printf("%-8s unsupported\n", kernel->name);
+			continue;
+		}
+
+		for(size_t i = 0; i < BENCH_HASH_NAMES; i++) {
+			const size_t expectedlength = strlen(names[i]);
+			size_t length;
+
+			if(kernel->function(names[i], &length) != hash_bytes(names[i], expectedlength) || length != expectedlength) {
+				fprintf(stderr, "%s: Mismatch for '%s'\n", kernel->name, names[i]);
+				status = EXIT_FAILURE;
+				break;
+			}
+		}
+	}
+
+	bench_hash_run("fnv", bench_hash_fnv, names);
+	for(const struct hash_kernel *kernel = hash_kernels; kernel->name != NULL; kernel++) {
+		if(kernel->supported()) {
+			bench_hash_run(kernel->name, kernel->function, names);
+		}
+	}
+	bench_hash_run("selected", hash_string, names);
+
+	for(size_t i = 0; i < BENCH_HASH_NAMES; i++) {
+		free(names[i]);
+	}
+	free(names);
+
+	return status;
+}
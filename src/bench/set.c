@@ -0,0 +1,239 @@
+/*
+	set.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "../update/state.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+/* Linear scans are quadratic, don't run them above this size */
+#define BENCH_SET_LINEAR_MAX 10000
+
+struct bench_set_names {
+	size_t count;
+	atom_t *geister;
+	atom_t *packages;
+	atom_t *misses;  /* Geister absent of the set */
+	atom_t *bumped;  /* Packages of a newer version */
+};
+
+static double
+bench_set_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+bench_set_report(const char *workload, size_t count, double begin, size_t operations) {
+	const double elapsed = bench_set_now() - begin;
+
+	printf("%8lu %-20s %10.2f ns/op\n", count, workload, elapsed / operations);
+}
+
+/* Geister look like lib<name>, python3-<name>..., packages like <geist>-<major>.<minor>.<patch> */
+static void
+bench_set_names_init(struct bench_set_names *names, struct atoms *atoms, size_t count) {
+	static const char *prefixes[] = {
+		"lib", "python3-", "perl-", "xorg-x11-", "kernel-modules-", "",
+	};
+
+	names->count = count;
+	names->geister = malloc(count * sizeof(*names->geister));
+	names->packages = malloc(count * sizeof(*names->packages));
+	names->misses = malloc(count * sizeof(*names->misses));
+	names->bumped = malloc(count * sizeof(*names->bumped));
+
+	srand(count);
+	for(size_t i = 0; i < count; i++) {
+		const char * const prefix = prefixes[rand() % (sizeof(prefixes) / sizeof(*prefixes))];
+		const int major = rand() % 10, minor = rand() % 100, patch = rand() % 1000;
+		char name[128];
+		int length;
+
+		length = snprintf(name, sizeof(name), "%s%lx", prefix, (unsigned long)i * 2654435761u % 0xFFFFFFF);
+		names->geister[i] = atoms_intern(atoms, name, length);
+
+		length = snprintf(name, sizeof(name), "%s%lx-%d.%d.%d", prefix, (unsigned long)i * 2654435761u % 0xFFFFFFF, major, minor, patch);
+		names->packages[i] = atoms_intern(atoms, name, length);
+
+		length = snprintf(name, sizeof(name), "%s%lx-%d.%d.%d", prefix, (unsigned long)i * 2654435761u % 0xFFFFFFF, major, minor, patch + 1);
+		names->bumped[i] = atoms_intern(atoms, name, length);
+
+		length = snprintf(name, sizeof(name), "missing-%s%lx", prefix, (unsigned long)i);
+		names->misses[i] = atoms_intern(atoms, name, length);
+	}
+}
+
+static void
+bench_set_names_deinit(struct bench_set_names *names) {
+	free(names->geister);
+	free(names->packages);
+	free(names->misses);
+	free(names->bumped);
+}
+
+/* The packed array of the original set, for reference */
+static void
+bench_set_linear(const struct bench_set_names *names) {
+	const size_t count = names->count;
+	atom_t * const array = malloc(count * 2 * sizeof(*array));
+	volatile size_t found = 0;
+	size_t size = 0;
+	double begin;
+
+	begin = bench_set_now();
+	for(size_t i = 0; i < count; i++) {
+		size_t j = 0;
+
+		while(j != size && array[j] != names->geister[i]) {
+			j += 2;
+		}
+
+		if(j == size) {
+			array[size] = names->geister[i];
+			array[size + 1] = names->packages[i];
+			size += 2;
+		}
+	}
+	bench_set_report("linear insert", count, begin, count);
+
+	begin = bench_set_now();
+	for(size_t i = 0; i < count; i++) {
+		for(size_t j = 0; j != size; j += 2) {
+			if(array[j] == names->misses[i]) {
+				found++;
+				break;
+			}
+		}
+	}
+	bench_set_report("linear find miss", count, begin, count);
+
+	free(array);
+}
+
+static size_t
+bench_set_footprint(const struct set *set) {
+	return set->capacity * sizeof(*set->elements) + set->buckets * sizeof(*set->slots);
+}
+
+static void
+bench_set_run(size_t count) {
+	struct bench_set_names names;
+	struct state state;
+	struct set_iterator iterator;
+	struct set_element element;
+	volatile size_t found = 0;
+	double begin;
+
+	atoms_init(&state.atoms);
+	bench_set_names_init(&names, &state.atoms, count);
+
+	set_init(&state.current, &pair_set_class, &state.atoms);
+	set_init(&state.pending, &pair_set_class, &state.atoms);
+
+	begin = bench_set_now();
+	for(size_t i = 0; i < count; i++) {
+		const atom_t pair[] = { names.geister[i], names.packages[i] };
+		pair_set_insert(&state.current, pair);
+	}
+	bench_set_report("insert", count, begin, count);
+
+	begin = bench_set_now();
+	for(size_t i = 0; i < count; i++) {
+		found += pair_set_find(&state.current, names.geister + i, NULL);
+	}
+	bench_set_report("find hit", count, begin, count);
+
+	begin = bench_set_now();
+	for(size_t i = 0; i < count; i++) {
+		found += pair_set_find(&state.current, names.misses + i, NULL);
+	}
+	bench_set_report("find miss", count, begin, count);
+
+	begin = bench_set_now();
+	for(size_t i = 0; i < count; i++) {
+		found += set_find(&state.current, names.geister + i, NULL);
+	}
+	bench_set_report("find hit generic", count, begin, count);
+
+	begin = bench_set_now();
+	set_iterator_init(&iterator, &state.current);
+	while(pair_set_iterator_next(&iterator, &element)) {
+		found += element.keylength;
+	}
+	set_iterator_deinit(&iterator);
+	bench_set_report("iterate", count, begin, count);
+
+	/* Pending bumps 8% of packages, adds 2% of geister, and removes 2% of them */
+	for(size_t i = 0; i < count; i++) {
+		const unsigned int dice = i % 50;
+
+		if(dice == 0) {
+			const atom_t pair[] = { names.misses[i], names.packages[i] };
+			pair_set_insert(&state.pending, pair);
+		} else if(dice > 1) {
+			const atom_t pair[] = { names.geister[i], dice < 6 ? names.bumped[i] : names.packages[i] };
+			pair_set_insert(&state.pending, pair);
+		}
+	}
+
+	struct set newgeister, newpackages, oldgeister, oldpackages;
+
+	set_init(&newgeister, &pair_set_class, &state.atoms);
+	set_init(&newpackages, &string_set_class, &state.atoms);
+	set_init(&oldgeister, &pair_set_class, &state.atoms);
+	set_init(&oldpackages, &string_set_class, &state.atoms);
+
+	begin = bench_set_now();
+	state_diff(&state, &newgeister, &newpackages, &oldgeister, &oldpackages);
+	bench_set_report("state_diff", count, begin, count);
+
+	const size_t footprint = bench_set_footprint(&state.current) + bench_set_footprint(&state.pending)
+		+ state.atoms.capacity + state.atoms.buckets * sizeof(*state.atoms.slots);
+
+	set_deinit(&newgeister);
+	set_deinit(&newpackages);
+	set_deinit(&oldgeister);
+	set_deinit(&oldpackages);
+
+	begin = bench_set_now();
+	for(size_t i = 0; i < count; i++) {
+		found += pair_set_remove(&state.current, names.geister + i);
+	}
+	bench_set_report("remove", count, begin, count);
+
+	if(count <= BENCH_SET_LINEAR_MAX) {
+		bench_set_linear(&names);
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("%8lu %-20s %10lu KiB, peak RSS %lu KiB\n", count, "memory", footprint / 1024, usage.ru_maxrss);
+
+	set_deinit(&state.current);
+	set_deinit(&state.pending);
+
+	bench_set_names_deinit(&names);
+	atoms_deinit(&state.atoms);
+}
+
+int
+main(int argc, char **argv) {
+	static const size_t counts[] = { 1000, 10000, 100000, 1000000 };
+
+	for(size_t i = 0; i < sizeof(counts) / sizeof(*counts); i++) {
+		bench_set_run(counts[i]);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,597 @@
+/*
+	main.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "../update/digest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <lzma.h>
+
+/* Must match the source layout expected by update, see src/update/chunk.h */
+#define UPDATE_CHUNK_PACKAGES_DIRECTORY "packages"
+#define UPDATE_CHUNK_INDEXES_DIRECTORY  "indexes"
+#define UPDATE_CHUNK_CHUNKS_DIRECTORY   "chunks"
+
+/* Content-defined boundaries, a boundary is found where the gear hash
+ * has its top bits cleared, so ~64KiB chunks on average */
+#define UPDATE_CHUNK_SIZE_MIN  (16 << 10)
+#define UPDATE_CHUNK_SIZE_MAX  (256 << 10)
+#define UPDATE_CHUNK_MASK      0xFFFF000000000000ull
+#define UPDATE_CHUNK_GEAR_SEED 0x7570646174652d63ull
+
+/* Archive entries are grouped in a chunk until it holds at least UPDATE_CHUNK_ENTRIES_MIN
+ * bytes and the digest of an entry's name has its mask bits cleared, so boundaries only
+ * move where entries were added or removed, and a modified entry only changes its chunk */
+#define UPDATE_CHUNK_ENTRIES_MIN  (8 << 10)
+#define UPDATE_CHUNK_ENTRIES_MASK 0x01
+
+/* hny packages are xz compressed cpio archives, in the "new" ASCII format */
+#define UPDATE_CHUNK_CPIO_HEADER_SIZE 110
+#define UPDATE_CHUNK_CPIO_TRAILER     "TRAILER!!!"
+
+/* Compression of chunks, each is an independent xz block,
+ * so a dictionary larger than a chunk would only cost memory, to us and to update */
+#define UPDATE_CHUNK_XZ_PRESET 6
+#define UPDATE_CHUNK_XZ_CHECK  LZMA_CHECK_CRC64
+
+#define UPDATE_CHUNK_READ_SIZE (64 << 10)
+
+struct update_chunk_args {
+	const char *source;
+	int sourcefd, packagesfd, chunksfd, indexesfd;
+	uint64_t gear[256];
+	lzma_options_lzma options;
+	unsigned long long total, stored;
+};
+
+/*
+ * Package being chunked. Boundaries of a xz package are found in its decompressed
+ * archive, at its entries when it is a cpio archive, and each chunk is compressed
+ * again as an independent xz block, so unchanged entries give the same chunks,
+ * whatever changed around them. Once concatenated, chunks are a xz archive of the same
+ * contents, update extracts it as the package, which is left untouched for those
+ * downloading it whole. Other packages are cut as they are.
+ */
+struct update_chunk_package {
+	const char *name;
+	int fd;
+	bool isxz, isinputend, isend;
+	bool isarchive; /* Contents are still parsed as a cpio archive */
+
+	lzma_stream decoder, encoder;
+	uint8_t input[UPDATE_CHUNK_READ_SIZE];
+
+	uint8_t *window; /* UPDATE_CHUNK_SIZE_MAX bytes of contents */
+	size_t windowlength;
+	uint64_t offset; /* Of the window in the contents */
+	uint64_t entry;  /* Offset of the next archive entry in the contents */
+
+	uint8_t *output; /* Last compressed chunk */
+	size_t outputcapacity;
+
+	FILE *index;
+};
+
+enum update_chunk_cpio_status {
+	UPDATE_CHUNK_CPIO_ENTRY,
+	UPDATE_CHUNK_CPIO_INCOMPLETE, /* The header doesn't fit in the data */
+	UPDATE_CHUNK_CPIO_INVALID,
+};
+
+struct update_chunk_cpio_entry {
+	const uint8_t *name;
+	size_t namesize; /* Nul byte included */
+	uint64_t size;   /* Header, name, data and their paddings */
+};
+
+static void
+update_chunk_usage(const char *progname) {
+	fprintf(stderr, "usage: %s <source> [package...]\n", progname);
+	exit(EXIT_FAILURE);
+}
+
+/* The table must never change, or all boundaries would move, splitmix64 is enough */
+static void
+update_chunk_gear_init(uint64_t gear[256]) {
+	uint64_t seed = UPDATE_CHUNK_GEAR_SEED;
+
+	for(unsigned int i = 0; i < 256; i++) {
+		uint64_t value = (seed += 0x9E3779B97F4A7C15ull);
+
+		value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+		value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+		gear[i] = value ^ (value >> 31);
+	}
+}
+
+static size_t
+update_chunk_boundary(const uint64_t gear[256], const uint8_t *data, size_t length) {
+	if(length <= UPDATE_CHUNK_SIZE_MIN) {
+		return length;
+	}
+
+	const size_t end = length < UPDATE_CHUNK_SIZE_MAX ? length : UPDATE_CHUNK_SIZE_MAX;
+	uint64_t hash = 0;
+
+	for(size_t i = UPDATE_CHUNK_SIZE_MIN; i < end; i++) {
+		hash = (hash << 1) + gear[data[i]];
+		if((hash & UPDATE_CHUNK_MASK) == 0) {
+			return i + 1;
+		}
+	}
+
+	return end;
+}
+
+/* Hexadecimal fields of cpio headers are 8 digits */
+static bool
+update_chunk_cpio_field(const uint8_t *field, uint64_t *valuep) {
+	uint64_t value = 0;
+
+	for(unsigned int i = 0; i < 8; i++) {
+		const uint8_t c = field[i];
+
+		if(c >= '0' && c <= '9') {
+			value = value << 4 | (c - '0');
+		} else if(c >= 'A' && c <= 'F') {
+			value = value << 4 | (c - 'A' + 10);
+		} else if(c >= 'a' && c <= 'f') {
+			value = value << 4 | (c - 'a' + 10);
+		} else {
+			return false;
+		}
+	}
+
+	*valuep = value;
+
+	return true;
+}
+
+static enum update_chunk_cpio_status
+update_chunk_cpio_parse(const uint8_t *data, size_t length, struct update_chunk_cpio_entry *entry) {
+	uint64_t filesize, namesize;
+
+	if(length < UPDATE_CHUNK_CPIO_HEADER_SIZE) {
+		return UPDATE_CHUNK_CPIO_INCOMPLETE;
+	}
+
+	if((memcmp(data, "070701", 6) != 0 && memcmp(data, "070702", 6) != 0)
+		|| !update_chunk_cpio_field(data + 54, &filesize)
+		|| !update_chunk_cpio_field(data + 94, &namesize)
+		|| namesize == 0 || namesize > PATH_MAX) {
+		return UPDATE_CHUNK_CPIO_INVALID;
+	}
+
+	if(length < UPDATE_CHUNK_CPIO_HEADER_SIZE + namesize) {
+		return UPDATE_CHUNK_CPIO_INCOMPLETE;
+	}
+
+	/* Both the header with the name, and the data, are padded to 4 bytes */
+	entry->name = data + UPDATE_CHUNK_CPIO_HEADER_SIZE;
+	entry->namesize = namesize;
+	entry->size = ((UPDATE_CHUNK_CPIO_HEADER_SIZE + namesize + 3) & ~3ull) + ((filesize + 3) & ~3ull);
+
+	return UPDATE_CHUNK_CPIO_ENTRY;
+}
+
+static bool
+update_chunk_cpio_is_boundary(const struct update_chunk_cpio_entry *entry) {
+	uint8_t result[DIGEST_SIZE];
+	struct digest digest;
+
+	digest_init(&digest);
+	digest_update(&digest, entry->name, entry->namesize);
+	digest_final(&digest, result);
+
+	return (*result & UPDATE_CHUNK_ENTRIES_MASK) == 0;
+}
+
+/* Size of the next chunk, at the start of the window. Entries of a cpio archive are kept whole,
+ * unless larger than a chunk, then they are cut like any contents, up to their end */
+static size_t
+update_chunk_package_boundary(const struct update_chunk_args *args, struct update_chunk_package *package) {
+	const uint8_t * const window = package->window;
+	const size_t length = package->windowlength;
+	size_t end = 0;
+
+	while(package->isarchive) {
+		if(package->entry > package->offset + end) {
+			const uint64_t left = package->entry - package->offset;
+			return update_chunk_boundary(args->gear, window, left < length ? left : length);
+		}
+
+		struct update_chunk_cpio_entry entry;
+		switch(update_chunk_cpio_parse(window + end, length - end, &entry)) {
+		case UPDATE_CHUNK_CPIO_ENTRY:
+			if(end + entry.size > UPDATE_CHUNK_SIZE_MAX) {
+				if(end != 0) {
+					return end;
+				}
+				package->entry = package->offset + entry.size;
+				continue;
+			}
+
+			/* The archive is truncated, its end is cut as any contents */
+			if(end + entry.size > length) {
+				package->isarchive = false;
+				break;
+			}
+
+			end += entry.size;
+			package->entry = package->offset + end;
+
+			/* The trailer may be followed by padding, cut as any contents */
+			if(entry.namesize == sizeof(UPDATE_CHUNK_CPIO_TRAILER)
+				&& memcmp(entry.name, UPDATE_CHUNK_CPIO_TRAILER, sizeof(UPDATE_CHUNK_CPIO_TRAILER)) == 0) {
+				package->isarchive = false;
+				return end;
+			}
+
+			if(end >= UPDATE_CHUNK_ENTRIES_MIN && update_chunk_cpio_is_boundary(&entry)) {
+				return end;
+			}
+			break;
+		case UPDATE_CHUNK_CPIO_INCOMPLETE:
+			/* The next chunk starts with the header, unless we're at the end of the contents */
+			if(end != 0) {
+				return end;
+			}
+			package->isarchive = false;
+			break;
+		case UPDATE_CHUNK_CPIO_INVALID:
+			package->isarchive = false;
+			break;
+		}
+	}
+
+	if(end != 0) {
+		return end;
+	}
+
+	return update_chunk_boundary(args->gear, window, length);
+}
+
+static bool
+update_chunk_write(int fd, const uint8_t *data, size_t length) {
+	while(length != 0) {
+		const ssize_t writeval = write(fd, data, length);
+
+		if(writeval < 0) {
+			return false;
+		}
+
+		data += writeval;
+		length -= writeval;
+	}
+
+	return true;
+}
+
+/* Chunks already present are shared with previous packages, others are written atomically */
+static void
+update_chunk_store(struct update_chunk_args *args, const char *digeststring, const uint8_t *data, size_t length) {
+	struct stat st;
+
+	if(fstatat(args->chunksfd, digeststring, &st, 0) == 0 && (size_t)st.st_size == length) {
+		return;
+	}
+
+	char temporary[DIGEST_STRING_SIZE + 16];
+	snprintf(temporary, sizeof(temporary), ".%s.%d", digeststring, getpid());
+
+	const int fd = openat(args->chunksfd, temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+		perror("openat chunk");
+		exit(EXIT_FAILURE);
+	}
+
+	if(!update_chunk_write(fd, data, length) || close(fd) != 0
+		|| renameat(args->chunksfd, temporary, args->chunksfd, digeststring) != 0) {
+		perror("write chunk");
+		unlinkat(args->chunksfd, temporary, 0);
+		exit(EXIT_FAILURE);
+	}
+
+	args->stored += length;
+}
+
+/* xz archives start with their stream header magic bytes */
+static bool
+update_chunk_is_xz(int fd) {
+	static const uint8_t magic[] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
+	uint8_t header[sizeof(magic)];
+
+	return pread(fd, header, sizeof(header), 0) == sizeof(header)
+		&& memcmp(header, magic, sizeof(magic)) == 0;
+}
+
+/* Reads up to length bytes of the package contents, less only once all were read */
+static size_t
+update_chunk_read(struct update_chunk_package *package, uint8_t *data, size_t length) {
+	size_t count = 0;
+
+	if(!package->isxz) {
+		ssize_t readval = 0;
+
+		while(count != length && (readval = read(package->fd, data + count, length - count)) > 0) {
+			count += readval;
+		}
+
+		if(readval < 0) {
+			fprintf(stderr, "Unable to read package %s: %s\n", package->name, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		return count;
+	}
+
+	lzma_stream * const decoder = &package->decoder;
+
+	decoder->next_out = data;
+	decoder->avail_out = length;
+
+	while(!package->isend && decoder->avail_out != 0) {
+		if(decoder->avail_in == 0 && !package->isinputend) {
+			const ssize_t readval = read(package->fd, package->input, sizeof(package->input));
+
+			if(readval < 0) {
+				fprintf(stderr, "Unable to read package %s: %s\n", package->name, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+
+			package->isinputend = readval == 0;
+			decoder->next_in = package->input;
+			decoder->avail_in = readval;
+		}
+
+		const lzma_ret ret = lzma_code(decoder, package->isinputend ? LZMA_FINISH : LZMA_RUN);
+
+		if(ret == LZMA_STREAM_END) {
+			package->isend = true;
+		} else if(ret != LZMA_OK) {
+			fprintf(stderr, "Unable to decompress package %s: liblzma error %d\n", package->name, ret);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return length - decoder->avail_out;
+}
+
+/* Compresses data in the output buffer, the action flushes, or finishes, the stream, returns the output length */
+static size_t
+update_chunk_compress(struct update_chunk_package *package, const uint8_t *data, size_t length, lzma_action action) {
+	lzma_stream * const encoder = &package->encoder;
+	const uint64_t start = encoder->total_out;
+	lzma_ret ret;
+
+	encoder->next_in = data;
+	encoder->avail_in = length;
+
+	do {
+		const size_t compressed = encoder->total_out - start;
+
+		if(compressed == package->outputcapacity) {
+			package->outputcapacity *= 2;
+			package->output = realloc(package->output, package->outputcapacity);
+			if(package->output == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		encoder->next_out = package->output + compressed;
+		encoder->avail_out = package->outputcapacity - compressed;
+
+		ret = lzma_code(encoder, action);
+	} while(ret == LZMA_OK);
+
+	if(ret != LZMA_STREAM_END) {
+		fprintf(stderr, "Unable to compress package %s: liblzma error %d\n", package->name, ret);
+		exit(EXIT_FAILURE);
+	}
+
+	return encoder->total_out - start;
+}
+
+static void
+update_chunk_emit(struct update_chunk_args *args, struct update_chunk_package *package, const uint8_t *data, size_t length) {
+	uint8_t result[DIGEST_SIZE];
+	char digeststring[DIGEST_STRING_SIZE];
+	struct digest digest;
+
+	digest_init(&digest);
+	digest_update(&digest, data, length);
+	digest_final(&digest, result);
+	digest_string(result, digeststring);
+
+	update_chunk_store(args, digeststring, data, length);
+	fprintf(package->index, "%s %zu\n", digeststring, length);
+
+	args->total += length;
+}
+
+static FILE *
+update_chunk_temporary(int dirfd, const char *name, char temporary[static NAME_MAX + 1]) {
+	snprintf(temporary, NAME_MAX + 1, ".%.200s.%d", name, getpid());
+
+	const int fd = openat(dirfd, temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	FILE * const filep = fd >= 0 ? fdopen(fd, "w") : NULL;
+
+	if(filep == NULL) {
+		perror("openat");
+		exit(EXIT_FAILURE);
+	}
+
+	return filep;
+}
+
+static void
+update_chunk_package(struct update_chunk_args *args, const char *name) {
+	struct update_chunk_package package = {
+		.name = name,
+		.fd = openat(args->packagesfd, name, O_RDONLY),
+		.decoder = LZMA_STREAM_INIT,
+		.encoder = LZMA_STREAM_INIT,
+		.window = malloc(UPDATE_CHUNK_SIZE_MAX),
+		.outputcapacity = UPDATE_CHUNK_SIZE_MAX,
+		.output = malloc(UPDATE_CHUNK_SIZE_MAX),
+	};
+	char temporary[NAME_MAX + 1];
+
+	if(package.fd < 0) {
+		fprintf(stderr, "Unable to open package %s/" UPDATE_CHUNK_PACKAGES_DIRECTORY "/%s\n", args->source, name);
+		exit(EXIT_FAILURE);
+	}
+
+	if(package.window == NULL || package.output == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	package.isxz = update_chunk_is_xz(package.fd);
+	if(package.isxz) {
+		const lzma_filter filters[] = {
+			{ .id = LZMA_FILTER_LZMA2, .options = &args->options },
+			{ .id = LZMA_VLI_UNKNOWN },
+		};
+
+		if(lzma_stream_decoder(&package.decoder, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK
+			|| lzma_stream_encoder(&package.encoder, filters, UPDATE_CHUNK_XZ_CHECK) != LZMA_OK) {
+			fprintf(stderr, "Unable to initialize liblzma for package %s\n", name);
+			exit(EXIT_FAILURE);
+		}
+
+		package.isarchive = true;
+	} else {
+		fprintf(stderr, "Package %s is not a xz archive, chunking it as is\n", name);
+	}
+
+	package.index = update_chunk_temporary(args->indexesfd, name, temporary);
+
+	for(;;) {
+		package.windowlength += update_chunk_read(&package, package.window + package.windowlength, UPDATE_CHUNK_SIZE_MAX - package.windowlength);
+		if(package.windowlength == 0) {
+			break;
+		}
+
+		const size_t size = update_chunk_package_boundary(args, &package);
+
+		if(package.isxz) {
+			const size_t length = update_chunk_compress(&package, package.window, size, LZMA_FULL_FLUSH);
+			update_chunk_emit(args, &package, package.output, length);
+		} else {
+			update_chunk_emit(args, &package, package.window, size);
+		}
+
+		package.offset += size;
+		package.windowlength -= size;
+		memmove(package.window, package.window + size, package.windowlength);
+	}
+
+	close(package.fd);
+
+	/* The xz index and stream footer list all blocks, they change with any of them, so they are a chunk of their own */
+	if(package.isxz) {
+		const size_t length = update_chunk_compress(&package, NULL, 0, LZMA_FINISH);
+		update_chunk_emit(args, &package, package.output, length);
+
+		lzma_end(&package.decoder);
+		lzma_end(&package.encoder);
+	}
+
+	free(package.window);
+	free(package.output);
+
+	/* The index is renamed last, update never sees an index referencing missing chunks */
+	if(fclose(package.index) != 0 || renameat(args->indexesfd, temporary, args->indexesfd, name) != 0) {
+		perror("write index");
+		unlinkat(args->indexesfd, temporary, 0);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static int
+update_chunk_directory(int dirfd, const char *name) {
+	if(mkdirat(dirfd, name, 0755) != 0 && errno != EEXIST) {
+		perror("mkdirat");
+		exit(EXIT_FAILURE);
+	}
+
+	const int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+	if(fd < 0) {
+		perror("openat");
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+int
+main(int argc, char **argv) {
+	struct update_chunk_args args = { .source = argv[1] };
+
+	if(argc < 2) {
+		update_chunk_usage(*argv);
+	}
+
+	args.sourcefd = open(args.source, O_RDONLY | O_DIRECTORY);
+	if(args.sourcefd < 0) {
+		perror(args.source);
+		return EXIT_FAILURE;
+	}
+
+	args.packagesfd = openat(args.sourcefd, UPDATE_CHUNK_PACKAGES_DIRECTORY, O_RDONLY | O_DIRECTORY);
+	if(args.packagesfd < 0) {
+		perror(UPDATE_CHUNK_PACKAGES_DIRECTORY);
+		return EXIT_FAILURE;
+	}
+
+	args.chunksfd = update_chunk_directory(args.sourcefd, UPDATE_CHUNK_CHUNKS_DIRECTORY);
+	args.indexesfd = update_chunk_directory(args.sourcefd, UPDATE_CHUNK_INDEXES_DIRECTORY);
+	update_chunk_gear_init(args.gear);
+
+	if(lzma_lzma_preset(&args.options, UPDATE_CHUNK_XZ_PRESET)) {
+		fprintf(stderr, "Unable to use xz preset %d\n", UPDATE_CHUNK_XZ_PRESET);
+		return EXIT_FAILURE;
+	}
+	args.options.dict_size = UPDATE_CHUNK_SIZE_MAX;
+
+	/* Without explicit packages, all packages of the source are chunked */
+	if(argc > 2) {
+		for(int i = 2; i < argc; i++) {
+			update_chunk_package(&args, argv[i]);
+		}
+	} else {
+		DIR * const dirp = fdopendir(dup(args.packagesfd));
+		struct dirent *entry;
+
+		if(dirp == NULL) {
+			perror("fdopendir");
+			return EXIT_FAILURE;
+		}
+
+		while((entry = readdir(dirp)) != NULL) {
+			if(*entry->d_name != '.') {
+				update_chunk_package(&args, entry->d_name);
+			}
+		}
+
+		closedir(dirp);
+	}
+
+	printf("Chunked %llu bytes, stored %llu bytes of new chunks\n", args.total, args.stored);
+
+	return EXIT_SUCCESS;
+}
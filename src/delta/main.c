@@ -0,0 +1,292 @@
+/*
+	main.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "../update/digest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <hny.h>
+
+/* Must match the source layout expected by update, see src/update/delta.h */
+#define UPDATE_DELTA_SNAPSHOT_FILE "snapshot"
+#define UPDATE_DELTA_DIRECTORY     "deltas"
+
+struct update_delta_entry {
+	const char *geist, *package;
+};
+
+/* A snapshot file, and its entries sorted by geist */
+struct update_delta_snapshot {
+	const char *path;
+	char *data;
+	size_t count;
+	struct update_delta_entry *entries;
+	uint8_t digest[DIGEST_SIZE];          /* Of the file as is */
+	uint8_t canonicaldigest[DIGEST_SIZE]; /* Of the file as update writes it */
+};
+
+/* Growable text of a delta */
+struct update_delta_text {
+	char *data;
+	size_t length, capacity;
+};
+
+static void
+update_delta_usage(const char *progname) {
+	fprintf(stderr, "usage: %s <source> <previous snapshot>...\n", progname);
+	exit(EXIT_FAILURE);
+}
+
+static int
+update_delta_entry_compare(const void *lhs, const void *rhs) {
+	return strcmp(((const struct update_delta_entry *)lhs)->geist, ((const struct update_delta_entry *)rhs)->geist);
+}
+
+static char *
+update_delta_read(int dirfd, const char *path, size_t *sizep) {
+	const int fd = openat(dirfd, path, O_RDONLY);
+	struct stat st;
+
+	if(fd < 0 || fstat(fd, &st) != 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	char * const data = malloc(st.st_size + 1);
+	size_t length = 0;
+	ssize_t readval;
+
+	const size_t size = st.st_size;
+
+	while(data != NULL && length < size && (readval = read(fd, data + length, size - length)) > 0) {
+		length += readval;
+	}
+	close(fd);
+
+	if(data == NULL || length != size) {
+		fprintf(stderr, "Unable to read %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	data[length] = '\0';
+	*sizep = length;
+
+	return data;
+}
+
+/* Same grammar as update: a geist line, its package line, then package lines which are ignored */
+static void
+update_delta_snapshot_load(struct update_delta_snapshot *snapshot, int dirfd, const char *path) {
+	size_t size, capacity = 0, lineno = 0;
+	struct digest digest;
+
+	*snapshot = (struct update_delta_snapshot) { .path = path };
+	snapshot->data = update_delta_read(dirfd, path, &size);
+
+	digest_init(&digest);
+	digest_update(&digest, snapshot->data, size);
+	digest_final(&digest, snapshot->digest);
+
+	if(memchr(snapshot->data, '\0', size) != NULL) {
+		fprintf(stderr, "Ill formed snapshot %s contains zero byte\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	struct update_delta_entry *entry = NULL;
+	char *line = snapshot->data;
+	while(*line != '\0') {
+		char * const newline = strchr(line, '\n');
+		const enum hny_type type = newline != NULL ? (*newline = '\0', hny_type_of(line)) : hny_type_of(line);
+
+		lineno++;
+
+		if(type == HNY_TYPE_GEIST && (entry == NULL || entry->package != NULL)) {
+			if(snapshot->count == capacity) {
+				capacity = capacity == 0 ? 1024 : capacity * 2;
+				snapshot->entries = realloc(snapshot->entries, capacity * sizeof(*snapshot->entries));
+				if(snapshot->entries == NULL) {
+					perror("realloc");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			entry = snapshot->entries + snapshot->count++;
+			*entry = (struct update_delta_entry) { .geist = line };
+		} else if(type == HNY_TYPE_PACKAGE && entry != NULL) {
+			if(entry->package == NULL) {
+				entry->package = line;
+			}
+		} else {
+			fprintf(stderr, "Ill formed snapshot %s at line %zu\n", path, lineno);
+			exit(EXIT_FAILURE);
+		}
+
+		line = newline != NULL ? newline + 1 : line + strlen(line);
+	}
+
+	if(entry != NULL && entry->package == NULL) {
+		fprintf(stderr, "Ill formed snapshot %s, last geist has no package\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	qsort(snapshot->entries, snapshot->count, sizeof(*snapshot->entries), update_delta_entry_compare);
+
+	digest_init(&digest);
+	for(size_t i = 0; i < snapshot->count; i++) {
+		if(i != 0 && strcmp(snapshot->entries[i - 1].geist, snapshot->entries[i].geist) == 0) {
+			fprintf(stderr, "Ill formed snapshot %s redundant geist %s\n", path, snapshot->entries[i].geist);
+			exit(EXIT_FAILURE);
+		}
+
+		digest_update(&digest, snapshot->entries[i].geist, strlen(snapshot->entries[i].geist));
+		digest_update(&digest, "\n", 1);
+		digest_update(&digest, snapshot->entries[i].package, strlen(snapshot->entries[i].package));
+		digest_update(&digest, "\n", 1);
+	}
+	digest_final(&digest, snapshot->canonicaldigest);
+}
+
+static void
+update_delta_text_append(struct update_delta_text *text, const char *prefix, const char *geist, const char *package) {
+	const size_t length = strlen(prefix) + strlen(geist) + (package != NULL ? strlen(package) + 1 : 0) + 1;
+
+	if(text->length + length + 1 > text->capacity) {
+		text->capacity = text->capacity == 0 ? 65536 : text->capacity;
+		while(text->length + length + 1 > text->capacity) {
+			text->capacity *= 2;
+		}
+
+		text->data = realloc(text->data, text->capacity);
+		if(text->data == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	text->length += package != NULL
+		? sprintf(text->data + text->length, "%s%s %s\n", prefix, geist, package)
+		: sprintf(text->data + text->length, "%s%s\n", prefix, geist);
+}
+
+/* Merge of both sorted snapshots, as state_diff does on geister */
+static void
+update_delta_diff(const struct update_delta_snapshot *previous, const struct update_delta_snapshot *snapshot, struct update_delta_text *text) {
+	size_t i = 0, j = 0;
+
+	while(i != previous->count || j != snapshot->count) {
+		const int comparison = i == previous->count ? 1 : j == snapshot->count ? -1
+			: strcmp(previous->entries[i].geist, snapshot->entries[j].geist);
+
+		if(comparison < 0) {
+			update_delta_text_append(text, "- ", previous->entries[i].geist, NULL);
+			i++;
+		} else if(comparison > 0) {
+			update_delta_text_append(text, "+ ", snapshot->entries[j].geist, snapshot->entries[j].package);
+			j++;
+		} else {
+			if(strcmp(previous->entries[i].package, snapshot->entries[j].package) != 0) {
+				update_delta_text_append(text, "+ ", snapshot->entries[j].geist, snapshot->entries[j].package);
+			}
+			i++, j++;
+		}
+	}
+}
+
+static bool
+update_delta_write(int fd, const char *data, size_t length) {
+	while(length != 0) {
+		const ssize_t writeval = write(fd, data, length);
+
+		if(writeval < 0) {
+			return false;
+		}
+
+		data += writeval;
+		length -= writeval;
+	}
+
+	return true;
+}
+
+/* Written aside then renamed, update never receives a partial delta */
+static void
+update_delta_store(int deltasfd, const uint8_t base[DIGEST_SIZE], const uint8_t result[DIGEST_SIZE], const struct update_delta_text *text) {
+	char basestring[DIGEST_STRING_SIZE], resultstring[DIGEST_STRING_SIZE], temporary[DIGEST_STRING_SIZE + 16];
+	char header[2 * DIGEST_STRING_SIZE + 1];
+
+	digest_string(base, basestring);
+	digest_string(result, resultstring);
+	snprintf(header, sizeof(header), "%s %s\n", basestring, resultstring);
+	snprintf(temporary, sizeof(temporary), ".%s.%d", basestring, getpid());
+
+	const int fd = openat(deltasfd, temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || !update_delta_write(fd, header, strlen(header)) || !update_delta_write(fd, text->data, text->length)
+		|| close(fd) != 0 || renameat(deltasfd, temporary, deltasfd, basestring) != 0) {
+		perror("write delta");
+		unlinkat(deltasfd, temporary, 0);
+		exit(EXIT_FAILURE);
+	}
+}
+
+int
+main(int argc, char **argv) {
+	struct update_delta_snapshot snapshot;
+
+	if(argc < 3) {
+		update_delta_usage(*argv);
+	}
+
+	const int sourcefd = open(argv[1], O_RDONLY | O_DIRECTORY);
+	if(sourcefd < 0) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	if(mkdirat(sourcefd, UPDATE_DELTA_DIRECTORY, 0755) != 0 && errno != EEXIST) {
+		perror("mkdirat");
+		return EXIT_FAILURE;
+	}
+
+	const int deltasfd = openat(sourcefd, UPDATE_DELTA_DIRECTORY, O_RDONLY | O_DIRECTORY);
+	if(deltasfd < 0) {
+		perror(UPDATE_DELTA_DIRECTORY);
+		return EXIT_FAILURE;
+	}
+
+	update_delta_snapshot_load(&snapshot, sourcefd, UPDATE_DELTA_SNAPSHOT_FILE);
+
+	for(int i = 2; i < argc; i++) {
+		struct update_delta_snapshot previous;
+		struct update_delta_text text = { .data = NULL };
+
+		update_delta_snapshot_load(&previous, AT_FDCWD, argv[i]);
+		update_delta_diff(&previous, &snapshot, &text);
+
+		/* Clients hold the previous snapshot as it was served if they fetched it whole,
+		 * or in canonical form if they built it from a delta, both are provided.
+		 * The resulting snapshot is always the canonical form, as written by update. */
+		update_delta_store(deltasfd, previous.canonicaldigest, snapshot.canonicaldigest, &text);
+		if(memcmp(previous.digest, previous.canonicaldigest, DIGEST_SIZE) != 0) {
+			update_delta_store(deltasfd, previous.digest, snapshot.canonicaldigest, &text);
+		}
+
+		printf("Delta from %s: %zu bytes\n", argv[i], text.length);
+
+		free(text.data);
+		free(previous.entries);
+		free(previous.data);
+	}
+
+	return EXIT_SUCCESS;
+}
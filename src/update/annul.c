@@ -6,12 +6,16 @@
 	subject the BSD 3-Clause License, see LICENSE
 */
 #include "annul.h"
+#include "batch.h"
+#include "hooks.h"
+#include "journal.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/wait.h>
+#include <fcntl.h>
 #include <syslog.h>
+#include <errno.h>
 
 #include <hny.h>
 
@@ -25,43 +29,34 @@ annul_pending(struct state *state) {
 	}
 
 	set_empty(&state->pending);
+	journal_remove(state);
 
 	if(state->shouldexit) {
 		exit(EXIT_SUCCESS);
 	}
 }
 
-static void
-annul_new_geister_spawn(struct state *state, const char *geist, const char *path) {
-	const char * const step = path + 4; /* path + 4 because strlen("hny/") == 4 */
-	int wstatus;
-	pid_t pid;
+/* Shifts back previous geister, unlinks new ones */
+static bool
+annul_new_geister_shift(struct state *state, const struct hooks_task *task) {
 
-	/* If an error happens here, note no process was forked in hny_spawn. */
-	const int errcode = hny_spawn(state->hny, geist, path, &pid);
-	if(errcode != 0) {
-		syslog(LOG_ERR, "annul_new_geister: Unable to spawn %s for %s: %s", step, geist, strerror(errcode));
-		exit(EXIT_FAILURE);
-	}
-
-	if(waitpid(pid, &wstatus, 0) != pid) {
-		syslog(LOG_ERR, "annul_new_geister: waitpid failed at %s for %s: %m", step, geist);
-		exit(EXIT_FAILURE);
-	}
+	if(task->package != NULL) {
+		const int errcode = hny_shift(state->hny, task->geist, task->package);
 
-	if(WIFSIGNALED(wstatus)) {
-		syslog(LOG_ERR, "annul_new_geister: Spawned %s for %s was ended with a signal: %s", step, geist, strsignal(WTERMSIG(wstatus)));
-		exit(EXIT_FAILURE);
-	}
-
-	if(WIFEXITED(wstatus)) {
-		const int status = WEXITSTATUS(wstatus);
-
-		if(status != 0) {
-			syslog(LOG_ERR, "annul_new_geister: Spawned %s for %s exited with code %d", step, geist, status);
-			exit(EXIT_FAILURE);
+		if(errcode != 0) {
+			syslog(LOG_ERR, "annul_new_geister: Unable to shift %s to %s: %s", task->geist, task->package, strerror(errcode));
+			return false;
+		}
+	} else {
+		/* If it was a new geist, we will only unlink the geist, not remove its content.
+		 * The geist may not have been linked yet, if the fetch packages step didn't finish */
+		if(unlinkat(state->prefixfd, task->geist, 0) != 0 && errno != ENOENT) {
+			syslog(LOG_ERR, "annul_new_geister: Unable to unlink %s: %m", task->geist);
+			return false;
 		}
 	}
+
+	return true;
 }
 
 /*
@@ -74,71 +69,60 @@ annul_new_geister_spawn(struct state *state, const char *geist, const char *path
 void
 annul_new_geister(struct state *state, const struct set *newgeister, const struct set *newpackages) {
 	struct set_iterator newgeisteriterator;
+	struct set_element element;
+	struct batch packages;
+	struct hooks hooks;
+
+	/* The package can possibly not be present, if the fetch package
+	 * step didn't finish correctly, new ones are all looked up at once */
+	batch_init(&packages, state->prefixfd, "annul_new_geister");
+	set_iterator_init(&newgeisteriterator, newgeister);
+	while(set_iterator_next(&newgeisteriterator, &element)) {
+		if(set_find(newpackages, element.record + 1, NULL)) {
+			batch_stat(&packages, element.value, AT_SYMLINK_NOFOLLOW);
+		}
+	}
+	set_iterator_deinit(&newgeisteriterator);
+
+	batch_flush(&packages);
 
+	hooks_init(&hooks, state, "annul_new_geister", annul_new_geister_shift);
 	set_iterator_init(&newgeisteriterator, newgeister);
 
-	const void *element;
-	size_t elementsize;
-	while(!state->shouldexit && set_iterator_next(&newgeisteriterator, &element, &elementsize)) {
-		const size_t geistlength = strlen(element);
-		const char * const geist = element;
-		const char * const package = geist + geistlength + 1;
-		const bool isnewpackage = set_find(newpackages, package, NULL);
-		int errcode;
+	size_t index = 0;
+	while(set_iterator_next(&newgeisteriterator, &element)) {
+		const char * const package = element.value;
+		const bool isnewpackage = set_find(newpackages, element.record + 1, NULL);
+		const atom_t *oldelement;
+		const bool isoldgeist = set_find(&state->current, element.record, &oldelement);
+		struct hooks_task task = {
+			.geist = element.key,
+			.geistatom = element.record[0],
+			.packages = { element.record[1], isoldgeist ? oldelement[1] : ATOM_NONE },
+		};
 
 		/* Clean new package */
-		if(isnewpackage) {
-			/* The package can possibly not be present, if the fetch package
-			 * step didn't finish correctly */
-			const char * const prefixpath = hny_path(state->hny);
-			const size_t prefixpathlength = strlen(prefixpath);
-			const size_t packagelength = strlen(package);
-			char path[prefixpathlength + packagelength + 2]; /* One for the /, another for the terminating nul */
-
-			strncpy(path, prefixpath, prefixpathlength);
-			path[prefixpathlength] = '/';
-			strncpy(path + prefixpathlength + 1, package, packagelength + 1);
-
-			if(access(path, F_OK) == 0) {
-				/* Use package because the geist could have been removed while shifting */
-				annul_new_geister_spawn(state, package, "hny/clean");
-			}
+		if(isnewpackage && batch_errcode(&packages, index++) == 0) {
+			/* Use package because the geist could have been removed while shifting */
+			task.cleaned = package;
 		}
 
-		if(set_find(&state->current, geist, &element)) {
+		if(isoldgeist) {
 			/* If it was a previous geist, shift it back, and setup the old package */
-			const char * const oldpackage = (const char *)element + geistlength + 1;
-
-			errcode = hny_shift(state->hny, geist, oldpackage);
-			if(errcode != 0) {
-				syslog(LOG_ERR, "annul_new_geister: Unable to shift %s to %s: %s", geist, oldpackage, strerror(errcode));
-				exit(EXIT_FAILURE);
-			}
-
-			if(isnewpackage) {
-				annul_new_geister_spawn(state, geist, "hny/setup");
-			}
-		} else {
-			/* If it was a new geist, we will only unlink the geist, not remove its content. */
-			const char * const prefixpath = hny_path(state->hny);
-			const size_t prefixpathlength = strlen(prefixpath);
-			char path[prefixpathlength + geistlength + 2]; /* One for the /, another for the terminating nul */
-
-			strncpy(path, prefixpath, prefixpathlength);
-			path[prefixpathlength] = '/';
-			strncpy(path + prefixpathlength + 1, geist, geistlength + 1);
-
-			if(unlink(path) != 0) {
-				syslog(LOG_ERR, "annul_new_geister: Unable to unlink %s: %m", geist);
-				exit(EXIT_FAILURE);
-			}
+			task.package = atoms_string(&state->atoms, oldelement[1]);
+			task.issetup = isnewpackage;
 		}
+
+		hooks_add(&hooks, &task);
 	}
 
 	set_iterator_deinit(&newgeisteriterator);
+	batch_deinit(&packages);
+
+	hooks_run(&hooks);
+	hooks_deinit(&hooks);
 
 	if(state->shouldexit) {
 		exit(EXIT_SUCCESS);
 	}
 }
-
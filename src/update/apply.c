@@ -6,49 +6,36 @@
 	subject the BSD 3-Clause License, see LICENSE
 */
 #include "apply.h"
+#include "batch.h"
+#include "check.h"
+#include "hooks.h"
+#include "journal.h"
+#include "index.h"
+#include "reuse.h"
+#include "spool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <dirent.h>
-#include <sys/wait.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <syslog.h>
 #include <errno.h>
 
 #include <hny.h>
 
-static void
-apply_new_geister_spawn(struct state *state, const char *geist, const char *path) {
-	const char * const step = path + 4; /* path + 4 because strlen("hny/") == 4 */
-	int wstatus;
-	pid_t pid;
+static bool
+apply_new_geister_shift(struct state *state, const struct hooks_task *task) {
+	const int errcode = hny_shift(state->hny, task->geist, task->package);
 
-	/* If an error happens here, note no process was forked in hny_spawn. */
-	const int errcode = hny_spawn(state->hny, geist, path, &pid);
 	if(errcode != 0) {
-		syslog(LOG_ERR, "apply_new_geister: Unable to spawn %s for %s: %s", step, geist, strerror(errcode));
-		exit(EXIT_FAILURE);
-	}
-
-	if(waitpid(pid, &wstatus, 0) != pid) {
-		syslog(LOG_ERR, "apply_new_geister: waitpid failed at %s for %s: %m", step, geist);
-		exit(EXIT_FAILURE);
+		syslog(LOG_ERR, "apply_new_geister: Unable to shift %s to %s: %s", task->geist, task->package, strerror(errcode));
+		return false;
 	}
 
-	if(WIFSIGNALED(wstatus)) {
-		syslog(LOG_ERR, "apply_new_geister: Spawned %s for %s was ended with a signal: %s", step, geist, strsignal(WTERMSIG(wstatus)));
-		exit(EXIT_FAILURE);
-	}
-
-	if(WIFEXITED(wstatus)) {
-		const int status = WEXITSTATUS(wstatus);
-
-		if(status != 0) {
-			syslog(LOG_ERR, "apply_new_geister: Spawned %s for %s exited with code %d", step, geist, status);
-			exit(EXIT_FAILURE);
-		}
-	}
+	return true;
 }
 
 /*
@@ -57,49 +44,77 @@ apply_new_geister_spawn(struct state *state, const char *geist, const char *path
  * - Previous geist installing an old package: Shift the geist, don't touch the package.
  * - New geist installing a new package: Shift the geist, setup the new.
  * - New geist installing an old package: Shift the geist, don't touch the package.
+ * When resuming, geister in completed are skipped, those already shifted are only setup.
  */
-void
-apply_new_geister(struct state *state, const struct set *newgeister, const struct set *newpackages) {
+static void
+apply_new_geister_tasks(struct state *state, const struct set *newgeister, const struct set *newpackages, const struct set *completed) {
 	struct set_iterator newgeisteriterator;
+	struct journal journal;
+	struct hooks hooks;
+	struct set shifted;
 
-	set_iterator_init(&newgeisteriterator, newgeister);
+	set_init(&shifted, &string_set_class, &state->atoms);
+	if(completed != NULL) {
+		check_shifted_geister(state, newgeister, &shifted);
+	}
 
-	const void *element;
-	size_t elementsize;
-	while(!state->shouldexit && set_iterator_next(&newgeisteriterator, &element, &elementsize)) {
-		/* This section is critical, if the geist is not shifted correctly, this is the only case where this process
-		 * could not recover at all, SIGTERM (and optionnaly SIGINT) are modified to handle a state flag notifying
-		 * us to exit as soon as possible */
-		const char * const geist = element;
-		const char * const package = geist + strlen(geist) + 1;
-		const bool isnewpackage = set_find(newpackages, package, NULL);
-		int errcode;
-
-		/* Cleaning the previous package if we're an old geist installing a new package */
-		if(isnewpackage && set_find(&state->current, geist, NULL)) {
-			apply_new_geister_spawn(state, geist, "hny/clean");
-		}
+	hooks_init(&hooks, state, "apply_new_geister", apply_new_geister_shift);
+	set_iterator_init(&newgeisteriterator, newgeister);
 
-		/* Shift it in any case */
-		errcode = hny_shift(state->hny, geist, package);
-		if(errcode != 0) {
-			syslog(LOG_ERR, "apply_new_geister: Unable to shift %s to %s: %s", geist, package, strerror(errcode));
-			exit(EXIT_FAILURE);
+	struct set_element element;
+	while(set_iterator_next(&newgeisteriterator, &element)) {
+		if(completed != NULL && set_find(completed, element.record, NULL)) {
+			continue;
 		}
 
-		/* Setup the geist if we are a new package */
-		if(isnewpackage) {
-			apply_new_geister_spawn(state, geist, "hny/setup");
-		}
+		const bool isnewpackage = set_find(newpackages, element.record + 1, NULL);
+		const atom_t *oldelement;
+		const bool isoldgeist = set_find(&state->current, element.record, &oldelement);
+		const struct hooks_task task = {
+			.geist = element.key,
+			.geistatom = element.record[0],
+			/* Cleaning the previous package if we're an old geist installing a new package */
+			.cleaned = isnewpackage && isoldgeist ? element.key : NULL,
+			/* Shift it in any case */
+			.package = element.value,
+			/* Setup the geist if we are a new package */
+			.issetup = isnewpackage,
+			.isshifted = set_find(&shifted, element.record, NULL),
+			.packages = { element.record[1], isoldgeist ? oldelement[1] : ATOM_NONE },
+		};
+
+		hooks_add(&hooks, &task);
 	}
 
 	set_iterator_deinit(&newgeisteriterator);
+	set_deinit(&shifted);
+
+	/* This section is critical, if the geist is not shifted correctly, this is the only case where this process
+	 * could not recover at all, SIGTERM (and optionnaly SIGINT) are modified to handle a state flag notifying
+	 * us to exit as soon as possible, started tasks complete before */
+	journal_open(state, &journal, completed != NULL);
+	hooks.journal = &journal;
+
+	hooks_run(&hooks);
+
+	journal_close(&journal);
+	hooks_deinit(&hooks);
 
 	if(state->shouldexit) {
 		exit(EXIT_SUCCESS);
 	}
 }
 
+void
+apply_new_geister(struct state *state, const struct set *newgeister, const struct set *newpackages) {
+	apply_new_geister_tasks(state, newgeister, newpackages, NULL);
+}
+
+void
+apply_resume_new_geister(struct state *state, const struct set *newgeister, const struct set *newpackages, const struct set *completed) {
+	apply_new_geister_tasks(state, newgeister, newpackages, completed);
+}
+
 void
 apply_pending(struct state *state) {
 	if(unlinkat(state->dirfd, STATE_SNAPSHOT_CURRENT, 0) != 0) {
@@ -112,18 +127,111 @@ apply_pending(struct state *state) {
 		exit(EXIT_FAILURE);
 	}
 
-	set_empty(&state->pending);
-	state_parse_current(state);
+	journal_remove(state);
+
+	state_current_from_pending(state);
+	index_store(state);
+
+	/* Packages of pending were all extracted, none will be fetched again */
+	spool_clear(state);
+	reuse_prune(state);
+
+	if(state->shouldexit) {
+		exit(EXIT_SUCCESS);
+	}
+}
+
+/* There is a risk of removing a valid package if a geist pointed to a kept package. Just unlink them.
+ * Geister already removed by someone else are not an error, the update may already be committed */
+static void
+apply_unlink_geister(struct batch *batch) {
+
+	batch_flush(batch);
+
+	for(size_t i = 0; i < batch->count; i++) {
+		const int errcode = batch_errcode(batch, i);
+
+		if(errcode != 0 && errcode != ENOENT) {
+			syslog(LOG_ERR, "%s: Unable to unlink %s: %s", batch->caller, batch_path(batch, i), strerror(errcode));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * Old geister and packages were computed by state_diff, so we know exactly what to remove,
+ * without scanning the prefix. Must be called after the pending snapshot was commited.
+ */
+void
+apply_old_geister(struct state *state, const struct set *oldgeister, const struct set *oldpackages) {
+	struct set_iterator iterator;
+	struct set_element element;
+	struct batch batch;
+
+	batch_init(&batch, state->prefixfd, "apply_old_geister");
+	set_iterator_init(&iterator, oldgeister);
+	while(set_iterator_next(&iterator, &element)) {
+		batch_unlink(&batch, element.key, 0);
+	}
+	set_iterator_deinit(&iterator);
+
+	apply_unlink_geister(&batch);
+	batch_deinit(&batch);
+
+	set_iterator_init(&iterator, oldpackages);
+	while(!state->shouldexit && set_iterator_next(&iterator, &element)) {
+		const char * const package = element.key;
+		const int errcode = hny_remove(state->hny, package);
+		struct stat st;
+
+		/* Like geister, a package already removed is not an error */
+		if(errcode != 0 && errcode != ENOENT && (fstatat(state->prefixfd, package, &st, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT)) {
+			syslog(LOG_ERR, "apply_old_geister: Unable to remove package %s: %s", package, strerror(errcode));
+			exit(EXIT_FAILURE);
+		}
+	}
+	set_iterator_deinit(&iterator);
 
 	if(state->shouldexit) {
 		exit(EXIT_SUCCESS);
 	}
 }
 
+/* Removes an entry of the prefix no snapshot knows, stray geister are only queued */
+static void
+apply_cleanup_entry(struct state *state, struct batch *geister, const char *name, unsigned char type) {
+	/* A name never interned cannot be in any set */
+	const atom_t atom = atoms_find_string(&state->atoms, name);
+
+	switch(type) {
+	case DT_DIR:
+		if(atom == ATOM_NONE || !set_find(&state->packages, &atom, NULL)) {
+			const int errcode = hny_remove(state->hny, name);
+
+			if(errcode != 0) {
+				syslog(LOG_ERR, "apply_cleanup: Unable to remove package %s: %s", name, strerror(errcode));
+				exit(EXIT_FAILURE);
+			}
+		}
+		break;
+	case DT_LNK:
+		if(atom == ATOM_NONE || !set_find(&state->current, &atom, NULL)) {
+			batch_unlink(geister, name, 0);
+		}
+		break;
+	default:
+		/* Unknown sh*t, nothing to do here */
+		syslog(LOG_WARNING, "Invalid entry in prefix %s: %s", hny_path(state->hny), name);
+		break;
+	}
+}
+
 void
 apply_cleanup(struct state *state) {
-	const struct set * const packages = &state->packages;
-	DIR *dirp = opendir(hny_path(state->hny));
+	/* Opened again rather than duplicated, so the directory is read from its beginning */
+	const int fd = openat(state->prefixfd, ".", O_RDONLY | O_DIRECTORY);
+	DIR *dirp = fd >= 0 ? fdopendir(fd) : NULL;
+	struct batch geister, unknowns;
 	struct dirent *entry;
 
 	if(dirp == NULL) {
@@ -131,45 +239,20 @@ apply_cleanup(struct state *state) {
 		exit(EXIT_FAILURE);
 	}
 
+	batch_init(&geister, state->prefixfd, "apply_cleanup");
+	batch_init(&unknowns, state->prefixfd, "apply_cleanup");
+
 	while(errno = 0, entry = readdir(dirp), !state->shouldexit && entry != NULL) {
 		/* If hidden file/dir, or . or .., ignore it */
 		if(*entry->d_name == '.') {
 			continue;
 		}
 
-		switch(entry->d_type) {
-		case DT_DIR:
-			if(!set_find(packages, entry->d_name, NULL)) {
-				const int errcode = hny_remove(state->hny, entry->d_name);
-
-				if(errcode != 0) {
-					syslog(LOG_ERR, "apply_cleanup: Unable to remove package %s: %s", entry->d_name, strerror(errcode));
-					exit(EXIT_FAILURE);
-				}
-			}
-			break;
-		case DT_LNK:
-			if(!set_find(&state->current, entry->d_name, NULL)) {
-				/* There is a risk of removing a valid package if the geist pointed to a kept package. Just unlink. */
-				const size_t geistlength = strlen(entry->d_name);
-				const char * const prefixpath = hny_path(state->hny);
-				const size_t prefixpathlength = strlen(prefixpath);
-				char path[prefixpathlength + geistlength + 2]; /* One for the /, another for the terminating nul */
-
-				strncpy(path, prefixpath, prefixpathlength);
-				path[prefixpathlength] = '/';
-				strncpy(path + prefixpathlength + 1, entry->d_name, geistlength + 1);
-
-				if(unlink(path) != 0) {
-					syslog(LOG_ERR, "apply_cleanup: Unable to unlink %s: %m", entry->d_name);
-					exit(EXIT_FAILURE);
-				}
-			}
-			break;
-		default:
-			/* Unknown sh*t, nothing to do here */
-			syslog(LOG_WARNING, "Invalid entry in prefix %s: %s", hny_path(state->hny), entry->d_name);
-			break;
+		/* Some filesystems don't report types, they are queried once the directory is read */
+		if(entry->d_type == DT_UNKNOWN) {
+			batch_stat(&unknowns, entry->d_name, AT_SYMLINK_NOFOLLOW);
+		} else {
+			apply_cleanup_entry(state, &geister, entry->d_name, entry->d_type);
 		}
 	}
 
@@ -180,8 +263,24 @@ apply_cleanup(struct state *state) {
 
 	closedir(dirp);
 
+	batch_flush(&unknowns);
+	for(size_t i = 0; i < unknowns.count; i++) {
+		unsigned char type = DT_UNKNOWN;
+
+		if(batch_errcode(&unknowns, i) == 0) {
+			const mode_t mode = batch_st(&unknowns, i)->st_mode;
+			type = S_ISDIR(mode) ? DT_DIR : S_ISLNK(mode) ? DT_LNK : DT_UNKNOWN;
+		}
+
+		apply_cleanup_entry(state, &geister, batch_path(&unknowns, i), type);
+	}
+
+	apply_unlink_geister(&geister);
+
+	batch_deinit(&unknowns);
+	batch_deinit(&geister);
+
 	if(state->shouldexit) {
 		exit(EXIT_SUCCESS);
 	}
 }
-
@@ -14,9 +14,16 @@
 void
 apply_new_geister(struct state *state, const struct set *newgeister, const struct set *newpackages);
 
+/* Resumes applying new geister after an interruption, skipping those in completed, see journal_load */
+void
+apply_resume_new_geister(struct state *state, const struct set *newgeister, const struct set *newpackages, const struct set *completed);
+
 void
 apply_pending(struct state *state);
 
+void
+apply_old_geister(struct state *state, const struct set *oldgeister, const struct set *oldpackages);
+
 void
 apply_cleanup(struct state *state);
 
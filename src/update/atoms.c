@@ -0,0 +1,252 @@
+/*
+	atoms.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "atoms.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#define ATOMS_DEFAULT_CAPACITY 4096
+#define ATOMS_DEFAULT_BUCKETS  256
+
+/* Header, string and its nul, padded to keep headers aligned */
+#define ATOMS_ENTRY_SIZE(length) \
+	((sizeof(struct atoms_header) + (length) + 1 + _Alignof(struct atoms_header) - 1) & ~(_Alignof(struct atoms_header) - 1))
+
+/* Returns the slot where the string is, or the empty slot where it would be inserted */
+static atom_t *
+atoms_probe(const struct atoms *atoms, const char *string, size_t length, uint32_t hash) {
+	const size_t mask = atoms->buckets - 1;
+	size_t i = hash & mask;
+
+	while(atoms->slots[i] != ATOM_NONE) {
+		const struct atoms_header * const header = atoms_header(atoms, atoms->slots[i]);
+
+		if(header->hash == hash && header->length == length
+			&& hash_equal(header + 1, string, length)) {
+			break;
+		}
+
+		i = (i + 1) & mask;
+	}
+
+	return atoms->slots + i;
+}
+
+/* Copies borrowed storage to the heap, so it can be reallocated and freed */
+static void
+atoms_own(struct atoms *atoms) {
+	if(atoms->isborrowed) {
+		char * const strings = malloc(atoms->capacity);
+		atom_t * const slots = malloc(atoms->buckets * sizeof(*slots));
+
+		if(strings == NULL || slots == NULL) {
+			syslog(LOG_ERR, "atoms_own: Unable to copy %lu strings: %m", atoms->count);
+			exit(EXIT_FAILURE);
+		}
+
+		atoms->strings = memcpy(strings, atoms->strings, atoms->size);
+		atoms->slots = memcpy(slots, atoms->slots, atoms->buckets * sizeof(*slots));
+		atoms->isborrowed = false;
+	}
+}
+
+static void
+atoms_resize(struct atoms *atoms, size_t buckets) {
+	atoms_own(atoms);
+
+	const atom_t * const oldslots = atoms->slots, * const oldend = oldslots + atoms->buckets;
+	atom_t *slots = calloc(buckets, sizeof(*slots));
+
+	if(slots == NULL) {
+		syslog(LOG_ERR, "atoms_resize: Index of %lu slots: %m", buckets);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Hashes are in headers, no need to recompute them */
+	const size_t mask = buckets - 1;
+	for(const atom_t *slot = oldslots; slot != oldend; slot++) {
+		if(*slot != ATOM_NONE) {
+			size_t i = atoms_header(atoms, *slot)->hash & mask;
+
+			while(slots[i] != ATOM_NONE) {
+				i = (i + 1) & mask;
+			}
+
+			slots[i] = *slot;
+		}
+	}
+
+	free(atoms->slots);
+
+	atoms->buckets = buckets;
+	atoms->slots = slots;
+}
+
+/* While size more bytes cannot fit, update size.
+ * Atoms are 32 bits offsets, the arena cannot be bigger than 4GiB */
+static void
+atoms_grow(struct atoms *atoms, size_t size) {
+	size_t newcapacity = atoms->capacity;
+
+	while(newcapacity - atoms->size < size && newcapacity <= UINT32_MAX) {
+		newcapacity *= 2;
+	}
+
+	if(newcapacity - atoms->size < size || newcapacity > (size_t)UINT32_MAX + 1) {
+		syslog(LOG_ERR, "atoms_grow: Unable to fit %lu more bytes in arena", size);
+		exit(EXIT_FAILURE);
+	}
+
+	if(newcapacity != atoms->capacity) {
+		atoms_own(atoms);
+
+		char * const newstrings = realloc(atoms->strings, newcapacity);
+
+		if(newstrings == NULL) {
+			syslog(LOG_ERR, "atoms_grow: Arena of %lu bytes: %m", newcapacity);
+			exit(EXIT_FAILURE);
+		}
+
+		atoms->capacity = newcapacity;
+		atoms->strings = newstrings;
+	}
+}
+
+void
+atoms_init(struct atoms *atoms) {
+	atoms->capacity = ATOMS_DEFAULT_CAPACITY;
+	atoms->size = ATOMS_ENTRY_SIZE(0); /* The empty string, ATOM_NONE */
+	atoms->strings = malloc(atoms->capacity);
+
+	atoms->count = 0;
+	atoms->buckets = ATOMS_DEFAULT_BUCKETS;
+	atoms->slots = calloc(atoms->buckets, sizeof(*atoms->slots));
+
+	if(atoms->strings == NULL || atoms->slots == NULL) {
+		syslog(LOG_ERR, "atoms_init: Unable to allocate atoms: %m");
+		exit(EXIT_FAILURE);
+	}
+
+	*(struct atoms_header *)atoms->strings = (struct atoms_header) { .hash = 0, .length = 0 };
+	atoms->strings[sizeof(struct atoms_header)] = '\0';
+
+	atoms->isborrowed = false;
+}
+
+void
+atoms_deinit(struct atoms *atoms) {
+	if(!atoms->isborrowed) {
+		free(atoms->strings);
+		free(atoms->slots);
+	}
+}
+
+/* Replaces the table with one previously built, stored in a private writable mapping,
+ * the mapping must outlive the table. Its capacity is its size, so the first
+ * new string copies it to the heap, previous ones are only read or written in place. */
+void
+atoms_borrow(struct atoms *atoms, char *strings, size_t size, atom_t *slots, size_t buckets, size_t count) {
+	atoms_deinit(atoms);
+
+	atoms->capacity = size;
+	atoms->size = size;
+	atoms->strings = strings;
+
+	atoms->count = count;
+	atoms->buckets = buckets;
+	atoms->slots = slots;
+
+	atoms->isborrowed = true;
+}
+
+/* Makes room for count more strings, of length bytes in total,
+ * so interning them neither grows the arena nor rehashes the index */
+void
+atoms_reserve(struct atoms *atoms, size_t count, size_t length) {
+	size_t buckets = atoms->buckets;
+
+	while((atoms->count + count) * 2 > buckets) {
+		buckets *= 2;
+	}
+
+	if(buckets != atoms->buckets) {
+		atoms_resize(atoms, buckets);
+	}
+
+	atoms_grow(atoms, count * ATOMS_ENTRY_SIZE(0) + length);
+}
+
+atom_t
+atoms_intern(struct atoms *atoms, const char *string, size_t length) {
+	return atoms_intern_hashed(atoms, string, length, hash_bytes(string, length));
+}
+
+/* Interns a string whose hash_bytes was computed beforehand, truncated, possibly in another thread */
+atom_t
+atoms_intern_hashed(struct atoms *atoms, const char *string, size_t length, uint32_t hash) {
+
+	if(length == 0) {
+		return ATOM_NONE;
+	}
+
+	/* Keep the load factor under one half */
+	if((atoms->count + 1) * 2 > atoms->buckets) {
+		atoms_resize(atoms, atoms->buckets * 2);
+	}
+
+	const atom_t *slot = atoms_probe(atoms, string, length, hash);
+
+	if(*slot == ATOM_NONE) {
+		const size_t entrysize = ATOMS_ENTRY_SIZE(length);
+		const size_t index = slot - atoms->slots;
+
+		/* Growing copies borrowed slots, slot must be looked up again */
+		atoms_grow(atoms, entrysize);
+
+		struct atoms_header * const header = (struct atoms_header *)(atoms->strings + atoms->size);
+		char * const interned = (char *)(header + 1);
+
+		header->hash = hash;
+		header->length = length;
+		memcpy(interned, string, length);
+		interned[length] = '\0';
+
+		atoms->slots[index] = atoms->size;
+
+		atoms->size += entrysize;
+		atoms->count++;
+
+		return atoms->slots[index];
+	}
+
+	return *slot;
+}
+
+atom_t
+atoms_find(const struct atoms *atoms, const char *string, size_t length) {
+
+	if(length == 0) {
+		return ATOM_NONE;
+	}
+
+	return *atoms_probe(atoms, string, length, hash_bytes(string, length));
+}
+
+/* Finds a nul-terminated string, hashing and measuring it in a single pass */
+atom_t
+atoms_find_string(const struct atoms *atoms, const char *string) {
+	size_t length;
+	const uint32_t hash = hash_string(string, &length);
+
+	if(length == 0) {
+		return ATOM_NONE;
+	}
+
+	return *atoms_probe(atoms, string, length, hash);
+}
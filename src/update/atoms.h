@@ -0,0 +1,76 @@
+/*
+	atoms.h
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#ifndef UPDATE_ATOMS_H
+#define UPDATE_ATOMS_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hash.h"
+
+/* An atom is the handle of an interned string, two atoms
+ * of the same table are equal if and only if their strings are. */
+typedef uint32_t atom_t;
+
+/* The empty string, never a valid geist or package */
+#define ATOM_NONE 0
+
+/* Precedes each string in the arena, so neither is ever recomputed */
+struct atoms_header {
+	uint32_t hash;   /* Truncated hash of the string */
+	uint32_t length; /* Length of the string, without its terminating nul */
+};
+
+/* Strings are stored once, nul-terminated, after their header, in a single arena.
+ * An atom is the offset of its header in the arena, so the arena can grow
+ * with realloc, but pointers returned by atoms_string are invalidated by atoms_intern. */
+struct atoms {
+	size_t capacity;
+	size_t size;
+	char *strings;
+
+	size_t count;   /* Number of interned strings */
+	size_t buckets; /* Number of slots, a power of two */
+	atom_t *slots;  /* Interned strings, ATOM_NONE for an empty slot */
+
+	bool isborrowed; /* Strings and slots belong to a private mapping, copied before growing */
+};
+
+void
+atoms_init(struct atoms *atoms);
+
+void
+atoms_deinit(struct atoms *atoms);
+
+void
+atoms_borrow(struct atoms *atoms, char *strings, size_t size, atom_t *slots, size_t buckets, size_t count);
+
+void
+atoms_reserve(struct atoms *atoms, size_t count, size_t length);
+
+atom_t
+atoms_intern(struct atoms *atoms, const char *string, size_t length);
+
+atom_t
+atoms_intern_hashed(struct atoms *atoms, const char *string, size_t length, uint32_t hash);
+
+atom_t
+atoms_find(const struct atoms *atoms, const char *string, size_t length);
+
+atom_t
+atoms_find_string(const struct atoms *atoms, const char *string);
+
+#define atoms_header(atoms, atom) ((const struct atoms_header *)((atoms)->strings + (atom)))
+
+#define atoms_string(atoms, atom) ((const char *)(atoms)->strings + (atom) + sizeof(struct atoms_header))
+
+#define atoms_length(atoms, atom) (atoms_header(atoms, atom)->length)
+
+/* UPDATE_ATOMS_H */
+#endif
@@ -0,0 +1,330 @@
+/*
+	batch.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "batch.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <errno.h>
+
+#ifdef BATCH_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+
+void
+batch_init(struct batch *batch, int dirfd, const char *caller) {
+	batch->dirfd = dirfd;
+	batch->caller = caller;
+
+	batch->count = 0;
+	batch->capacity = 0;
+	batch->flushed = 0;
+	batch->entries = NULL;
+
+	batch->nameslength = 0;
+	batch->namescapacity = 0;
+	batch->names = NULL;
+
+#ifdef BATCH_URING
+	batch->isuring = 0;
+#endif
+}
+
+void
+batch_deinit(struct batch *batch) {
+#ifdef BATCH_URING
+	if(batch->isuring > 0) {
+		struct batch_ring * const ring = &batch->ring;
+
+		munmap(ring->sqes, ring->sqessize);
+		if(ring->cq != ring->sq) {
+			munmap(ring->cq, ring->cqsize);
+		}
+		munmap(ring->sq, ring->sqsize);
+		close(ring->fd);
+	}
+#endif
+
+	free(batch->entries);
+	free(batch->names);
+}
+
+static size_t
+batch_add(struct batch *batch, enum batch_operation operation, const char *path, int flags) {
+	const size_t pathsize = strlen(path) + 1;
+
+	if(batch->count == batch->capacity) {
+		batch->capacity = batch->capacity == 0 ? BATCH_ENTRIES : batch->capacity * 2;
+		batch->entries = realloc(batch->entries, batch->capacity * sizeof(*batch->entries));
+		if(batch->entries == NULL) {
+			syslog(LOG_ERR, "%s: Unable to allocate %lu operations: %m", batch->caller, batch->capacity);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(batch->nameslength + pathsize > batch->namescapacity) {
+		do {
+			batch->namescapacity = batch->namescapacity == 0 ? 4096 : batch->namescapacity * 2;
+		} while(batch->nameslength + pathsize > batch->namescapacity);
+
+		batch->names = realloc(batch->names, batch->namescapacity);
+		if(batch->names == NULL) {
+			syslog(LOG_ERR, "%s: Unable to allocate %lu bytes of paths: %m", batch->caller, batch->namescapacity);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	struct batch_entry * const entry = batch->entries + batch->count;
+
+	entry->operation = operation;
+	entry->path = batch->nameslength;
+	entry->flags = flags;
+	entry->errcode = 0;
+
+	memcpy(batch->names + batch->nameslength, path, pathsize);
+	batch->nameslength += pathsize;
+
+	return batch->count++;
+}
+
+size_t
+batch_unlink(struct batch *batch, const char *path, int flags) {
+	return batch_add(batch, BATCH_UNLINK, path, flags);
+}
+
+size_t
+batch_stat(struct batch *batch, const char *path, int flags) {
+	return batch_add(batch, BATCH_STAT, path, flags);
+}
+
+static void
+batch_flush_sync(struct batch *batch) {
+
+	for(size_t i = batch->flushed; i < batch->count; i++) {
+		struct batch_entry * const entry = batch->entries + i;
+		const char * const path = batch->names + entry->path;
+		int retval;
+
+		switch(entry->operation) {
+		case BATCH_UNLINK:
+			retval = unlinkat(batch->dirfd, path, entry->flags);
+			break;
+		case BATCH_STAT:
+			retval = fstatat(batch->dirfd, path, &entry->st, entry->flags);
+			break;
+		default:
+			errno = EINVAL;
+			retval = -1;
+			break;
+		}
+
+		entry->errcode = retval != 0 ? errno : 0;
+	}
+}
+
+#ifdef BATCH_URING
+
+static bool
+batch_ring_supports(int fd) {
+	const size_t probesize = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, probesize);
+	bool supports = false;
+
+	if(probe != NULL) {
+		/* Probing appeared after the ring itself, an error means we can't know, consider it unsupported */
+		if(syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+			supports = probe->last_op >= IORING_OP_UNLINKAT
+				&& (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) != 0
+				&& (probe->ops[IORING_OP_UNLINKAT].flags & IO_URING_OP_SUPPORTED) != 0;
+		}
+		free(probe);
+	}
+
+	return supports;
+}
+
+/* Sets the ring up, returns false if io_uring is unavailable, disabled or too old */
+static bool
+batch_ring_setup(struct batch_ring *ring) {
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = syscall(SYS_io_uring_setup, BATCH_ENTRIES, &params);
+	if(ring->fd < 0) {
+		return false;
+	}
+
+	if(!batch_ring_supports(ring->fd)) {
+		close(ring->fd);
+		return false;
+	}
+
+	ring->sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cqsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	/* Since Linux 5.4 both rings are mapped at once */
+	const bool issinglemmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if(issinglemmap && ring->cqsize > ring->sqsize) {
+		ring->sqsize = ring->cqsize;
+	}
+
+	ring->sq = mmap(NULL, ring->sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if(ring->sq == MAP_FAILED) {
+		close(ring->fd);
+		return false;
+	}
+
+	if(issinglemmap) {
+		ring->cq = ring->sq;
+	} else {
+		ring->cq = mmap(NULL, ring->cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if(ring->cq == MAP_FAILED) {
+			munmap(ring->sq, ring->sqsize);
+			close(ring->fd);
+			return false;
+		}
+	}
+
+	ring->sqes = mmap(NULL, ring->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED) {
+		if(ring->cq != ring->sq) {
+			munmap(ring->cq, ring->cqsize);
+		}
+		munmap(ring->sq, ring->sqsize);
+		close(ring->fd);
+		return false;
+	}
+
+	ring->sqtail = (unsigned int *)((char *)ring->sq + params.sq_off.tail);
+	ring->sqmask = (unsigned int *)((char *)ring->sq + params.sq_off.ring_mask);
+	ring->sqarray = (unsigned int *)((char *)ring->sq + params.sq_off.array);
+
+	ring->cqhead = (unsigned int *)((char *)ring->cq + params.cq_off.head);
+	ring->cqtail = (unsigned int *)((char *)ring->cq + params.cq_off.tail);
+	ring->cqmask = (unsigned int *)((char *)ring->cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq + params.cq_off.cqes);
+
+	return true;
+}
+
+static void
+batch_ring_prepare(struct batch *batch, size_t index) {
+	struct batch_ring * const ring = &batch->ring;
+	struct batch_entry * const entry = batch->entries + index;
+	const unsigned int tail = *ring->sqtail;
+	const unsigned int slot = tail & *ring->sqmask;
+	struct io_uring_sqe * const sqe = ring->sqes + slot;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = batch->dirfd;
+	sqe->addr = (unsigned long)(batch->names + entry->path);
+	sqe->user_data = index;
+
+	switch(entry->operation) {
+	case BATCH_UNLINK:
+		sqe->opcode = IORING_OP_UNLINKAT;
+		sqe->unlink_flags = entry->flags;
+		break;
+	case BATCH_STAT:
+		sqe->opcode = IORING_OP_STATX;
+		sqe->len = STATX_TYPE | STATX_MODE | STATX_INO;
+		sqe->off = (unsigned long)&entry->stx;
+		sqe->statx_flags = entry->flags;
+		break;
+	}
+
+	ring->sqarray[slot] = slot;
+	/* The kernel must see the entry before the new tail */
+	__atomic_store_n(ring->sqtail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void
+batch_ring_complete(struct batch *batch, const struct io_uring_cqe *cqe) {
+	struct batch_entry * const entry = batch->entries + cqe->user_data;
+
+	entry->errcode = cqe->res < 0 ? -cqe->res : 0;
+
+	if(entry->operation == BATCH_STAT && entry->errcode == 0) {
+		memset(&entry->st, 0, sizeof(entry->st));
+		entry->st.st_dev = makedev(entry->stx.stx_dev_major, entry->stx.stx_dev_minor);
+		entry->st.st_ino = entry->stx.stx_ino;
+		entry->st.st_mode = entry->stx.stx_mode;
+	}
+}
+
+static void
+batch_flush_ring(struct batch *batch) {
+	struct batch_ring * const ring = &batch->ring;
+
+	while(batch->flushed < batch->count) {
+		const size_t remaining = batch->count - batch->flushed;
+		const unsigned int submitting = remaining < BATCH_ENTRIES ? remaining : BATCH_ENTRIES;
+		unsigned int submitted = 0, completed = 0;
+
+		for(size_t i = batch->flushed; i < batch->flushed + submitting; i++) {
+			batch_ring_prepare(batch, i);
+		}
+
+		while(completed < submitting) {
+			const int retval = syscall(SYS_io_uring_enter, ring->fd, submitting - submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+			if(retval < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+				syslog(LOG_ERR, "%s: io_uring_enter: %m", batch->caller);
+				exit(EXIT_FAILURE);
+			}
+
+			submitted += retval;
+
+			unsigned int head = *ring->cqhead;
+			const unsigned int tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+			while(head != tail) {
+				batch_ring_complete(batch, ring->cqes + (head & *ring->cqmask));
+				head++, completed++;
+			}
+			/* Entries are read before the kernel may reuse them */
+			__atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+		}
+
+		batch->flushed += submitting;
+	}
+}
+
+#endif
+
+void
+batch_flush(struct batch *batch) {
+
+	if(batch->flushed == batch->count) {
+		return;
+	}
+
+#ifdef BATCH_URING
+	/* The ring is set up on the first flush with operations, most batches are empty */
+	if(batch->isuring == 0) {
+		batch->isuring = batch_ring_setup(&batch->ring) ? 1 : -1;
+	}
+
+	if(batch->isuring > 0) {
+		batch_flush_ring(batch);
+		return;
+	}
+#endif
+
+	batch_flush_sync(batch);
+	batch->flushed = batch->count;
+}
@@ -0,0 +1,105 @@
+/*
+	batch.h
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#ifndef UPDATE_BATCH_H
+#define UPDATE_BATCH_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+/* IORING_OP_UNLINKAT is an enumerator, the uapi headers are known to define it
+ * with IORING_FEAT_EXT_ARG, both appeared in Linux 5.11. With older headers, only
+ * the synchronous path is built */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_EXT_ARG
+#include <linux/stat.h>
+#define BATCH_URING
+#endif
+#endif
+#endif
+
+/* Operations submitted at once to the ring */
+#define BATCH_ENTRIES 256
+
+enum batch_operation {
+	BATCH_UNLINK,
+	BATCH_STAT,
+};
+
+struct batch_entry {
+	enum batch_operation operation;
+	size_t path;       /* Offset in names */
+	int flags;         /* AT_* flags of unlinkat or fstatat */
+	int errcode;       /* Once flushed, 0 or errno */
+	struct stat st;    /* Only st_dev, st_ino and st_mode are set */
+#ifdef BATCH_URING
+	struct statx stx;
+#endif
+};
+
+#ifdef BATCH_URING
+/* Rings mapped from io_uring_setup */
+struct batch_ring {
+	int fd;
+	void *sq, *cq;
+	size_t sqsize, cqsize;
+	struct io_uring_sqe *sqes;
+	size_t sqessize;
+	unsigned int *sqtail, *sqmask, *sqarray;
+	unsigned int *cqhead, *cqtail, *cqmask;
+	struct io_uring_cqe *cqes;
+};
+#endif
+
+/*
+ * Operations on entries of a directory, run together by batch_flush.
+ * On Linux, they are submitted BATCH_ENTRIES at a time to an io_uring,
+ * else, or if the kernel doesn't support it, they are done one after the other.
+ */
+struct batch {
+	int dirfd;
+	const char *caller;
+
+	size_t count, capacity;
+	size_t flushed; /* Entries before were done */
+	struct batch_entry *entries;
+
+	size_t nameslength, namescapacity;
+	char *names;
+
+#ifdef BATCH_URING
+	int isuring; /* 1 once the ring is set up, -1 if unavailable, 0 if not tried yet */
+	struct batch_ring ring;
+#endif
+};
+
+void
+batch_init(struct batch *batch, int dirfd, const char *caller);
+
+void
+batch_deinit(struct batch *batch);
+
+/* Queues an operation, the path is copied, returns its index */
+size_t
+batch_unlink(struct batch *batch, const char *path, int flags);
+
+size_t
+batch_stat(struct batch *batch, const char *path, int flags);
+
+/* Runs all queued operations, results are kept until batch_deinit */
+void
+batch_flush(struct batch *batch);
+
+/* Results of the operation at index, once flushed */
+#define batch_path(batch, index)    ((const char *)(batch)->names + (batch)->entries[index].path)
+#define batch_errcode(batch, index) ((batch)->entries[index].errcode)
+#define batch_st(batch, index)      ((const struct stat *)&(batch)->entries[index].st)
+
+/* UPDATE_BATCH_H */
+#endif
@@ -0,0 +1,590 @@
+/*
+	cache.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "cache.h"
+#include "reuse.h"
+#include "extract.h"
+#include "jobs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/*
+ * The cache keeps package archives across runs, so prefixes of a host, or a prefix
+ * rolling back and forth, fetch a package from the source once. Archives are stored
+ * by content, as objects/<digest>, and names/<package> is a symbolic link to its object,
+ * so the same archive under several names is stored once. An object is verified against
+ * its digest before being extracted, a corrupted one is removed and fetched again.
+ * The modification time of an object is the last time it was used, the least recently
+ * used are evicted first. Several processes may share the cache, objects and names are
+ * written aside, then renamed in place. Chunks of chunked packages, see chunk_extract,
+ * are stored the same way, as chunks/<digest>, and evicted along objects.
+ */
+
+#define CACHE_OBJECTS_DIRECTORY "objects"
+#define CACHE_NAMES_DIRECTORY   "names"
+#define CACHE_CHUNKS_DIRECTORY  "chunks"
+#define CACHE_WINDOW            (1 << 20)
+#define CACHE_STALE_TEMPORARY   (24 * 60 * 60) /* Seconds after which a temporary was left by a dead process */
+
+/* Path of the object of a digest, relative to the names directory */
+#define CACHE_OBJECT_LINK_SIZE (sizeof("../" CACHE_OBJECTS_DIRECTORY "/") + DIGEST_STRING_SIZE - 1)
+
+void
+cache_open(struct state *state, const char *path, unsigned long long budget) {
+	state->cachedirfd = open(path, O_RDONLY | O_DIRECTORY);
+	if(state->cachedirfd < 0) {
+		syslog(LOG_ERR, "cache_open: Unable to open cache at %s: %m", path);
+		exit(EXIT_FAILURE);
+	}
+
+	if((mkdirat(state->cachedirfd, CACHE_OBJECTS_DIRECTORY, 0755) != 0 && errno != EEXIST)
+		|| (mkdirat(state->cachedirfd, CACHE_NAMES_DIRECTORY, 0755) != 0 && errno != EEXIST)
+		|| (mkdirat(state->cachedirfd, CACHE_CHUNKS_DIRECTORY, 0755) != 0 && errno != EEXIST)) {
+		syslog(LOG_ERR, "cache_open: Unable to create cache directories at %s: %m", path);
+		exit(EXIT_FAILURE);
+	}
+
+	state->cachebudget = budget;
+}
+
+/* Opens the object of package and marks it used, or returns -1 */
+static int
+cache_find(const struct state *state, const char *package, char digeststring[DIGEST_STRING_SIZE]) {
+	const size_t packagelength = strlen(package);
+	char name[sizeof(CACHE_NAMES_DIRECTORY) + packagelength + 1], link[CACHE_OBJECT_LINK_SIZE + 1];
+
+	snprintf(name, sizeof(name), CACHE_NAMES_DIRECTORY "/%s", package);
+
+	const ssize_t linklength = readlinkat(state->cachedirfd, name, link, sizeof(link));
+	if(linklength != CACHE_OBJECT_LINK_SIZE - 1) {
+		return -1;
+	}
+	link[linklength] = '\0';
+
+	const int fd = openat(state->cachedirfd, name, O_RDONLY);
+	if(fd < 0) {
+		/* Its object was evicted */
+		unlinkat(state->cachedirfd, name, 0);
+		return -1;
+	}
+
+	memcpy(digeststring, link + linklength - (DIGEST_STRING_SIZE - 1), DIGEST_STRING_SIZE);
+	futimens(fd, NULL);
+
+	return fd;
+}
+
+static void
+cache_remove(const struct state *state, const char *package, const char *digeststring) {
+	char name[sizeof(CACHE_NAMES_DIRECTORY) + strlen(package) + 1], object[sizeof(CACHE_OBJECTS_DIRECTORY) + DIGEST_STRING_SIZE];
+
+	snprintf(name, sizeof(name), CACHE_NAMES_DIRECTORY "/%s", package);
+	snprintf(object, sizeof(object), CACHE_OBJECTS_DIRECTORY "/%s", digeststring);
+
+	unlinkat(state->cachedirfd, name, 0);
+	unlinkat(state->cachedirfd, object, 0);
+}
+
+/*******************
+ * Cache hits pool *
+ *******************/
+
+struct cache_hit {
+	atom_t package;
+	int fd;
+	bool ismissing; /* Corrupted, to be fetched from the source */
+	char digeststring[DIGEST_STRING_SIZE];
+};
+
+struct cache_extractions {
+	const struct state *state;
+
+	struct jobs jobs; /* Over hits */
+	struct cache_hit *hits;
+};
+
+/* Verifies the object, then extracts it, its pages are still cached from being digested */
+static bool
+cache_extract_hit(const struct state *state, struct cache_hit *hit) {
+	const char * const package = atoms_string(&state->atoms, hit->package);
+	enum hny_extraction_status status = HNY_EXTRACTION_STATUS_OK;
+	struct hny_extraction *extraction;
+	uint8_t result[DIGEST_SIZE];
+	char digeststring[DIGEST_STRING_SIZE];
+	struct digest digest;
+	struct stat st;
+	char *mapping = NULL;
+
+	if(fstat(hit->fd, &st) != 0) {
+		syslog(LOG_ERR, "cache_extract: Unable to stat cached '%s': %m", package);
+		return false;
+	}
+
+	if(st.st_size != 0) {
+		mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, hit->fd, 0);
+		if(mapping == MAP_FAILED) {
+			syslog(LOG_ERR, "cache_extract: Unable to map cached '%s': %m", package);
+			return false;
+		}
+		madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+	}
+
+	digest_init(&digest);
+	if(mapping != NULL) {
+		digest_update(&digest, mapping, st.st_size);
+	}
+	digest_final(&digest, result);
+	digest_string(result, digeststring);
+
+	if(strcmp(digeststring, hit->digeststring) != 0) {
+		syslog(LOG_WARNING, "cache_extract: Cached '%s' is corrupted, fetching it again", package);
+		cache_remove(state, package, hit->digeststring);
+		hit->ismissing = true;
+		if(mapping != NULL) {
+			munmap(mapping, st.st_size);
+		}
+		return true;
+	}
+
+	/* Create extraction handler */
+	int errcode = hny_extraction_create(&extraction, state->hny, package);
+	if(errcode != 0) {
+		syslog(LOG_ERR, "cache_extract: Unable to create extraction: %s", strerror(errcode));
+		if(mapping != NULL) {
+			munmap(mapping, st.st_size);
+		}
+		return false;
+	}
+
+	const char *current = mapping, * const end = mapping + st.st_size;
+	while(current != end && status == HNY_EXTRACTION_STATUS_OK) {
+		const size_t length = end - current < CACHE_WINDOW ? end - current : CACHE_WINDOW;
+
+		status = hny_extraction_extract(extraction, current, length, &errcode);
+		current += length;
+	}
+
+	hny_extraction_destroy(extraction);
+	if(mapping != NULL) {
+		munmap(mapping, st.st_size);
+	}
+
+	if(!extract_status("cache_extract", package, status, errcode)) {
+		return false;
+	}
+
+	reuse_package(state, package);
+
+	return true;
+}
+
+static void *
+cache_extract_run(void *arg) {
+	struct cache_extractions * const extractions = arg;
+
+	size_t index;
+
+	while(jobs_next(&extractions->jobs, &index)) {
+		if(!cache_extract_hit(extractions->state, extractions->hits + index)) {
+			jobs_fail(&extractions->jobs);
+		}
+	}
+
+	return NULL;
+}
+
+void
+cache_extract(const struct state *state, const struct set *packages, struct set *missing) {
+	struct cache_extractions extractions = { .state = state };
+	struct set_iterator iterator;
+	struct set_element element;
+
+	if(state->cachedirfd < 0) {
+		set_iterator_init(&iterator, packages);
+		while(set_iterator_next(&iterator, &element)) {
+			string_set_insert(missing, element.record);
+		}
+		set_iterator_deinit(&iterator);
+		return;
+	}
+
+	extractions.hits = malloc(packages->count * sizeof(*extractions.hits) + 1); /* + 1 to never allocate zero bytes */
+	if(extractions.hits == NULL) {
+		syslog(LOG_ERR, "cache_extract: Unable to allocate %lu packages: %m", packages->count);
+		exit(EXIT_FAILURE);
+	}
+
+	size_t count = 0;
+	set_iterator_init(&iterator, packages);
+	while(set_iterator_next(&iterator, &element)) {
+		struct cache_hit * const hit = extractions.hits + count;
+
+		hit->fd = cache_find(state, element.key, hit->digeststring);
+		if(hit->fd >= 0) {
+			hit->package = *element.record;
+			hit->ismissing = false;
+			count++;
+		} else {
+			string_set_insert(missing, element.record);
+		}
+	}
+	set_iterator_deinit(&iterator);
+
+	jobs_init(&extractions.jobs, count);
+	jobs_run("cache_extract", count < state->jobs ? count : state->jobs, cache_extract_run, &extractions, 0);
+
+	if(extractions.jobs.failed) {
+		exit(EXIT_FAILURE);
+	}
+
+	size_t extracted = 0;
+	for(size_t i = 0; i < count; i++) {
+		struct cache_hit * const hit = extractions.hits + i;
+
+		if(hit->ismissing) {
+			string_set_insert(missing, &hit->package);
+		} else {
+			extracted++;
+		}
+		close(hit->fd);
+	}
+
+	if(count != 0) {
+		syslog(LOG_INFO, "Extracted %lu packages from cache, %lu left to fetch", extracted, missing->count);
+	}
+
+	free(extractions.hits);
+	jobs_deinit(&extractions.jobs);
+}
+
+/***********
+ * Entries *
+ ***********/
+
+void
+cache_entry_create(const struct state *state, const char *package, struct cache_entry *entry) {
+	entry->fd = -1;
+
+	if(state->cachedirfd < 0) {
+		return;
+	}
+
+	/* Unique to the process, a package is fetched once per run */
+	const int length = snprintf(entry->temporary, sizeof(entry->temporary), ".%s.%ld", package, (long)getpid());
+	if(length < 0 || (size_t)length >= sizeof(entry->temporary)) {
+		return;
+	}
+
+	char path[sizeof(CACHE_OBJECTS_DIRECTORY) + sizeof(entry->temporary)];
+	snprintf(path, sizeof(path), CACHE_OBJECTS_DIRECTORY "/%s", entry->temporary);
+
+	entry->fd = openat(state->cachedirfd, path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(entry->fd < 0) {
+		syslog(LOG_WARNING, "cache_entry_create: Unable to cache '%s': %m", package);
+		return;
+	}
+
+	digest_init(&entry->digest);
+}
+
+void
+cache_entry_write(const struct state *state, struct cache_entry *entry, const void *data, size_t length) {
+
+	if(entry->fd < 0) {
+		return;
+	}
+
+	digest_update(&entry->digest, data, length);
+
+	while(length != 0) {
+		const ssize_t written = write(entry->fd, data, length);
+
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			syslog(LOG_WARNING, "cache_entry_write: Unable to cache package: %m");
+			cache_entry_abort(state, entry);
+			return;
+		}
+
+		data = (const char *)data + written;
+		length -= written;
+	}
+}
+
+void
+cache_entry_commit(const struct state *state, const char *package, struct cache_entry *entry) {
+	char digeststring[DIGEST_STRING_SIZE];
+	uint8_t result[DIGEST_SIZE];
+
+	if(entry->fd < 0) {
+		return;
+	}
+
+	digest_final(&entry->digest, result);
+	digest_string(result, digeststring);
+
+	char temporary[sizeof(CACHE_OBJECTS_DIRECTORY) + sizeof(entry->temporary)],
+		object[sizeof(CACHE_OBJECTS_DIRECTORY) + DIGEST_STRING_SIZE],
+		link[CACHE_OBJECT_LINK_SIZE],
+		temporaryname[sizeof(CACHE_NAMES_DIRECTORY) + sizeof(entry->temporary)],
+		name[sizeof(CACHE_NAMES_DIRECTORY) + strlen(package) + 1];
+
+	snprintf(temporary, sizeof(temporary), CACHE_OBJECTS_DIRECTORY "/%s", entry->temporary);
+	snprintf(object, sizeof(object), CACHE_OBJECTS_DIRECTORY "/%s", digeststring);
+	snprintf(link, sizeof(link), "../" CACHE_OBJECTS_DIRECTORY "/%s", digeststring);
+	snprintf(temporaryname, sizeof(temporaryname), CACHE_NAMES_DIRECTORY "/%s", entry->temporary);
+	snprintf(name, sizeof(name), CACHE_NAMES_DIRECTORY "/%s", package);
+
+	close(entry->fd);
+	entry->fd = -1;
+
+	/* The object first, so a name never points to a partial archive */
+	if(renameat(state->cachedirfd, temporary, state->cachedirfd, object) != 0) {
+		syslog(LOG_WARNING, "cache_entry_commit: Unable to cache '%s': %m", package);
+		unlinkat(state->cachedirfd, temporary, 0);
+		return;
+	}
+
+	if(symlinkat(link, state->cachedirfd, temporaryname) != 0
+		|| renameat(state->cachedirfd, temporaryname, state->cachedirfd, name) != 0) {
+		syslog(LOG_WARNING, "cache_entry_commit: Unable to name cached '%s': %m", package);
+		unlinkat(state->cachedirfd, temporaryname, 0);
+	}
+}
+
+void
+cache_entry_abort(const struct state *state, struct cache_entry *entry) {
+
+	if(entry->fd >= 0) {
+		char temporary[sizeof(CACHE_OBJECTS_DIRECTORY) + sizeof(entry->temporary)];
+
+		snprintf(temporary, sizeof(temporary), CACHE_OBJECTS_DIRECTORY "/%s", entry->temporary);
+
+		close(entry->fd);
+		unlinkat(state->cachedirfd, temporary, 0);
+		entry->fd = -1;
+	}
+}
+
+/**********
+ * Chunks *
+ **********/
+
+int
+cache_chunk_find(const struct state *state, const char *digeststring) {
+	char chunk[sizeof(CACHE_CHUNKS_DIRECTORY) + DIGEST_STRING_SIZE];
+
+	if(state->cachedirfd < 0) {
+		return -1;
+	}
+
+	snprintf(chunk, sizeof(chunk), CACHE_CHUNKS_DIRECTORY "/%s", digeststring);
+
+	const int fd = openat(state->cachedirfd, chunk, O_RDONLY);
+	if(fd >= 0) {
+		futimens(fd, NULL);
+	}
+
+	return fd;
+}
+
+void
+cache_chunk_store(const struct state *state, const char *digeststring, const void *data, size_t size, unsigned int job) {
+	char chunk[sizeof(CACHE_CHUNKS_DIRECTORY) + DIGEST_STRING_SIZE], temporary[NAME_MAX + 1];
+
+	if(state->cachedirfd < 0) {
+		return;
+	}
+
+	snprintf(chunk, sizeof(chunk), CACHE_CHUNKS_DIRECTORY "/%s", digeststring);
+	snprintf(temporary, sizeof(temporary), CACHE_CHUNKS_DIRECTORY "/.%s.%ld.%u", digeststring, (long)getpid(), job);
+
+	const int fd = openat(state->cachedirfd, temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+		syslog(LOG_WARNING, "cache_chunk_store: Unable to cache chunk %s: %m", digeststring);
+		return;
+	}
+
+	const char *current = data, * const end = current + size;
+	while(current != end) {
+		const ssize_t written = write(fd, current, end - current);
+
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		current += written;
+	}
+
+	close(fd);
+
+	if(current != end || renameat(state->cachedirfd, temporary, state->cachedirfd, chunk) != 0) {
+		syslog(LOG_WARNING, "cache_chunk_store: Unable to cache chunk %s: %m", digeststring);
+		unlinkat(state->cachedirfd, temporary, 0);
+	}
+}
+
+/************
+ * Eviction *
+ ************/
+
+struct cache_object {
+	struct timespec used;
+	off_t size;
+	const char *directory; /* Objects or chunks */
+	char name[DIGEST_STRING_SIZE];
+};
+
+/* Objects and chunks of the cache, and their total size */
+struct cache_objects {
+	struct cache_object *objects;
+	size_t count, capacity;
+	unsigned long long total;
+};
+
+static int
+cache_object_compare(const void *lhs, const void *rhs) {
+	const struct timespec *lhsused = &((const struct cache_object *)lhs)->used,
+		*rhsused = &((const struct cache_object *)rhs)->used;
+
+	if(lhsused->tv_sec != rhsused->tv_sec) {
+		return (lhsused->tv_sec > rhsused->tv_sec) - (lhsused->tv_sec < rhsused->tv_sec);
+	}
+
+	return (lhsused->tv_nsec > rhsused->tv_nsec) - (lhsused->tv_nsec < rhsused->tv_nsec);
+}
+
+/* Lists a directory of the cache */
+static DIR *
+cache_opendir(const struct state *state, const char *directory) {
+	const int dirfd = openat(state->cachedirfd, directory, O_RDONLY | O_DIRECTORY);
+	DIR * const dirp = dirfd >= 0 ? fdopendir(dirfd) : NULL;
+
+	if(dirp == NULL) {
+		syslog(LOG_WARNING, "cache_evict: Unable to list %s: %m", directory);
+		if(dirfd >= 0) {
+			close(dirfd);
+		}
+	}
+
+	return dirp;
+}
+
+/* Lists the objects of directory, removing stale temporaries */
+static void
+cache_objects_list(const struct state *state, const char *directory, struct cache_objects *objects) {
+	const struct dirent *entry;
+	DIR * const dirp = cache_opendir(state, directory);
+
+	if(dirp == NULL) {
+		return;
+	}
+
+	const time_t now = time(NULL);
+	while((entry = readdir(dirp)) != NULL) {
+		struct stat st;
+
+		if(fstatat(dirfd(dirp), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+
+		/* Temporaries are being written by another process, unless they're stale */
+		if(*entry->d_name == '.') {
+			if(now - st.st_mtim.tv_sec > CACHE_STALE_TEMPORARY) {
+				unlinkat(dirfd(dirp), entry->d_name, 0);
+			}
+			continue;
+		}
+
+		if(strlen(entry->d_name) != DIGEST_STRING_SIZE - 1) {
+			continue;
+		}
+
+		if(objects->count == objects->capacity) {
+			const size_t newcapacity = objects->capacity == 0 ? 64 : objects->capacity * 2;
+			struct cache_object * const newobjects = realloc(objects->objects, newcapacity * sizeof(*newobjects));
+
+			if(newobjects == NULL) {
+				syslog(LOG_WARNING, "cache_evict: Unable to list %s: %m", directory);
+				break;
+			}
+
+			objects->objects = newobjects;
+			objects->capacity = newcapacity;
+		}
+
+		struct cache_object * const object = objects->objects + objects->count;
+		object->used = st.st_mtim;
+		object->size = st.st_size;
+		object->directory = directory;
+		memcpy(object->name, entry->d_name, DIGEST_STRING_SIZE);
+
+		objects->total += st.st_size;
+		objects->count++;
+	}
+
+	closedir(dirp);
+}
+
+void
+cache_evict(const struct state *state) {
+	struct cache_objects objects = { .objects = NULL };
+	const struct dirent *entry;
+	DIR *dirp;
+
+	if(state->cachedirfd < 0) {
+		return;
+	}
+
+	cache_objects_list(state, CACHE_OBJECTS_DIRECTORY, &objects);
+	cache_objects_list(state, CACHE_CHUNKS_DIRECTORY, &objects);
+
+	size_t evicted = 0;
+	if(objects.total > state->cachebudget) {
+		qsort(objects.objects, objects.count, sizeof(*objects.objects), cache_object_compare);
+
+		while(evicted != objects.count && objects.total > state->cachebudget) {
+			const struct cache_object * const object = objects.objects + evicted;
+			char path[sizeof(CACHE_OBJECTS_DIRECTORY) + sizeof(CACHE_CHUNKS_DIRECTORY) + DIGEST_STRING_SIZE];
+
+			snprintf(path, sizeof(path), "%s/%s", object->directory, object->name);
+			if(unlinkat(state->cachedirfd, path, 0) == 0) {
+				objects.total -= object->size;
+			}
+			evicted++;
+		}
+	}
+
+	free(objects.objects);
+
+	/* Remove names of evicted objects */
+	if(evicted != 0 && (dirp = cache_opendir(state, CACHE_NAMES_DIRECTORY)) != NULL) {
+		while((entry = readdir(dirp)) != NULL) {
+			if(*entry->d_name != '.' && faccessat(dirfd(dirp), entry->d_name, F_OK, 0) != 0 && errno == ENOENT) {
+				unlinkat(dirfd(dirp), entry->d_name, 0);
+			}
+		}
+		closedir(dirp);
+
+		syslog(LOG_INFO, "Evicted %lu objects from cache, %llu bytes left", evicted, objects.total);
+	}
+}
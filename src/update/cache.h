@@ -0,0 +1,60 @@
+/*
+	cache.h
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#ifndef UPDATE_CACHE_H
+#define UPDATE_CACHE_H
+
+#include <stdbool.h>
+#include <limits.h>
+
+#include "digest.h"
+#include "set.h"
+#include "state.h"
+
+/* Package being stored in the cache while it is fetched, see cache_entry_create */
+struct cache_entry {
+	int fd; /* Of the temporary object, or -1 if the package isn't cached */
+	struct digest digest;
+	char temporary[NAME_MAX + 1];
+};
+
+/* Opens or creates the cache at path, which may grow up to budget bytes. */
+void
+cache_open(struct state *state, const char *path, unsigned long long budget);
+
+/* Extracts packages found in the cache, and inserts the others in missing, for the scheme to fetch. */
+void
+cache_extract(const struct state *state, const struct set *packages, struct set *missing);
+
+/* Starts caching package, does nothing if there is no cache. Failing to cache is never an error. */
+void
+cache_entry_create(const struct state *state, const char *package, struct cache_entry *entry);
+
+void
+cache_entry_write(const struct state *state, struct cache_entry *entry, const void *data, size_t length);
+
+/* Stores the package, once it was completely fetched and extracted. */
+void
+cache_entry_commit(const struct state *state, const char *package, struct cache_entry *entry);
+
+void
+cache_entry_abort(const struct state *state, struct cache_entry *entry);
+
+/* Opens the chunk of the digest and marks it used, or returns -1. */
+int
+cache_chunk_find(const struct state *state, const char *digeststring);
+
+/* Stores a chunk verified against its digest, job tells concurrent writers apart. */
+void
+cache_chunk_store(const struct state *state, const char *digeststring, const void *data, size_t size, unsigned int job);
+
+/* Evicts least recently used packages, until the cache fits its budget. */
+void
+cache_evict(const struct state *state);
+
+/* UPDATE_CACHE_H */
+#endif
@@ -6,10 +6,11 @@
 	subject the BSD 3-Clause License, see LICENSE
 */
 #include "check.h"
+#include "batch.h"
 
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
+#include <fcntl.h>
 #include <syslog.h>
 #include <errno.h>
 
@@ -19,54 +20,69 @@ check_pending(struct state *state) {
 	return set_is_empty(&state->pending);
 }
 
-bool
-check_new_geister(struct state *state, const struct set *newgeister) {
+/*
+ * A geist is shifted when it resolves to its package. Comparing what both resolve to,
+ * rather than reading the link, lets all of them be queried in batches.
+ */
+void
+check_shifted_geister(struct state *state, const struct set *newgeister, struct set *shifted) {
 	struct set_iterator newgeisteriterator;
+	struct set_element element;
+	struct batch batch;
+
+	batch_init(&batch, state->prefixfd, "check_new_geister");
+
+	set_iterator_init(&newgeisteriterator, newgeister);
+	while(set_iterator_next(&newgeisteriterator, &element)) {
+		batch_stat(&batch, element.key, 0);
+		batch_stat(&batch, element.value, AT_SYMLINK_NOFOLLOW);
+	}
+	set_iterator_deinit(&newgeisteriterator);
+
+	batch_flush(&batch);
 
+	size_t index = 0;
 	set_iterator_init(&newgeisteriterator, newgeister);
+	while(set_iterator_next(&newgeisteriterator, &element)) {
+		const int geisterrcode = batch_errcode(&batch, index), packageerrcode = batch_errcode(&batch, index + 1);
 
-	bool foundone = false;
-	const void *element;
-	size_t elementsize;
-	while(!state->shouldexit && set_iterator_next(&newgeisteriterator, &element, &elementsize)) {
-		/* As we only need to check if one of the new geist is correct,
-		 * we won't bother handling every cases of new geist like in annul or apply,
-		 * here, we'll only check if the geist is present with the right target */
-		const char * const geist = element;
-		const size_t geistlength = strlen(geist);
-		const char * const package = geist + geistlength + 1;
-		const size_t packagelength = strlen(package);
-		const char * const prefixpath = hny_path(state->hny);
-		const size_t prefixpathlength = strlen(prefixpath);
-		char path[prefixpathlength + geistlength + 2]; /* One for the /, another for the terminating nul */
-		char dest[packagelength + 1];
-
-		strncpy(path, prefixpath, prefixpathlength);
-		path[prefixpathlength] = '/';
-		strncpy(path + prefixpathlength + 1, geist, geistlength + 1);
-
-		ssize_t destlength = readlink(path, dest, sizeof(dest));
-
-		if(destlength == -1) {
-			if(errno != ENOENT) {
-				syslog(LOG_ERR, "check_new_geister: Unable to readlink %s: %m", path);
-				exit(EXIT_FAILURE);
-			}
-		} else {
-			dest[packagelength] = '\0';
-			if(destlength == packagelength && strcmp(package, dest) == 0) {
-				foundone = true;
-				break;
+		if(geisterrcode != 0 && geisterrcode != ENOENT) {
+			syslog(LOG_ERR, "check_new_geister: Unable to stat %s: %s", element.key, strerror(geisterrcode));
+			exit(EXIT_FAILURE);
+		}
+
+		if(geisterrcode == 0 && packageerrcode == 0) {
+			const struct stat * const geistst = batch_st(&batch, index), * const packagest = batch_st(&batch, index + 1);
+
+			if(geistst->st_dev == packagest->st_dev && geistst->st_ino == packagest->st_ino) {
+				string_set_insert(shifted, element.record);
 			}
 		}
-	}
 
+		index += 2;
+	}
 	set_iterator_deinit(&newgeisteriterator);
 
+	batch_deinit(&batch);
+
 	if(state->shouldexit) {
 		exit(EXIT_SUCCESS);
 	}
+}
+
+bool
+check_new_geister(struct state *state, const struct set *newgeister) {
+	/* As we only need to check if one of the new geist is correct,
+	 * we won't bother handling every cases of new geist like in annul or apply,
+	 * here, we'll only check if the geist is present with the right target */
+	struct set shifted;
+
+	set_init(&shifted, &string_set_class, &state->atoms);
+	check_shifted_geister(state, newgeister, &shifted);
+
+	const bool foundone = !set_is_empty(&shifted);
+
+	set_deinit(&shifted);
 
 	return foundone;
 }
-
@@ -16,6 +16,10 @@
 bool
 check_pending(struct state *state);
 
+/* Inserts in shifted the geister of newgeister resolving to their package */
+void
+check_shifted_geister(struct state *state, const struct set *newgeister, struct set *shifted);
+
 bool
 check_new_geister(struct state *state, const struct set *newgeister);
 
@@ -0,0 +1,356 @@
+/*
+	chunk.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "chunk.h"
+#include "cache.h"
+#include "digest.h"
+#include "extract.h"
+#include "jobs.h"
+#include "reuse.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/*
+ * A source may publish packages cut in content defined chunks, by update-chunk:
+ * indexes/<package> lists the chunks of the package archive, in order, one per line,
+ * as "<digest> <size>", and chunks/<digest> holds each chunk. Chunks of a xz archive
+ * are independent xz blocks, cut at the entries of its decompressed archive,
+ * so the package shares the chunks of entries it didn't change with previous versions.
+ * Once concatenated, they are a xz archive of the same contents, not the package itself.
+ * Chunks are kept in the cache, so only those missing from it are fetched,
+ * each one is verified against its digest before it is extracted or stored.
+ * Packages without an index are left to the scheme, to be fetched whole.
+ */
+
+#define CHUNK_INDEX_SIZE_MAX (16 << 20)
+#define CHUNK_SIZE_MAX       (4 << 20) /* update-chunk cuts chunks of 256KiB of contents at most */
+
+/* File received in memory, up to limit bytes, nul-terminated */
+struct chunk_buffer {
+	char *data;
+	size_t length, capacity, limit;
+	bool isoverflown;
+};
+
+struct chunk_extractions {
+	const struct state *state;
+	const struct chunk_source *source;
+
+	struct jobs jobs; /* Over iterator, its mutex also guards missing and totals */
+	struct set_iterator iterator;
+	struct set *missing;
+
+	size_t extracted;
+	unsigned long long total, fetched, reused; /* In bytes of chunks */
+};
+
+struct chunk_job {
+	struct chunk_extractions *extractions;
+	unsigned int number;
+	void *connection;
+	struct chunk_buffer index, chunk;
+
+	size_t extracted;
+	unsigned long long total, fetched, reused;
+};
+
+static bool
+chunk_buffer_write(void *arg, const char *data, size_t length) {
+	struct chunk_buffer * const buffer = arg;
+
+	if(length > buffer->limit - buffer->length) {
+		buffer->isoverflown = true;
+		return false;
+	}
+
+	if(buffer->length + length + 1 > buffer->capacity) {
+		size_t newcapacity = buffer->capacity == 0 ? 65536 : buffer->capacity;
+		char *newdata;
+
+		while(buffer->length + length + 1 > newcapacity) {
+			newcapacity *= 2;
+		}
+
+		newdata = realloc(buffer->data, newcapacity);
+		if(newdata == NULL) {
+			syslog(LOG_ERR, "chunk_extract: Unable to allocate %lu bytes: %m", newcapacity);
+			return false;
+		}
+
+		buffer->data = newdata;
+		buffer->capacity = newcapacity;
+	}
+
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+	buffer->data[buffer->length] = '\0';
+
+	return true;
+}
+
+static void
+chunk_buffer_reset(struct chunk_buffer *buffer, size_t limit) {
+	buffer->length = 0;
+	buffer->limit = limit;
+	buffer->isoverflown = false;
+}
+
+static bool
+chunk_verify(const struct chunk_buffer *buffer, const char *digeststring) {
+	char actualstring[DIGEST_STRING_SIZE];
+	uint8_t result[DIGEST_SIZE];
+	struct digest digest;
+
+	digest_init(&digest);
+	digest_update(&digest, buffer->data, buffer->length);
+	digest_final(&digest, result);
+	digest_string(result, actualstring);
+
+	return strcmp(actualstring, digeststring) == 0;
+}
+
+/* Reads the cached chunk, returns false if it is absent or corrupted */
+static bool
+chunk_read_cached(struct chunk_job *job, const char *digeststring, size_t size) {
+	const int fd = cache_chunk_find(job->extractions->state, digeststring);
+	char buffer[65536];
+	ssize_t readval;
+
+	if(fd < 0) {
+		return false;
+	}
+
+	chunk_buffer_reset(&job->chunk, size);
+
+	while((readval = read(fd, buffer, sizeof(buffer))) > 0
+		&& chunk_buffer_write(&job->chunk, buffer, readval));
+
+	close(fd);
+
+	return readval == 0 && job->chunk.length == size && chunk_verify(&job->chunk, digeststring);
+}
+
+/* Brings the chunk in job->chunk, from the cache or else from the source */
+static bool
+chunk_fetch(struct chunk_job *job, const char *package, const char *digeststring, size_t size) {
+	const struct chunk_extractions * const extractions = job->extractions;
+	char file[sizeof(CHUNK_CHUNKS_DIRECTORY) + DIGEST_STRING_SIZE];
+
+	if(chunk_read_cached(job, digeststring, size)) {
+		job->reused += size;
+		return true;
+	}
+
+	snprintf(file, sizeof(file), CHUNK_CHUNKS_DIRECTORY "/%s", digeststring);
+	chunk_buffer_reset(&job->chunk, size);
+
+	const enum chunk_get_status status = extractions->source->get(job->connection, file, chunk_buffer_write, &job->chunk);
+	if(status == CHUNK_GET_MISSING) {
+		syslog(LOG_ERR, "chunk_extract: Chunk %s of '%s' is missing from the source", digeststring, package);
+		return false;
+	}
+
+	if(status != CHUNK_GET_OK && !job->chunk.isoverflown) {
+		return false;
+	}
+
+	if(job->chunk.length != size || !chunk_verify(&job->chunk, digeststring)) {
+		syslog(LOG_ERR, "chunk_extract: Chunk %s of '%s' is corrupted", digeststring, package);
+		return false;
+	}
+
+	cache_chunk_store(extractions->state, digeststring, job->chunk.data, size, job->number);
+	job->fetched += size;
+
+	return true;
+}
+
+/* Parses a line of the index, "<digest> <size>", in place */
+static bool
+chunk_index_line(char *line, size_t *sizep) {
+	char *end;
+
+	if(strspn(line, "0123456789abcdef") != DIGEST_STRING_SIZE - 1 || line[DIGEST_STRING_SIZE - 1] != ' ') {
+		return false;
+	}
+
+	line[DIGEST_STRING_SIZE - 1] = '\0';
+	*sizep = strtoul(line + DIGEST_STRING_SIZE, &end, 10);
+
+	return *end == '\0' && end != line + DIGEST_STRING_SIZE && *sizep != 0 && *sizep <= CHUNK_SIZE_MAX;
+}
+
+static enum chunk_get_status
+chunk_package(struct chunk_job *job, const char *package) {
+	const struct chunk_extractions * const extractions = job->extractions;
+	const struct state * const state = extractions->state;
+	enum hny_extraction_status status = HNY_EXTRACTION_STATUS_OK;
+	struct hny_extraction *extraction;
+	char file[sizeof(CHUNK_INDEXES_DIRECTORY) + strlen(package) + 1];
+
+	snprintf(file, sizeof(file), CHUNK_INDEXES_DIRECTORY "/%s", package);
+	chunk_buffer_reset(&job->index, CHUNK_INDEX_SIZE_MAX);
+
+	const enum chunk_get_status indexed = extractions->source->get(job->connection, file, chunk_buffer_write, &job->index);
+	if(indexed != CHUNK_GET_OK) {
+		if(job->index.isoverflown) {
+			syslog(LOG_ERR, "chunk_extract: Chunk index of '%s' is bigger than %d bytes", package, CHUNK_INDEX_SIZE_MAX);
+		}
+		return indexed;
+	}
+
+	if(job->index.length == 0) {
+		chunk_buffer_write(&job->index, "", 0);
+	}
+
+	/* Create extraction handler */
+	int errcode = hny_extraction_create(&extraction, state->hny, package);
+	if(errcode != 0) {
+		syslog(LOG_ERR, "chunk_extract: Unable to create extraction: %s", strerror(errcode));
+		return CHUNK_GET_ERROR;
+	}
+
+	char *line = job->index.data, *end;
+	size_t lineno = 1;
+	bool isvalid = true, isfetched = true;
+	while(isfetched && !HNY_EXTRACTION_STATUS_IS_ERROR(status) && *line != '\0') {
+		size_t size;
+
+		end = strchr(line, '\n');
+		if(end == NULL) {
+			isvalid = false;
+			break;
+		}
+		*end = '\0';
+
+		if(!chunk_index_line(line, &size)) {
+			isvalid = false;
+			break;
+		}
+
+		isfetched = chunk_fetch(job, package, line, size);
+		if(isfetched && status == HNY_EXTRACTION_STATUS_OK) {
+			status = hny_extraction_extract(extraction, job->chunk.data, size, &errcode);
+		}
+
+		job->total += size;
+		line = end + 1;
+		lineno++;
+	}
+
+	hny_extraction_destroy(extraction);
+
+	if(!isvalid) {
+		syslog(LOG_ERR, "chunk_extract: Invalid chunk index of '%s', line %lu", package, lineno);
+		return CHUNK_GET_ERROR;
+	}
+
+	if(!isfetched || !extract_status("chunk_extract", package, status, errcode)) {
+		return CHUNK_GET_ERROR;
+	}
+
+	reuse_package(state, package);
+	job->extracted++;
+
+	return CHUNK_GET_OK;
+}
+
+static void *
+chunk_extract_run(void *arg) {
+	struct chunk_job * const job = arg;
+	struct chunk_extractions * const extractions = job->extractions;
+
+	job->connection = extractions->source->connect(extractions->state);
+	if(job->connection == NULL) {
+		jobs_fail(&extractions->jobs);
+		return NULL;
+	}
+
+	struct set_element element;
+	while(jobs_next_element(&extractions->jobs, &extractions->iterator, &element)) {
+		const enum chunk_get_status status = chunk_package(job, element.key);
+
+		pthread_mutex_lock(&extractions->jobs.mutex);
+		if(status == CHUNK_GET_MISSING) {
+			string_set_insert(extractions->missing, element.record);
+		} else if(status == CHUNK_GET_ERROR) {
+			extractions->jobs.failed = true;
+		}
+		pthread_mutex_unlock(&extractions->jobs.mutex);
+	}
+
+	extractions->source->disconnect(job->connection);
+
+	pthread_mutex_lock(&extractions->jobs.mutex);
+	extractions->extracted += job->extracted;
+	extractions->total += job->total;
+	extractions->fetched += job->fetched;
+	extractions->reused += job->reused;
+	pthread_mutex_unlock(&extractions->jobs.mutex);
+
+	return NULL;
+}
+
+void
+chunk_extract(const struct state *state, const struct chunk_source *source, const struct set *packages, struct set *missing) {
+	struct chunk_extractions extractions = {
+		.state = state,
+		.source = source,
+		.missing = missing,
+	};
+
+	if(state->cachedirfd < 0 || source == NULL) {
+		struct set_iterator iterator;
+		struct set_element element;
+
+		set_iterator_init(&iterator, packages);
+		while(set_iterator_next(&iterator, &element)) {
+			string_set_insert(missing, element.record);
+		}
+		set_iterator_deinit(&iterator);
+		return;
+	}
+
+	unsigned int jobs = packages->count < state->jobs ? packages->count : state->jobs;
+	if(jobs > source->jobsmax) {
+		jobs = source->jobsmax;
+	}
+
+	struct chunk_job jobsarray[jobs + 1];
+
+	jobs_init(&extractions.jobs, 0);
+	set_iterator_init(&extractions.iterator, packages);
+
+	for(unsigned int i = 0; i < jobs; i++) {
+		jobsarray[i] = (struct chunk_job) { .extractions = &extractions, .number = i };
+	}
+
+	jobs_run("chunk_extract", jobs, chunk_extract_run, jobsarray, sizeof(*jobsarray));
+
+	set_iterator_deinit(&extractions.iterator);
+
+	for(unsigned int i = 0; i < jobs; i++) {
+		free(jobsarray[i].index.data);
+		free(jobsarray[i].chunk.data);
+	}
+
+	if(extractions.jobs.failed) {
+		exit(EXIT_FAILURE);
+	}
+
+	if(extractions.extracted != 0) {
+		syslog(LOG_INFO, "Extracted %lu chunked packages, fetched %llu of %llu bytes, %llu reused from the cache",
+			extractions.extracted, extractions.fetched, extractions.total, extractions.reused);
+	}
+
+	jobs_deinit(&extractions.jobs);
+}
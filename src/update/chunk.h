@@ -0,0 +1,45 @@
+/*
+	chunk.h
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#ifndef UPDATE_CHUNK_H
+#define UPDATE_CHUNK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "set.h"
+#include "state.h"
+
+/* Relative to the uri of the source, see update-chunk */
+#define CHUNK_INDEXES_DIRECTORY "indexes"
+#define CHUNK_CHUNKS_DIRECTORY  "chunks"
+
+enum chunk_get_status {
+	CHUNK_GET_OK,
+	CHUNK_GET_MISSING, /* The source doesn't have the file */
+	CHUNK_GET_ERROR,   /* Already reported */
+};
+
+/* Receives a file, returning false aborts the transfer */
+typedef bool (*chunk_sink_t)(void *arg, const char *data, size_t length);
+
+/* Source of chunked packages, implemented by schemes.
+ * A connection is used by a single job at a time, each job has its own. */
+struct chunk_source {
+	unsigned int jobsmax; /* Concurrent connections, whatever the number of jobs */
+	void *(*connect)(const struct state *state);
+	enum chunk_get_status (*get)(void *connection, const char *file, chunk_sink_t sink, void *arg);
+	void (*disconnect)(void *connection);
+};
+
+/* Extracts packages the source has a chunk index of, fetching only chunks missing from the cache,
+ * inserts the others in missing. Without a cache, or a source, all packages are missing. */
+void
+chunk_extract(const struct state *state, const struct chunk_source *source, const struct set *packages, struct set *missing);
+
+/* UPDATE_CHUNK_H */
+#endif
@@ -0,0 +1,228 @@
+/*
+	delta.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "delta.h"
+#include "digest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+/*
+ * A source may publish, by update-delta, the difference between a previous snapshot
+ * and its current one, as deltas/<digest of the previous snapshot>:
+ *   <digest of the previous snapshot> <digest of the resulting snapshot>
+ *   + <geist> <package>   for each added geist, or geist whose package changed
+ *   - <geist>             for each removed geist
+ * The delta is applied to current, and the pending snapshot written in canonical form,
+ * see state_write_pending, its digest must then be the resulting one.
+ * A delta which doesn't apply, or doesn't result in the expected snapshot, is ignored,
+ * the full snapshot is fetched instead.
+ */
+
+#define DELTA_SIZE_MAX (64 << 20)
+
+struct delta_buffer {
+	char *data;
+	size_t length, capacity;
+	bool isoverflown;
+};
+
+static bool
+delta_buffer_write(void *arg, const char *data, size_t length) {
+	struct delta_buffer * const buffer = arg;
+
+	if(length > DELTA_SIZE_MAX - buffer->length) {
+		buffer->isoverflown = true;
+		return false;
+	}
+
+	if(buffer->length + length + 1 > buffer->capacity) {
+		size_t newcapacity = buffer->capacity == 0 ? 65536 : buffer->capacity;
+		char *newdata;
+
+		while(buffer->length + length + 1 > newcapacity) {
+			newcapacity *= 2;
+		}
+
+		newdata = realloc(buffer->data, newcapacity);
+		if(newdata == NULL) {
+			syslog(LOG_ERR, "delta_fetch: Unable to allocate %lu bytes: %m", newcapacity);
+			return false;
+		}
+
+		buffer->data = newdata;
+		buffer->capacity = newcapacity;
+	}
+
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+	buffer->data[buffer->length] = '\0';
+
+	return true;
+}
+
+static bool
+delta_receive(struct state *state, const struct chunk_source *source, const char *file, struct delta_buffer *buffer) {
+	void * const connection = source->connect(state);
+	enum chunk_get_status status = CHUNK_GET_ERROR;
+
+	if(connection != NULL) {
+		status = source->get(connection, file, delta_buffer_write, buffer);
+		source->disconnect(connection);
+	}
+
+	switch(status) {
+	case CHUNK_GET_OK:
+		return true;
+	case CHUNK_GET_MISSING:
+		syslog(LOG_INFO, "No delta from the current snapshot, fetching the full snapshot");
+		return false;
+	default:
+		if(buffer->isoverflown) {
+			syslog(LOG_WARNING, "delta_fetch: Delta %s exceeds %d bytes, fetching the full snapshot", file, DELTA_SIZE_MAX);
+		} else {
+			syslog(LOG_WARNING, "delta_fetch: Unable to fetch delta %s, fetching the full snapshot", file);
+		}
+		return false;
+	}
+}
+
+/* Splits the next line of the delta in place, returns NULL at its end */
+static char *
+delta_next_line(char **cursorp) {
+	char * const line = *cursorp, *newline;
+
+	if(*line == '\0') {
+		return NULL;
+	}
+
+	newline = strchr(line, '\n');
+	if(newline != NULL) {
+		*newline = '\0';
+		*cursorp = newline + 1;
+	} else {
+		*cursorp = line + strlen(line);
+	}
+
+	return line;
+}
+
+static bool
+delta_intern(struct state *state, const char *string, enum hny_type type, atom_t *atomp) {
+
+	if(hny_type_of(string) != type) {
+		return false;
+	}
+
+	*atomp = atoms_intern(&state->atoms, string, strlen(string));
+
+	return true;
+}
+
+/* Applies the entries of the delta to pending, a copy of current, stops at the first one which doesn't apply */
+static bool
+delta_apply(struct state *state, char *cursor, size_t *linenop) {
+	struct set_iterator iterator;
+	struct set_element element;
+	char *line;
+
+	set_empty(&state->pending);
+	set_reserve(&state->pending, state->current.count);
+
+	set_iterator_init(&iterator, &state->current);
+	while(pair_set_iterator_next(&iterator, &element)) {
+		pair_set_insert(&state->pending, element.record);
+	}
+	set_iterator_deinit(&iterator);
+
+	while(line = delta_next_line(&cursor), line != NULL) {
+		char * const geist = line + 2;
+		atom_t pair[2];
+
+		++*linenop;
+
+		if(line[0] == '\0' || line[1] != ' ') {
+			return false;
+		}
+
+		if(line[0] == '+') {
+			char * const space = strchr(geist, ' ');
+
+			if(space == NULL) {
+				return false;
+			}
+
+			*space = '\0';
+
+			if(!delta_intern(state, geist, HNY_TYPE_GEIST, pair) || !delta_intern(state, space + 1, HNY_TYPE_PACKAGE, pair + 1)) {
+				return false;
+			}
+
+			pair_set_remove(&state->pending, pair);
+			pair_set_insert(&state->pending, pair);
+		} else if(line[0] == '-') {
+			if(!delta_intern(state, geist, HNY_TYPE_GEIST, pair) || !pair_set_remove(&state->pending, pair)) {
+				return false;
+			}
+		} else {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool
+delta_fetch(struct state *state, const struct chunk_source *source) {
+	char file[sizeof(DELTA_DIRECTORY) + DIGEST_STRING_SIZE];
+	char currentstring[DIGEST_STRING_SIZE];
+	struct delta_buffer buffer = { .data = NULL };
+
+	if(source == NULL || !state->hascurrentdigest) {
+		return false;
+	}
+
+	digest_string(state->currentdigest, currentstring);
+	snprintf(file, sizeof(file), DELTA_DIRECTORY "/%s", currentstring);
+
+	if(!delta_receive(state, source, file, &buffer)) {
+		free(buffer.data);
+		return false;
+	}
+
+	/* The header repeats the digest of the previous snapshot, and gives the resulting one */
+	char *cursor = buffer.data != NULL ? buffer.data : "";
+	const char * const header = delta_next_line(&cursor);
+	size_t lineno = 1;
+	bool isapplied = header != NULL && strlen(header) == 2 * (DIGEST_STRING_SIZE - 1) + 1
+		&& strncmp(header, currentstring, DIGEST_STRING_SIZE - 1) == 0 && header[DIGEST_STRING_SIZE - 1] == ' '
+		&& delta_apply(state, cursor, &lineno);
+
+	if(isapplied) {
+		char resultstring[DIGEST_STRING_SIZE];
+		uint8_t result[DIGEST_SIZE];
+
+		state_write_pending(state, result);
+		digest_string(result, resultstring);
+
+		if(strcmp(resultstring, header + DIGEST_STRING_SIZE) != 0) {
+			syslog(LOG_WARNING, "delta_fetch: Delta %s resulted in snapshot %s instead of %s, fetching the full snapshot",
+				file, resultstring, header + DIGEST_STRING_SIZE);
+			isapplied = false;
+		} else {
+			syslog(LOG_INFO, "Applied delta of %lu bytes to the current snapshot", buffer.length);
+		}
+	} else {
+		syslog(LOG_WARNING, "delta_fetch: Delta %s does not apply at line %lu, fetching the full snapshot", file, lineno);
+	}
+
+	free(buffer.data);
+
+	return isapplied;
+}
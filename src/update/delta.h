@@ -0,0 +1,25 @@
+/*
+	delta.h
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#ifndef UPDATE_DELTA_H
+#define UPDATE_DELTA_H
+
+#include <stdbool.h>
+
+#include "chunk.h"
+#include "state.h"
+
+/* Relative to the uri of the source, see update-delta */
+#define DELTA_DIRECTORY "deltas"
+
+/* Fetches the delta from the current snapshot, if the source has one, applies it to current
+ * as the pending set, and writes the pending snapshot. Returns false if the full snapshot must be fetched. */
+bool
+delta_fetch(struct state *state, const struct chunk_source *source);
+
+/* UPDATE_DELTA_H */
+#endif
@@ -0,0 +1,138 @@
+/*
+	digest.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "digest.h"
+
+#include <string.h>
+
+/* FIPS 180-4 SHA-256 */
+
+#define DIGEST_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t digest_constants[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void
+digest_block(uint32_t state[8], const uint8_t *block) {
+	uint32_t w[64];
+
+	for(unsigned int i = 0; i < 16; i++) {
+		w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16
+			| (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+	}
+
+	for(unsigned int i = 16; i < 64; i++) {
+		const uint32_t s0 = DIGEST_ROTR(w[i - 15], 7) ^ DIGEST_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		const uint32_t s1 = DIGEST_ROTR(w[i - 2], 17) ^ DIGEST_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+		e = state[4], f = state[5], g = state[6], h = state[7];
+
+	for(unsigned int i = 0; i < 64; i++) {
+		const uint32_t t1 = h + (DIGEST_ROTR(e, 6) ^ DIGEST_ROTR(e, 11) ^ DIGEST_ROTR(e, 25))
+			+ ((e & f) ^ (~e & g)) + digest_constants[i] + w[i];
+		const uint32_t t2 = (DIGEST_ROTR(a, 2) ^ DIGEST_ROTR(a, 13) ^ DIGEST_ROTR(a, 22))
+			+ ((a & b) ^ (a & c) ^ (b & c));
+
+		h = g, g = f, f = e, e = d + t1;
+		d = c, c = b, b = a, a = t1 + t2;
+	}
+
+	state[0] += a, state[1] += b, state[2] += c, state[3] += d;
+	state[4] += e, state[5] += f, state[6] += g, state[7] += h;
+}
+
+void
+digest_init(struct digest *digest) {
+	static const uint32_t initial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(digest->state, initial, sizeof(initial));
+	digest->length = 0;
+}
+
+void
+digest_update(struct digest *digest, const void *data, size_t length) {
+	const uint8_t *current = data, * const end = current + length;
+	size_t buffered = digest->length % sizeof(digest->block);
+
+	digest->length += length;
+
+	/* Complete a previously buffered block */
+	if(buffered != 0) {
+		const size_t missing = sizeof(digest->block) - buffered;
+
+		if(length < missing) {
+			memcpy(digest->block + buffered, current, length);
+			return;
+		}
+
+		memcpy(digest->block + buffered, current, missing);
+		digest_block(digest->state, digest->block);
+		current += missing;
+	}
+
+	/* Whole blocks are digested in place */
+	while((size_t)(end - current) >= sizeof(digest->block)) {
+		digest_block(digest->state, current);
+		current += sizeof(digest->block);
+	}
+
+	memcpy(digest->block, current, end - current);
+}
+
+void
+digest_final(struct digest *digest, uint8_t result[DIGEST_SIZE]) {
+	const uint64_t bits = digest->length * 8;
+	size_t buffered = digest->length % sizeof(digest->block);
+
+	digest->block[buffered++] = 0x80;
+
+	/* No room left for the length, pad a whole block */
+	if(buffered > sizeof(digest->block) - sizeof(bits)) {
+		memset(digest->block + buffered, 0, sizeof(digest->block) - buffered);
+		digest_block(digest->state, digest->block);
+		buffered = 0;
+	}
+
+	memset(digest->block + buffered, 0, sizeof(digest->block) - sizeof(bits) - buffered);
+	for(unsigned int i = 0; i < sizeof(bits); i++) {
+		digest->block[sizeof(digest->block) - 1 - i] = bits >> i * 8;
+	}
+	digest_block(digest->state, digest->block);
+
+	for(unsigned int i = 0; i < 8; i++) {
+		result[i * 4] = digest->state[i] >> 24;
+		result[i * 4 + 1] = digest->state[i] >> 16;
+		result[i * 4 + 2] = digest->state[i] >> 8;
+		result[i * 4 + 3] = digest->state[i];
+	}
+}
+
+void
+digest_string(const uint8_t result[DIGEST_SIZE], char string[DIGEST_STRING_SIZE]) {
+	static const char digits[] = "0123456789abcdef";
+
+	for(unsigned int i = 0; i < DIGEST_SIZE; i++) {
+		string[i * 2] = digits[result[i] >> 4];
+		string[i * 2 + 1] = digits[result[i] & 0xF];
+	}
+
+	string[DIGEST_SIZE * 2] = '\0';
+}
@@ -0,0 +1,40 @@
+/*
+	digest.h
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#ifndef UPDATE_DIGEST_H
+#define UPDATE_DIGEST_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* SHA-256, identifies contents (snapshots, packages) across runs and hosts,
+ * unlike hash_t which only needs to be fast and stable for a given build */
+#define DIGEST_SIZE 32
+
+/* Size of the hexadecimal representation, with its terminating nul */
+#define DIGEST_STRING_SIZE (DIGEST_SIZE * 2 + 1)
+
+struct digest {
+	uint32_t state[8];
+	uint64_t length; /* Total length of digested data, in bytes */
+	uint8_t block[64];
+};
+
+void
+digest_init(struct digest *digest);
+
+void
+digest_update(struct digest *digest, const void *data, size_t length);
+
+void
+digest_final(struct digest *digest, uint8_t result[DIGEST_SIZE]);
+
+void
+digest_string(const uint8_t result[DIGEST_SIZE], char string[DIGEST_STRING_SIZE]);
+
+/* UPDATE_DIGEST_H */
+#endif
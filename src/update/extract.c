@@ -0,0 +1,33 @@
+/*
+	extract.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "extract.h"
+
+#include <string.h>
+#include <syslog.h>
+
+bool
+extract_status(const char *caller, const char *package, enum hny_extraction_status status, int errcode) {
+
+	if(status != HNY_EXTRACTION_STATUS_END) {
+		if(HNY_EXTRACTION_STATUS_IS_ERROR_XZ(status)) {
+			syslog(LOG_ERR, "%s: Unable to extract '%s', error while uncompressing", caller, package);
+		} else if(HNY_EXTRACTION_STATUS_IS_ERROR_CPIO(status)) {
+			if(HNY_EXTRACTION_STATUS_IS_ERROR_CPIO_SYSTEM(status)) {
+				syslog(LOG_ERR, "%s: Unable to extract '%s', system error while unarchiving: %s", caller, package, strerror(errcode));
+			} else {
+				syslog(LOG_ERR, "%s: Unable to extract '%s', error while unarchiving", caller, package);
+			}
+		} else {
+			syslog(LOG_ERR, "%s: Unable to extract '%s', archive not finished", caller, package);
+		}
+
+		return false;
+	}
+
+	return true;
+}
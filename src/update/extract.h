@@ -0,0 +1,20 @@
+/*
+	extract.h
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#ifndef UPDATE_EXTRACT_H
+#define UPDATE_EXTRACT_H
+
+#include <stdbool.h>
+
+#include <hny.h>
+
+/* Whether the extraction of package reached the end of its archive, else reports why, on behalf of caller. */
+bool
+extract_status(const char *caller, const char *package, enum hny_extraction_status status, int errcode);
+
+/* UPDATE_EXTRACT_H */
+#endif
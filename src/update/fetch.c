@@ -7,6 +7,11 @@
 */
 #include "fetch.h"
 
+#include "cache.h"
+#include "chunk.h"
+#include "delta.h"
+#include "journal.h"
+#include "reuse.h"
 #include "set.h"
 
 #include "schemes/file.h"
@@ -19,9 +24,10 @@
 struct scheme {
 	const char *name;
 	void (*open)(const struct state *state, const char *uri);
-	void (*snapshot)(const struct state *state);
+	void (*snapshot)(const struct state *state, struct state_stream *stream);
 	void (*packages)(const struct state *state, const struct set *packages);
 	void (*close)(const struct state *state);
+	const struct chunk_source *source; /* Files of the source, for chunks and deltas, or NULL if unsupported */
 };
 
 static const struct scheme schemes[] = {
@@ -30,41 +36,35 @@ static const struct scheme schemes[] = {
 		file_scheme_open,
 		file_scheme_snapshot,
 		file_scheme_packages,
-		file_scheme_close
+		file_scheme_close,
+		&file_scheme_chunks
 	},
-#if 0
 	{ /* HTTPS scheme, secure fetch remotely */
 		HTTPS_SCHEME,
 		https_scheme_open,
 		https_scheme_snapshot,
 		https_scheme_packages,
-		https_scheme_close
+		https_scheme_close,
+		&https_scheme_chunks
 	},
-#endif
 };
 
 static const struct scheme *scheme;
 
 void
 fetch_open(const struct state *state, const char *uri) {
-	/* We first need to find the scheme class */
+	/* We first need to find the scheme class, the uri begins with its name followed by a colon */
 	const struct scheme *current = schemes,
 		* const end = schemes + sizeof(schemes) / sizeof(*schemes);
-	const size_t urilength = strlen(uri);
 
 	while(current != end) {
-		const char * const schemename = current->name;
-		const char * const schemenameend = strchr(current->name, ':');
+		const size_t namelength = strlen(current->name);
 
-		if(schemenameend == NULL) {
-			syslog(LOG_ERR, "Invalid scheme for uri '%s'", uri);
-			exit(EXIT_FAILURE);
-		}
-
-		if(urilength == schemenameend - schemename
-			&& strncasecmp(uri, schemename, urilength) == 0) {
+		if(strncasecmp(uri, current->name, namelength) == 0 && uri[namelength] == ':') {
 			break;
 		}
+
+		current++;
 	}
 
 	if(current == end) {
@@ -82,18 +82,46 @@ fetch_open(const struct state *state, const char *uri) {
 	}
 }
 
+/* A delta from current is applied if the source has one, else the snapshot
+ * is streamed to disk as pending, and parsed at the same time */
 void
-fetch_snapshot(const struct state *state) {
-	scheme->snapshot(state);
+fetch_snapshot(struct state *state) {
+	/* A journal left by a committed update must not be taken for one of the new pending snapshot */
+	journal_remove(state);
+
+	if(!delta_fetch(state, scheme->source)) {
+		struct state_stream stream;
+
+		state_stream_open(state, &stream);
+		scheme->snapshot(state, &stream);
+		state_stream_close(&stream);
+	}
 
 	if(state->shouldexit) {
 		exit(EXIT_SUCCESS);
 	}
 }
 
+/* Packages found in the cache are extracted from it, then chunked packages
+ * are extracted from the chunks missing from the cache, the scheme fetches the others whole */
 void
-fetch_new_packages(const struct state *state, const struct set *newpackages) {
-	scheme->packages(state, newpackages);
+fetch_new_packages(struct state *state, const struct set *newpackages) {
+	struct set uncached, missing;
+
+	reuse_prepare(state, newpackages);
+
+	set_init(&uncached, &string_set_class, &state->atoms);
+	set_init(&missing, &string_set_class, &state->atoms);
+	cache_extract(state, newpackages, &uncached);
+	chunk_extract(state, scheme->source, &uncached, &missing);
+
+	if(!set_is_empty(&missing)) {
+		scheme->packages(state, &missing);
+	}
+
+	set_deinit(&uncached);
+	set_deinit(&missing);
+	cache_evict(state);
 
 	if(state->shouldexit) {
 		exit(EXIT_SUCCESS);
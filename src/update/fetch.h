@@ -15,10 +15,10 @@ void
 fetch_open(const struct state *state, const char *uri);
 
 void
-fetch_snapshot(const struct state *state);
+fetch_snapshot(struct state *state);
 
 void
-fetch_new_packages(const struct state *state, const struct set *newpackages);
+fetch_new_packages(struct state *state, const struct set *newpackages);
 
 void
 fetch_close(const struct state *state);
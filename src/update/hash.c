@@ -0,0 +1,395 @@
+/*
+	hash.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "hash.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+/*
+ * Strings are hashed eight bytes at a time, each word being loaded as little endian,
+ * the last one padded with zeroes, and the length folded in at the end.
+ * Kernels differ only in how they find the terminating nul while loading words.
+ * Word and vector kernels read past the terminating nul, but never across a page boundary,
+ * so they cannot fault. Such reads are invisible to the program, but not to sanitizers.
+ */
+
+#define HASH_SEED  0x9E3779B97F4A7C15
+#define HASH_PRIME 0xFF51AFD7ED558CCD
+
+/* Smallest page size, bigger ones being multiples of it */
+#define HASH_PAGE_SIZE 4096
+#define HASH_PAGE_FITS(pointer, size) (((uintptr_t)(pointer) & (HASH_PAGE_SIZE - 1)) <= HASH_PAGE_SIZE - (size))
+
+#define HASH_ONES  0x0101010101010101
+#define HASH_HIGHS 0x8080808080808080
+
+#if defined(__GNUC__)
+#define HASH_OVERREADS __attribute__((no_sanitize_address))
+#else
+#define HASH_OVERREADS
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HASH_LITTLE_ENDIAN
+#endif
+
+static inline hash_t
+hash_mix(hash_t hash, uint64_t word) {
+	hash ^= word;
+	hash *= HASH_PRIME;
+
+	return (hash << 31) | (hash >> 33);
+}
+
+static inline hash_t
+hash_finish(hash_t hash, size_t length) {
+	hash ^= length;
+
+	hash ^= hash >> 33;
+	hash *= HASH_PRIME;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+/* Keeps the count first bytes of a word, count being less than eight */
+#define HASH_LOW_BYTES(word, count) ((word) & ((UINT64_C(1) << (count) * 8) - 1))
+
+/* Mixes the words preceding the nul at index nul of a loaded block */
+static inline hash_t
+hash_mix_tail(hash_t hash, const uint64_t *words, size_t nul) {
+	size_t i;
+
+	for(i = 0; i < nul / 8; i++) {
+		hash = hash_mix(hash, words[i]);
+	}
+
+	if(nul % 8 != 0) {
+		hash = hash_mix(hash, HASH_LOW_BYTES(words[i], nul % 8));
+	}
+
+	return hash;
+}
+
+/* Loads up to eight bytes, as a little endian word, padded with zeroes */
+static inline uint64_t
+hash_load(const uint8_t *data, size_t count) {
+	uint64_t word = 0;
+
+#ifdef HASH_LITTLE_ENDIAN
+	memcpy(&word, data, count);
+#else
+	for(size_t i = 0; i < count; i++) {
+		word |= (uint64_t)data[i] << i * 8;
+	}
+#endif
+
+	return word;
+}
+
+/* Loads up to eight bytes of a string, stopping at its nul, the resulting word contains the nul if reached */
+static inline uint64_t
+hash_load_string(const uint8_t *data) {
+	uint64_t word = 0;
+
+	for(size_t i = 0; i < 8 && data[i] != '\0'; i++) {
+		word |= (uint64_t)data[i] << i * 8;
+	}
+
+	return word;
+}
+
+/* Index of the first nul byte of a word, eight if none */
+static inline size_t
+hash_word_nul(uint64_t word) {
+	const uint64_t zeroes = (word - HASH_ONES) & ~word & HASH_HIGHS;
+
+	/* Borrows can only produce false positives above the first nul byte, the lowest one is exact */
+	return zeroes == 0 ? 8 : __builtin_ctzll(zeroes) / 8;
+}
+
+/****************
+ * Byte kernel  *
+ ****************/
+
+static hash_t
+hash_string_byte(const char *string, size_t *lengthp) {
+	const uint8_t *data = (const uint8_t *)string;
+	hash_t hash = HASH_SEED;
+
+	for(;;) {
+		const uint64_t word = hash_load_string(data);
+		const size_t nul = hash_word_nul(word);
+
+		hash = hash_mix_tail(hash, &word, nul);
+
+		if(nul != 8) {
+			data += nul;
+			break;
+		}
+
+		data += 8;
+	}
+
+	*lengthp = data - (const uint8_t *)string;
+
+	return hash_finish(hash, *lengthp);
+}
+
+static bool
+hash_supported_always(void) {
+	return true;
+}
+
+/****************
+ * Word kernel  *
+ ****************/
+
+#ifdef HASH_LITTLE_ENDIAN
+static hash_t HASH_OVERREADS
+hash_string_word(const char *string, size_t *lengthp) {
+	const uint8_t *data = (const uint8_t *)string;
+	hash_t hash = HASH_SEED;
+
+	for(;;) {
+		uint64_t word;
+
+		if(HASH_PAGE_FITS(data, sizeof(word))) {
+			memcpy(&word, data, sizeof(word));
+		} else {
+			word = hash_load_string(data);
+		}
+
+		const size_t nul = hash_word_nul(word);
+
+		hash = hash_mix_tail(hash, &word, nul);
+
+		if(nul != 8) {
+			data += nul;
+			break;
+		}
+
+		data += 8;
+	}
+
+	*lengthp = data - (const uint8_t *)string;
+
+	return hash_finish(hash, *lengthp);
+}
+#endif
+
+/*****************
+ * SSE2 kernel   *
+ *****************/
+
+#if defined(__x86_64__)
+static hash_t HASH_OVERREADS
+hash_string_sse2(const char *string, size_t *lengthp) {
+	const uint8_t *data = (const uint8_t *)string;
+	const __m128i zero = _mm_setzero_si128();
+	hash_t hash = HASH_SEED;
+
+	for(;;) {
+		if(HASH_PAGE_FITS(data, sizeof(__m128i))) {
+			const __m128i block = _mm_loadu_si128((const __m128i *)data);
+			const unsigned int nuls = _mm_movemask_epi8(_mm_cmpeq_epi8(block, zero));
+			uint64_t words[2];
+
+			_mm_storeu_si128((__m128i *)words, block);
+
+			if(nuls == 0) {
+				hash = hash_mix(hash_mix(hash, words[0]), words[1]);
+				data += sizeof(block);
+			} else {
+				const size_t nul = __builtin_ctz(nuls);
+
+				hash = hash_mix_tail(hash, words, nul);
+				data += nul;
+				break;
+			}
+		} else {
+			/* Close to a page boundary, step a word at a time */
+			const uint64_t word = hash_load_string(data);
+			const size_t nul = hash_word_nul(word);
+
+			hash = hash_mix_tail(hash, &word, nul);
+
+			if(nul != 8) {
+				data += nul;
+				break;
+			}
+
+			data += 8;
+		}
+	}
+
+	*lengthp = data - (const uint8_t *)string;
+
+	return hash_finish(hash, *lengthp);
+}
+
+/*****************
+ * AVX2 kernel   *
+ *****************/
+
+static hash_t __attribute__((target("avx2"))) HASH_OVERREADS
+hash_string_avx2(const char *string, size_t *lengthp) {
+	const uint8_t *data = (const uint8_t *)string;
+	const __m256i zero = _mm256_setzero_si256();
+	hash_t hash = HASH_SEED;
+
+	for(;;) {
+		if(HASH_PAGE_FITS(data, sizeof(__m256i))) {
+			const __m256i block = _mm256_loadu_si256((const __m256i *)data);
+			const unsigned int nuls = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero));
+			uint64_t words[4];
+
+			_mm256_storeu_si256((__m256i *)words, block);
+
+			if(nuls == 0) {
+				hash = hash_mix(hash_mix(hash_mix(hash_mix(hash, words[0]), words[1]), words[2]), words[3]);
+				data += sizeof(block);
+			} else {
+				const size_t nul = __builtin_ctz(nuls);
+
+				hash = hash_mix_tail(hash, words, nul);
+				data += nul;
+				break;
+			}
+		} else {
+			const uint64_t word = hash_load_string(data);
+			const size_t nul = hash_word_nul(word);
+
+			hash = hash_mix_tail(hash, &word, nul);
+
+			if(nul != 8) {
+				data += nul;
+				break;
+			}
+
+			data += 8;
+		}
+	}
+
+	*lengthp = data - (const uint8_t *)string;
+
+	return hash_finish(hash, *lengthp);
+}
+
+/* Queried with cpuid rather than __builtin_cpu_supports, which needs libgcc at link time.
+ * The processor must have AVX2, and the system must save the ymm registers */
+static bool
+hash_supported_avx2(void) {
+	unsigned int eax, ebx, ecx, edx;
+
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || (ecx & bit_OSXSAVE) == 0 || (ecx & bit_AVX) == 0) {
+		return false;
+	}
+
+	unsigned int xcr0, xcr0high;
+	__asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0high) : "c" (0));
+	if((xcr0 & 0x6) != 0x6) {
+		return false;
+	}
+
+	return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2) != 0;
+}
+#endif
+
+/********************
+ * Kernel selection *
+ ********************/
+
+const struct hash_kernel hash_kernels[] = {
+#if defined(__x86_64__)
+	/* Names are mostly shorter than a ymm register, on them bench-hash measures avx2 slower than sse2.
+	 * Listed after sse2, avx2 is only benchmarked, never selected */
+	{ "sse2", hash_string_sse2, hash_supported_always },
+	{ "avx2", hash_string_avx2, hash_supported_avx2 },
+#endif
+#ifdef HASH_LITTLE_ENDIAN
+	{ "word", hash_string_word, hash_supported_always },
+#endif
+	{ "byte", hash_string_byte, hash_supported_always },
+	{ NULL },
+};
+
+static hash_t (*hash_string_kernel)(const char *, size_t *) = hash_string_byte;
+
+static void __attribute__((constructor))
+hash_select(void) {
+	const struct hash_kernel *kernel = hash_kernels;
+
+	while(!kernel->supported()) {
+		kernel++;
+	}
+
+	hash_string_kernel = kernel->function;
+}
+
+/********************
+ * Public functions *
+ ********************/
+
+hash_t
+hash_string(const char *string, size_t *lengthp) {
+	return hash_string_kernel(string, lengthp);
+}
+
+hash_t
+hash_bytes(const void *data, size_t length) {
+	const uint8_t *current = data, * const end = current + length;
+	hash_t hash = HASH_SEED;
+
+	while(end - current >= 8) {
+		hash = hash_mix(hash, hash_load(current, 8));
+		current += 8;
+	}
+
+	if(current != end) {
+		hash = hash_mix(hash, hash_load(current, end - current));
+	}
+
+	return hash_finish(hash, length);
+}
+
+bool
+hash_equal(const void *lhs, const void *rhs, size_t length) {
+	const uint8_t *lhscurrent = lhs, *rhscurrent = rhs;
+
+#if defined(__x86_64__)
+	while(length >= sizeof(__m128i)) {
+		const __m128i lhsblock = _mm_loadu_si128((const __m128i *)lhscurrent);
+		const __m128i rhsblock = _mm_loadu_si128((const __m128i *)rhscurrent);
+
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(lhsblock, rhsblock)) != 0xFFFF) {
+			return false;
+		}
+
+		lhscurrent += sizeof(__m128i);
+		rhscurrent += sizeof(__m128i);
+		length -= sizeof(__m128i);
+	}
+#endif
+
+	while(length >= 8) {
+		if(hash_load(lhscurrent, 8) != hash_load(rhscurrent, 8)) {
+			return false;
+		}
+
+		lhscurrent += 8;
+		rhscurrent += 8;
+		length -= 8;
+	}
+
+	return hash_load(lhscurrent, length) == hash_load(rhscurrent, length);
+}
@@ -0,0 +1,40 @@
+/*
+	hash.h
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#ifndef UPDATE_HASH_H
+#define UPDATE_HASH_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint64_t hash_t;
+
+/* An implementation of hash_string, for a processor feature */
+struct hash_kernel {
+	const char *name;
+	hash_t (*function)(const char *, size_t *);
+	bool (*supported)(void);
+};
+
+/* Kernels from the most to the least preferred, terminated by a NULL name */
+extern const struct hash_kernel hash_kernels[];
+
+/* Hashes the nul-terminated string, and stores its length in lengthp,
+ * in a single pass. The kernel is selected at runtime for the processor,
+ * all kernels return the same value, which is the one of hash_bytes. */
+hash_t
+hash_string(const char *string, size_t *lengthp);
+
+hash_t
+hash_bytes(const void *data, size_t length);
+
+bool
+hash_equal(const void *lhs, const void *rhs, size_t length);
+
+/* UPDATE_HASH_H */
+#endif
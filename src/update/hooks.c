@@ -0,0 +1,472 @@
+/*
+	hooks.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "hooks.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <signal.h>
+#include <errno.h>
+
+#include <hny.h>
+
+/*
+ * Hooks of different geister are independent unless declared otherwise,
+ * so they run concurrently, up to one per job. Each task stays ordered:
+ * its shift only happens once its hny/clean exited successfully, its hny/setup once it is shifted.
+ * Tasks are first all added, then dependencies read from the HOOKS_AFTER_FILE
+ * of the package each geist is set up with make a graph. A task starts once all
+ * tasks it depends on completed, and no running task shares its packages,
+ * so the update takes as long as the longest chain of dependent hooks.
+ * Dependencies on geister not updated are already satisfied, cycles are reported and ignored.
+ * Running hooks are reaped by their pid without blocking, in between we sleep in sigsuspend
+ * until a SIGCHLD, or an interruption which stops new tasks from being started at once.
+ * On the first failure no task nor step is started anymore, running hooks
+ * are waited for, then we exit, and the pending snapshot is recovered as before.
+ * An interruption lets started tasks complete, as their geist is in a critical section.
+ */
+
+void
+hooks_init(struct hooks *hooks, struct state *state, const char *caller, hooks_shift_t shift) {
+	hooks->state = state;
+	hooks->caller = caller;
+	hooks->shift = shift;
+	hooks->journal = NULL;
+	hooks->failed = false;
+
+	hooks->count = 0;
+	hooks->capacity = 0;
+	hooks->nodes = NULL;
+
+	hooks->readyhead = 0;
+	hooks->readytail = 0;
+	hooks->ready = NULL;
+
+	hooks->max = state->hooksjobs;
+	hooks->running = 0;
+	hooks->processes = calloc(hooks->max, sizeof(*hooks->processes));
+	if(hooks->processes == NULL) {
+		syslog(LOG_ERR, "%s: Unable to allocate %u hooks: %m", caller, hooks->max);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void
+hooks_deinit(struct hooks *hooks) {
+
+	for(size_t i = 0; i < hooks->count; i++) {
+		free(hooks->nodes[i].dependents);
+	}
+
+	free(hooks->nodes);
+	free(hooks->ready);
+	free(hooks->processes);
+}
+
+void
+hooks_add(struct hooks *hooks, const struct hooks_task *task) {
+
+	if(hooks->count == hooks->capacity) {
+		hooks->capacity = hooks->capacity == 0 ? 64 : hooks->capacity * 2;
+		hooks->nodes = realloc(hooks->nodes, hooks->capacity * sizeof(*hooks->nodes));
+		if(hooks->nodes == NULL) {
+			syslog(LOG_ERR, "%s: Unable to allocate %lu tasks: %m", hooks->caller, hooks->capacity);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	hooks->nodes[hooks->count++] = (struct hooks_node) { .task = *task };
+}
+
+/**********************
+ * Dependencies graph *
+ **********************/
+
+struct hooks_geist {
+	atom_t geist;
+	size_t node;
+};
+
+static int
+hooks_geist_compare(const void *lhs, const void *rhs) {
+	const atom_t lgeist = ((const struct hooks_geist *)lhs)->geist, rgeist = ((const struct hooks_geist *)rhs)->geist;
+
+	return (lgeist > rgeist) - (lgeist < rgeist);
+}
+
+static void
+hooks_depend(struct hooks *hooks, size_t dependency, size_t dependent) {
+	struct hooks_node * const node = hooks->nodes + dependency;
+
+	if(node->dependentscount == node->dependentscapacity) {
+		node->dependentscapacity = node->dependentscapacity == 0 ? 4 : node->dependentscapacity * 2;
+		node->dependents = realloc(node->dependents, node->dependentscapacity * sizeof(*node->dependents));
+		if(node->dependents == NULL) {
+			syslog(LOG_ERR, "%s: Unable to allocate dependents: %m", hooks->caller);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	node->dependents[node->dependentscount++] = dependent;
+	hooks->nodes[dependent].waiting++;
+}
+
+/* Reads the geister the package of the node must come after, those without a task are ignored */
+static void
+hooks_depend_after(struct hooks *hooks, const struct hooks_geist *geister, size_t index) {
+	const struct hooks_task * const task = &hooks->nodes[index].task;
+	char path[strlen(task->package) + sizeof(HOOKS_AFTER_FILE) + 1];
+
+	sprintf(path, "%s/" HOOKS_AFTER_FILE, task->package);
+
+	const int fd = openat(hooks->state->prefixfd, path, O_RDONLY);
+	FILE * const filep = fd >= 0 ? fdopen(fd, "r") : NULL;
+	if(filep == NULL) {
+		if(errno != ENOENT) {
+			syslog(LOG_WARNING, "%s: Unable to open %s, ignoring dependencies of %s: %m", hooks->caller, path, task->geist);
+		}
+		if(fd >= 0) {
+			close(fd);
+		}
+		return;
+	}
+
+	char *line = NULL;
+	size_t linecapacity = 0;
+	ssize_t linelength;
+
+	while(linelength = getline(&line, &linecapacity, filep), linelength >= 0) {
+		if(linelength != 0 && line[linelength - 1] == '\n') {
+			line[--linelength] = '\0';
+		}
+
+		/* A name never interned cannot be the geist of a task */
+		const struct hooks_geist key = { .geist = atoms_find(&hooks->state->atoms, line, linelength) };
+		const struct hooks_geist *found;
+
+		if(key.geist != ATOM_NONE && key.geist != task->geistatom
+			&& (found = bsearch(&key, geister, hooks->count, sizeof(*geister), hooks_geist_compare)) != NULL) {
+			hooks_depend(hooks, found->node, index);
+		}
+	}
+
+	free(line);
+	fclose(filep);
+}
+
+static void
+hooks_graph(struct hooks *hooks) {
+	struct hooks_geist * const geister = malloc(hooks->count * sizeof(*geister) + 1);
+
+	hooks->ready = malloc(hooks->count * sizeof(*hooks->ready) + 1);
+	if(geister == NULL || hooks->ready == NULL) {
+		syslog(LOG_ERR, "%s: Unable to allocate %lu tasks: %m", hooks->caller, hooks->count);
+		exit(EXIT_FAILURE);
+	}
+
+	for(size_t i = 0; i < hooks->count; i++) {
+		geister[i] = (struct hooks_geist) { .geist = hooks->nodes[i].task.geistatom, .node = i };
+	}
+	qsort(geister, hooks->count, sizeof(*geister), hooks_geist_compare);
+
+	for(size_t i = 0; i < hooks->count; i++) {
+		if(hooks->nodes[i].task.package != NULL) {
+			hooks_depend_after(hooks, geister, i);
+		}
+	}
+
+	free(geister);
+
+	for(size_t i = 0; i < hooks->count; i++) {
+		if(hooks->nodes[i].waiting == 0) {
+			hooks->ready[hooks->readytail++] = i;
+		}
+	}
+}
+
+/* Nodes which are still waiting are part of, or depend on, a cycle.
+ * The first one is released, others may then be released by its completion. */
+static void
+hooks_break_cycle(struct hooks *hooks) {
+	size_t i = 0;
+
+	while(hooks->nodes[i].waiting == 0) {
+		i++;
+	}
+
+	syslog(LOG_WARNING, "%s: Cyclic dependencies of %s, ignoring its order", hooks->caller, hooks->nodes[i].task.geist);
+
+	hooks->nodes[i].waiting = 0;
+	hooks->ready[hooks->readytail++] = i;
+}
+
+static void
+hooks_complete(struct hooks *hooks, size_t index) {
+	const struct hooks_node * const node = hooks->nodes + index;
+
+	if(hooks->journal != NULL) {
+		journal_record(hooks->journal, node->task.geist);
+	}
+
+	for(size_t i = 0; i < node->dependentscount; i++) {
+		struct hooks_node * const dependent = hooks->nodes + node->dependents[i];
+
+		/* Already released if a cycle was broken */
+		if(dependent->waiting != 0 && --dependent->waiting == 0) {
+			hooks->ready[hooks->readytail++] = node->dependents[i];
+		}
+	}
+}
+
+/*************
+ * Processes *
+ *************/
+
+static void
+hooks_spawn(struct hooks *hooks, struct hooks_process *process, const char *name, const char *path) {
+	const char * const step = path + 4; /* path + 4 because strlen("hny/") == 4 */
+
+	/* If an error happens here, note no process was forked in hny_spawn. */
+	const int errcode = hny_spawn(hooks->state->hny, name, path, &process->pid);
+	if(errcode != 0) {
+		syslog(LOG_ERR, "%s: Unable to spawn %s for %s: %s", hooks->caller, step, name, strerror(errcode));
+		process->pid = 0;
+		hooks->failed = true;
+		return;
+	}
+
+	process->step = step;
+}
+
+/* Shift then setup, once the task was cleaned, if it was */
+static void
+hooks_shift(struct hooks *hooks, struct hooks_process *process) {
+	const struct hooks_task * const task = &hooks->nodes[process->node].task;
+
+	process->pid = 0;
+
+	if(!hooks->shift(hooks->state, task)) {
+		hooks->failed = true;
+		return;
+	}
+
+	if(task->issetup) {
+		hooks_spawn(hooks, process, task->geist, "hny/setup");
+	} else {
+		hooks_complete(hooks, process->node);
+	}
+}
+
+static bool
+hooks_exited(const struct hooks *hooks, const struct hooks_process *process, int wstatus) {
+	const struct hooks_task * const task = &hooks->nodes[process->node].task;
+	const char * const name = task->cleaned != NULL && strcmp(process->step, "clean") == 0
+		? task->cleaned : task->geist;
+
+	if(WIFSIGNALED(wstatus)) {
+		syslog(LOG_ERR, "%s: Spawned %s for %s was ended with a signal: %s", hooks->caller, process->step, name, strsignal(WTERMSIG(wstatus)));
+		return false;
+	}
+
+	if(WIFEXITED(wstatus)) {
+		const int status = WEXITSTATUS(wstatus);
+
+		if(status != 0) {
+			syslog(LOG_ERR, "%s: Spawned %s for %s exited with code %d", hooks->caller, process->step, name, status);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Starts the next step of the task of the exited hook */
+static void
+hooks_exit(struct hooks *hooks, struct hooks_process *process, int wstatus) {
+
+	if(!hooks_exited(hooks, process, wstatus)) {
+		hooks->failed = true;
+		process->pid = 0;
+	} else if(strcmp(process->step, "clean") != 0) {
+		process->pid = 0;
+		hooks_complete(hooks, process->node);
+	} else if(hooks->failed) {
+		process->pid = 0;
+	} else {
+		hooks_shift(hooks, process);
+	}
+
+	if(process->pid == 0) {
+		hooks->running--;
+	}
+}
+
+/* Reaps hooks which exited, returns whether any did */
+static bool
+hooks_reap_exited(struct hooks *hooks) {
+	bool reaped = false;
+
+	for(unsigned int i = 0; i < hooks->max; i++) {
+		struct hooks_process * const process = hooks->processes + i;
+		int wstatus;
+
+		if(process->pid == 0) {
+			continue;
+		}
+
+		const pid_t pid = waitpid(process->pid, &wstatus, WNOHANG);
+		if(pid < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			syslog(LOG_ERR, "%s: waitpid failed with %u hooks running: %m", hooks->caller, hooks->running);
+			exit(EXIT_FAILURE);
+		}
+
+		if(pid != 0) {
+			hooks_exit(hooks, process, wstatus);
+			reaped = true;
+		}
+	}
+
+	return reaped;
+}
+
+/* Waits for running hooks to exit, and starts the next step of their tasks.
+ * If interruptible, also returns once we should exit. Signals are blocked while
+ * we look for exited hooks, so none is missed before sigsuspend. */
+static void
+hooks_reap(struct hooks *hooks, bool isinterruptible) {
+	sigset_t blocked, unblocked;
+
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGCHLD);
+	sigaddset(&blocked, SIGTERM);
+	sigaddset(&blocked, SIGINT);
+	sigprocmask(SIG_BLOCK, &blocked, &unblocked);
+
+	while(!hooks_reap_exited(hooks) && !(isinterruptible && hooks->state->shouldexit)) {
+		sigsuspend(&unblocked);
+	}
+
+	sigprocmask(SIG_SETMASK, &unblocked, NULL);
+}
+
+static bool
+hooks_conflicts(const struct hooks *hooks, const struct hooks_task *task) {
+
+	for(unsigned int i = 0; i < hooks->max; i++) {
+		const struct hooks_process * const process = hooks->processes + i;
+
+		if(process->pid == 0) {
+			continue;
+		}
+
+		const struct hooks_task * const running = &hooks->nodes[process->node].task;
+		for(unsigned int j = 0; j < 2; j++) {
+			if(task->packages[j] != ATOM_NONE
+				&& (task->packages[j] == running->packages[0] || task->packages[j] == running->packages[1])) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/* Takes the first ready node not conflicting with running ones, or returns false */
+static bool
+hooks_next(struct hooks *hooks, size_t *nodep) {
+
+	for(size_t i = hooks->readyhead; i < hooks->readytail; i++) {
+		const size_t node = hooks->ready[i];
+
+		if(!hooks_conflicts(hooks, &hooks->nodes[node].task)) {
+			memmove(hooks->ready + hooks->readyhead + 1, hooks->ready + hooks->readyhead, (i - hooks->readyhead) * sizeof(*hooks->ready));
+			hooks->readyhead++;
+			*nodep = node;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void
+hooks_start(struct hooks *hooks, size_t node) {
+	const struct hooks_task * const task = &hooks->nodes[node].task;
+	struct hooks_process *process = hooks->processes;
+
+	while(process->pid != 0) {
+		process++;
+	}
+
+	process->node = node;
+
+	if(task->isshifted) {
+		if(task->issetup) {
+			hooks_spawn(hooks, process, task->geist, "hny/setup");
+		} else {
+			hooks_complete(hooks, node);
+		}
+	} else if(task->cleaned != NULL) {
+		hooks_spawn(hooks, process, task->cleaned, "hny/clean");
+	} else {
+		hooks_shift(hooks, process);
+	}
+
+	if(process->pid != 0) {
+		hooks->running++;
+	}
+}
+
+/* Only there for SIGCHLD to interrupt sigsuspend, its default action is to be discarded */
+static void
+hooks_sigchld(int signo) {
+}
+
+void
+hooks_run(struct hooks *hooks) {
+	const struct sigaction action = {
+		.sa_handler = hooks_sigchld,
+		.sa_flags = SA_NOCLDSTOP,
+	};
+	struct sigaction previous;
+	size_t started = 0;
+
+	sigaction(SIGCHLD, &action, &previous);
+
+	hooks_graph(hooks);
+
+	while(!hooks->failed && !hooks->state->shouldexit && started != hooks->count) {
+		size_t node;
+
+		if(hooks->running != hooks->max && hooks_next(hooks, &node)) {
+			hooks_start(hooks, node);
+			started++;
+		} else if(hooks->running != 0) {
+			hooks_reap(hooks, true);
+		} else {
+			hooks_break_cycle(hooks);
+		}
+	}
+
+	while(hooks->running != 0) {
+		hooks_reap(hooks, false);
+	}
+
+	sigaction(SIGCHLD, &previous, NULL);
+
+	if(hooks->failed) {
+		exit(EXIT_FAILURE);
+	}
+}
@@ -0,0 +1,80 @@
+/*
+	hooks.h
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#ifndef UPDATE_HOOKS_H
+#define UPDATE_HOOKS_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "journal.h"
+#include "state.h"
+
+/* Optional file of a package, listing one geist per line, whose tasks must complete
+ * before the task of any geist set up with the package starts */
+#define HOOKS_AFTER_FILE "hny/after"
+
+/* Hooks of a geist, run in order: hny/clean, the shift, then hny/setup */
+struct hooks_task {
+	const char *geist;
+	atom_t geistatom;
+	const char *cleaned; /* Name hny/clean is spawned for, or NULL to skip it */
+	const char *package; /* Shifted to, see hooks_shift_t, its HOOKS_AFTER_FILE orders the task if not NULL */
+	bool issetup;        /* hny/setup is spawned for the geist after the shift */
+	bool isshifted;      /* Already shifted by an interrupted update, only setup remains */
+	atom_t packages[2];  /* Packages the hooks touch, or ATOM_NONE, tasks sharing one never run concurrently */
+};
+
+/* Shifts the geist of the task, returns false on failure, already reported */
+typedef bool (*hooks_shift_t)(struct state *state, const struct hooks_task *task);
+
+struct hooks_node {
+	struct hooks_task task;
+	unsigned int waiting; /* Dependencies not completed yet */
+	size_t dependentscount, dependentscapacity;
+	size_t *dependents;
+};
+
+struct hooks_process {
+	pid_t pid; /* Of the running hook, or 0 if the task is done */
+	const char *step;
+	size_t node;
+};
+
+/* Runs tasks of geister, up to max hooks at the same time */
+struct hooks {
+	struct state *state;
+	const char *caller;
+	hooks_shift_t shift;
+	struct journal *journal; /* Completed tasks are recorded in, if not NULL */
+	bool failed;
+
+	size_t count, capacity;
+	struct hooks_node *nodes;
+
+	size_t readyhead, readytail;
+	size_t *ready; /* Nodes whose dependencies completed, in order */
+
+	unsigned int max, running;
+	struct hooks_process *processes;
+};
+
+void
+hooks_init(struct hooks *hooks, struct state *state, const char *caller, hooks_shift_t shift);
+
+void
+hooks_deinit(struct hooks *hooks);
+
+void
+hooks_add(struct hooks *hooks, const struct hooks_task *task);
+
+/* Runs all added tasks, as their dependencies allow, exits on failure */
+void
+hooks_run(struct hooks *hooks);
+
+/* UPDATE_HOOKS_H */
+#endif
@@ -0,0 +1,318 @@
+/*
+	index.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "index.h"
+#include "digest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/*
+ * The index is a binary image of the atoms table, the current set and the packages set,
+ * as built from the current snapshot. Tables are stored as they are in memory,
+ * slots included, so loading one is mapping it and pointing the tables in it.
+ * It is written in native byte order, and its slots depend on hash_bytes and set_hash,
+ * so INDEX_VERSION must change with either of them.
+ * It is bound to the current snapshot by its inode, size and modification time,
+ * so loading it is constant time. The digest of current is stored too,
+ * to identify it without reading it. The header, which holds the directory of tables,
+ * is checksummed and tables are bounds checked against the index, so a torn or
+ * foreign index is parsed again. Their contents are trusted, checking them would
+ * read the whole index, which is what mapping it avoids.
+ */
+
+#define INDEX_MAGIC     "hnyupidx"
+#define INDEX_VERSION   3
+#define INDEX_BYTEORDER 0x01020304
+#define INDEX_TEMPORARY STATE_SNAPSHOT_INDEX ".new"
+
+#define INDEX_ALIGN(offset) (((offset) + 7) & ~(uint64_t)7)
+
+struct index_table {
+	uint64_t count;
+	uint64_t size;    /* In bytes for strings, in atoms for elements */
+	uint64_t buckets;
+	uint64_t storage; /* Offset of strings or elements in the index */
+	uint64_t slots;   /* Offset of slots in the index */
+};
+
+struct index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint64_t checksum; /* hash_bytes of the header, this field zeroed */
+	uint64_t size;     /* Of the whole index */
+
+	/* Identity of the current snapshot the index was built from */
+	uint64_t snapshotinode;
+	uint64_t snapshotsize;
+	int64_t snapshotmtime; /* In nanoseconds */
+	uint8_t snapshotdigest[DIGEST_SIZE];
+
+	struct index_table atoms;
+	struct index_table current;
+	struct index_table packages;
+};
+
+static uint64_t
+index_checksum(const struct index_header *header) {
+	struct index_header copy = *header;
+
+	copy.checksum = 0;
+
+	return hash_bytes(&copy, sizeof(copy));
+}
+
+static bool
+index_table_is_valid(const struct index_table *table, size_t storagesize, uint64_t indexsize) {
+	const uint64_t slotssize = table->buckets * sizeof(uint32_t);
+
+	return table->storage % 8 == 0 && table->slots % 8 == 0
+		&& table->storage <= indexsize && storagesize <= indexsize - table->storage
+		&& table->slots <= indexsize && slotssize <= indexsize - table->slots
+		&& (table->buckets & (table->buckets - 1)) == 0 && table->count * 2 <= table->buckets
+		&& table->size <= UINT32_MAX;
+}
+
+static bool
+index_is_valid(const struct index_header *header, uint64_t indexsize, const struct stat *st) {
+	return memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0
+		&& header->version == INDEX_VERSION && header->byteorder == INDEX_BYTEORDER
+		&& header->checksum == index_checksum(header) && header->size == indexsize
+		&& indexsize >= INDEX_ALIGN(sizeof(*header))
+		&& header->snapshotinode == st->st_ino && header->snapshotsize == (uint64_t)st->st_size
+		&& header->snapshotmtime == st->st_mtim.tv_sec * 1000000000ll + st->st_mtim.tv_nsec
+		&& header->atoms.buckets != 0 && header->atoms.size > sizeof(struct atoms_header)
+		&& index_table_is_valid(&header->atoms, header->atoms.size, indexsize)
+		&& header->current.size == header->current.count * pair_set_class.size
+		&& index_table_is_valid(&header->current, header->current.size * sizeof(atom_t), indexsize)
+		&& header->packages.size == header->packages.count * string_set_class.size
+		&& index_table_is_valid(&header->packages, header->packages.size * sizeof(atom_t), indexsize);
+}
+
+bool
+index_load(struct state *state) {
+	const int fd = openat(state->dirfd, STATE_SNAPSHOT_INDEX, O_RDONLY);
+	struct stat st, currentst;
+
+	if(fd < 0) {
+		if(errno != ENOENT) {
+			syslog(LOG_WARNING, "index_load: Unable to open " STATE_SNAPSHOT_INDEX ": %m");
+		}
+		return false;
+	}
+
+	if(fstat(fd, &st) != 0 || fstatat(state->dirfd, STATE_SNAPSHOT_CURRENT, &currentst, AT_SYMLINK_NOFOLLOW) != 0) {
+		syslog(LOG_WARNING, "index_load: Unable to stat " STATE_SNAPSHOT_INDEX " or " STATE_SNAPSHOT_CURRENT ": %m");
+		close(fd);
+		return false;
+	}
+
+	if(st.st_size < (off_t)sizeof(struct index_header)) {
+		close(fd);
+		return false;
+	}
+
+	/* Private and writable, tables can be modified in place without touching the file */
+	char * const mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if(mapping == MAP_FAILED) {
+		syslog(LOG_WARNING, "index_load: Unable to map " STATE_SNAPSHOT_INDEX ": %m");
+		return false;
+	}
+
+	const struct index_header * const header = (const struct index_header *)mapping;
+	if(!index_is_valid(header, st.st_size, &currentst)) {
+		syslog(LOG_INFO, "Index of " STATE_SNAPSHOT_CURRENT " snapshot is outdated, parsing it");
+		munmap(mapping, st.st_size);
+		return false;
+	}
+
+	atoms_borrow(&state->atoms, mapping + header->atoms.storage, header->atoms.size,
+		(atom_t *)(mapping + header->atoms.slots), header->atoms.buckets, header->atoms.count);
+
+	set_borrow(&state->current, (atom_t *)(mapping + header->current.storage), header->current.size,
+		(uint32_t *)(mapping + header->current.slots), header->current.buckets, header->current.count);
+
+	set_borrow(&state->packages, (atom_t *)(mapping + header->packages.storage), header->packages.size,
+		(uint32_t *)(mapping + header->packages.slots), header->packages.buckets, header->packages.count);
+
+	memcpy(state->currentdigest, header->snapshotdigest, DIGEST_SIZE);
+	state->hascurrentdigest = true;
+
+	state->index = mapping;
+	state->indexsize = st.st_size;
+
+	return true;
+}
+
+/* The shared atoms table holds strings of all snapshots parsed during the run,
+ * the index only keeps those of current, so tables are rebuilt compact before being stored */
+static void
+index_compact(const struct state *state, struct atoms *atoms, struct set *current, struct set *packages) {
+	struct set_iterator iterator;
+	struct set_element element;
+
+	atoms_init(atoms);
+	set_init(current, &pair_set_class, atoms);
+	set_init(packages, &string_set_class, atoms);
+
+	set_reserve(current, state->current.count);
+	set_reserve(packages, state->packages.count);
+
+	set_iterator_init(&iterator, &state->current);
+	while(pair_set_iterator_next(&iterator, &element)) {
+		const atom_t pair[] = {
+			atoms_intern(atoms, element.key, element.keylength),
+			atoms_intern(atoms, element.value, element.valuelength),
+		};
+
+		pair_set_insert(current, pair);
+	}
+	set_iterator_deinit(&iterator);
+
+	set_iterator_init(&iterator, &state->packages);
+	while(string_set_iterator_next(&iterator, &element)) {
+		const atom_t package = atoms_intern(atoms, element.key, element.keylength);
+
+		string_set_insert(packages, &package);
+	}
+	set_iterator_deinit(&iterator);
+}
+
+static bool
+index_digest_current(const struct state *state, const struct stat *st, uint8_t result[DIGEST_SIZE]) {
+	struct digest digest;
+
+	digest_init(&digest);
+
+	if(st->st_size != 0) {
+		const int fd = openat(state->dirfd, STATE_SNAPSHOT_CURRENT, O_RDONLY);
+
+		if(fd < 0) {
+			return false;
+		}
+
+		void * const mapping = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+
+		if(mapping == MAP_FAILED) {
+			return false;
+		}
+
+		madvise(mapping, st->st_size, MADV_SEQUENTIAL);
+		digest_update(&digest, mapping, st->st_size);
+		munmap(mapping, st->st_size);
+	}
+
+	digest_final(&digest, result);
+
+	return true;
+}
+
+static uint64_t
+index_table_place(struct index_table *table, uint64_t offset, size_t count, size_t size, size_t storagesize, size_t buckets) {
+	table->count = count;
+	table->size = size;
+	table->buckets = buckets;
+	table->storage = offset;
+	table->slots = INDEX_ALIGN(table->storage + storagesize);
+
+	return INDEX_ALIGN(table->slots + buckets * sizeof(uint32_t));
+}
+
+static bool
+index_write(int fd, const void *data, size_t size, uint64_t offset) {
+	while(size != 0) {
+		const ssize_t written = pwrite(fd, data, size, offset);
+
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+
+		data = (const char *)data + written;
+		size -= written;
+		offset += written;
+	}
+
+	return true;
+}
+
+void
+index_store(struct state *state) {
+	struct index_header header = { .magic = INDEX_MAGIC, .version = INDEX_VERSION, .byteorder = INDEX_BYTEORDER };
+	struct atoms atoms;
+	struct set current, packages;
+	struct stat st;
+
+	state->hascurrentdigest = false;
+
+	if(fstatat(state->dirfd, STATE_SNAPSHOT_CURRENT, &st, AT_SYMLINK_NOFOLLOW) != 0
+		|| !index_digest_current(state, &st, header.snapshotdigest)) {
+		syslog(LOG_WARNING, "index_store: Unable to read " STATE_SNAPSHOT_CURRENT " snapshot: %m");
+		return;
+	}
+
+	memcpy(state->currentdigest, header.snapshotdigest, DIGEST_SIZE);
+	state->hascurrentdigest = true;
+
+	header.snapshotinode = st.st_ino;
+	header.snapshotsize = st.st_size;
+	header.snapshotmtime = st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+
+	index_compact(state, &atoms, &current, &packages);
+
+	uint64_t offset = INDEX_ALIGN(sizeof(header));
+	offset = index_table_place(&header.atoms, offset, atoms.count, atoms.size, atoms.size, atoms.buckets);
+	offset = index_table_place(&header.current, offset, current.count, current.size, current.size * sizeof(atom_t), current.buckets);
+	offset = index_table_place(&header.packages, offset, packages.count, packages.size, packages.size * sizeof(atom_t), packages.buckets);
+	header.size = offset;
+
+	/* Written aside then renamed, a valid index is either the previous or the new one */
+	const int fd = openat(state->dirfd, INDEX_TEMPORARY, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bool stored = fd >= 0;
+
+	/* The body is written first, the header last */
+	stored = stored && ftruncate(fd, header.size) == 0
+		&& index_write(fd, atoms.strings, atoms.size, header.atoms.storage)
+		&& index_write(fd, atoms.slots, atoms.buckets * sizeof(*atoms.slots), header.atoms.slots)
+		&& index_write(fd, current.elements, current.size * sizeof(atom_t), header.current.storage)
+		&& index_write(fd, current.slots, current.buckets * sizeof(uint32_t), header.current.slots)
+		&& index_write(fd, packages.elements, packages.size * sizeof(atom_t), header.packages.storage)
+		&& index_write(fd, packages.slots, packages.buckets * sizeof(uint32_t), header.packages.slots);
+
+	header.checksum = index_checksum(&header);
+
+	stored = stored && index_write(fd, &header, sizeof(header), 0)
+		&& fsync(fd) == 0;
+
+	if(fd >= 0) {
+		close(fd);
+	}
+
+	stored = stored && renameat(state->dirfd, INDEX_TEMPORARY, state->dirfd, STATE_SNAPSHOT_INDEX) == 0;
+
+	if(!stored) {
+		syslog(LOG_WARNING, "index_store: Unable to store " STATE_SNAPSHOT_INDEX ": %m");
+		unlinkat(state->dirfd, INDEX_TEMPORARY, 0);
+	}
+
+	set_deinit(&current);
+	set_deinit(&packages);
+	atoms_deinit(&atoms);
+}
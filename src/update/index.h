@@ -0,0 +1,27 @@
+/*
+	index.h
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#ifndef UPDATE_INDEX_H
+#define UPDATE_INDEX_H
+
+#include <stdbool.h>
+
+#include "state.h"
+
+/* Maps the index of the current snapshot, and borrows its atoms,
+ * current and packages sets into state, if it is still the one of current.
+ * Both also record the digest of current in state. */
+bool
+index_load(struct state *state);
+
+/* Stores the index of the current snapshot, atomically replacing the previous one.
+ * The index is a cache, failing to store it is not an error. */
+void
+index_store(struct state *state);
+
+/* UPDATE_INDEX_H */
+#endif
@@ -0,0 +1,79 @@
+/*
+	jobs.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "jobs.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+void
+jobs_init(struct jobs *jobs, size_t count) {
+	pthread_mutex_init(&jobs->mutex, NULL);
+	jobs->count = count;
+	jobs->next = 0;
+	jobs->failed = false;
+}
+
+void
+jobs_deinit(struct jobs *jobs) {
+	pthread_mutex_destroy(&jobs->mutex);
+}
+
+bool
+jobs_next(struct jobs *jobs, size_t *indexp) {
+	bool hasnext;
+
+	pthread_mutex_lock(&jobs->mutex);
+	hasnext = !jobs->failed && jobs->next != jobs->count;
+	if(hasnext) {
+		*indexp = jobs->next++;
+	}
+	pthread_mutex_unlock(&jobs->mutex);
+
+	return hasnext;
+}
+
+bool
+jobs_next_element(struct jobs *jobs, struct set_iterator *iterator, struct set_element *elementp) {
+	bool hasnext;
+
+	pthread_mutex_lock(&jobs->mutex);
+	hasnext = !jobs->failed && set_iterator_next(iterator, elementp);
+	pthread_mutex_unlock(&jobs->mutex);
+
+	return hasnext;
+}
+
+void
+jobs_fail(struct jobs *jobs) {
+	pthread_mutex_lock(&jobs->mutex);
+	jobs->failed = true;
+	pthread_mutex_unlock(&jobs->mutex);
+}
+
+void
+jobs_run(const char *caller, unsigned int count, void *(*routine)(void *), void *args, size_t argsize) {
+	pthread_t threads[count + 1];
+
+	for(unsigned int i = 1; i < count; i++) {
+		const int errcode = pthread_create(threads + i, NULL, routine, (char *)args + i * argsize);
+
+		if(errcode != 0) {
+			syslog(LOG_ERR, "%s: Unable to create job thread: %s", caller, strerror(errcode));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(count != 0) {
+		routine(args);
+	}
+
+	for(unsigned int i = 1; i < count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
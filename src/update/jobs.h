@@ -0,0 +1,51 @@
+/*
+	jobs.h
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#ifndef UPDATE_JOBS_H
+#define UPDATE_JOBS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "set.h"
+
+/*
+ * Tasks shared by a pool of jobs, each one taking the next task until there are none left.
+ * Once a task failed, jobs stop taking new ones, tasks in progress complete.
+ * The mutex may also be held by jobs to update what they share.
+ */
+struct jobs {
+	pthread_mutex_t mutex;
+	size_t count, next; /* Of tasks indexed in an array */
+	bool failed;
+};
+
+void
+jobs_init(struct jobs *jobs, size_t count);
+
+void
+jobs_deinit(struct jobs *jobs);
+
+/* Takes the index of the next task, false if there are none left or one failed. */
+bool
+jobs_next(struct jobs *jobs, size_t *indexp);
+
+/* Takes the next element of iterator as the next task, false if there are none left or one failed. */
+bool
+jobs_next_element(struct jobs *jobs, struct set_iterator *iterator, struct set_element *elementp);
+
+void
+jobs_fail(struct jobs *jobs);
+
+/* Runs routine in count jobs, the calling thread being the first one. The argument of
+ * the i-th job is args + i * argsize, all share args if argsize is zero. Returns once all ended. */
+void
+jobs_run(const char *caller, unsigned int count, void *(*routine)(void *), void *args, size_t argsize);
+
+/* UPDATE_JOBS_H */
+#endif
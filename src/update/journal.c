@@ -0,0 +1,120 @@
+/*
+	journal.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/*
+ * The journal lists, one per line, new geister whose clean, shift and setup completed,
+ * while applying the pending snapshot. It is created before the first shift,
+ * so its presence means all packages were fetched, and recovery only redoes
+ * the geister it doesn't list. It is removed before a new pending snapshot is written,
+ * so a journal never outlives its pending snapshot. Without it, recovery
+ * annuls and applies all new geister again, as it always did.
+ */
+
+void
+journal_open(const struct state *state, struct journal *journal, bool isresuming) {
+
+	journal->fd = openat(state->dirfd, STATE_JOURNAL, O_WRONLY | O_CREAT | O_APPEND | (isresuming ? 0 : O_TRUNC), 0644);
+	if(journal->fd < 0) {
+		syslog(LOG_ERR, "journal_open: Unable to open " STATE_JOURNAL ": %m");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The journal must be on disk before any geist is shifted, for recovery */
+	if(fsync(journal->fd) != 0 || fsync(state->dirfd) != 0) {
+		syslog(LOG_ERR, "journal_open: Unable to sync " STATE_JOURNAL ": %m");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void
+journal_record(struct journal *journal, const char *geist) {
+	const size_t geistlength = strlen(geist);
+	char line[geistlength + 1];
+
+	memcpy(line, geist, geistlength);
+	line[geistlength] = '\n';
+
+	/* Appended in a single write, a torn line is at worst a geist done again */
+	if(write(journal->fd, line, sizeof(line)) != (ssize_t)sizeof(line) || fdatasync(journal->fd) != 0) {
+		syslog(LOG_ERR, "journal_record: Unable to record %s: %m", geist);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void
+journal_close(struct journal *journal) {
+	close(journal->fd);
+}
+
+bool
+journal_load(const struct state *state, struct set *completed) {
+	const int fd = openat(state->dirfd, STATE_JOURNAL, O_RDONLY);
+
+	if(fd < 0) {
+		if(errno != ENOENT) {
+			syslog(LOG_WARNING, "journal_load: Unable to open " STATE_JOURNAL ", recovering all geister: %m");
+		}
+		return false;
+	}
+
+	FILE * const filep = fdopen(fd, "r");
+	if(filep == NULL) {
+		syslog(LOG_WARNING, "journal_load: Unable to read " STATE_JOURNAL ", recovering all geister: %m");
+		close(fd);
+		return false;
+	}
+
+	char *line = NULL;
+	size_t linecapacity = 0;
+	ssize_t linelength;
+
+	while(linelength = getline(&line, &linecapacity, filep), linelength >= 0) {
+		/* Without its newline, the line may have been torn */
+		if(linelength == 0 || line[linelength - 1] != '\n') {
+			continue;
+		}
+
+		/* A name never interned cannot be a new geist */
+		const atom_t geist = atoms_find(&state->atoms, line, linelength - 1);
+		if(geist != ATOM_NONE) {
+			string_set_insert(completed, &geist);
+		}
+	}
+
+	free(line);
+	fclose(filep);
+
+	return true;
+}
+
+void
+journal_remove(const struct state *state) {
+
+	if(unlinkat(state->dirfd, STATE_JOURNAL, 0) != 0) {
+		if(errno != ENOENT) {
+			syslog(LOG_ERR, "journal_remove: Unable to remove " STATE_JOURNAL ": %m");
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
+
+	/* Gone before a new pending snapshot can appear */
+	if(fsync(state->dirfd) != 0) {
+		syslog(LOG_ERR, "journal_remove: Unable to sync snapshots directory: %m");
+		exit(EXIT_FAILURE);
+	}
+}
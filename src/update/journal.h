@@ -0,0 +1,41 @@
+/*
+	journal.h
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#ifndef UPDATE_JOURNAL_H
+#define UPDATE_JOURNAL_H
+
+#include <stdbool.h>
+
+#include "set.h"
+#include "state.h"
+
+/* Geister of the pending snapshot whose hooks completed */
+struct journal {
+	int fd;
+};
+
+/* Opens the journal of the pending snapshot, emptied unless resuming */
+void
+journal_open(const struct state *state, struct journal *journal, bool isresuming);
+
+/* Records the geist, on disk when it returns */
+void
+journal_record(struct journal *journal, const char *geist);
+
+void
+journal_close(struct journal *journal);
+
+/* Inserts recorded geister in completed, returns false without a journal */
+bool
+journal_load(const struct state *state, struct set *completed);
+
+/* Removes the journal, once its pending snapshot is committed or replaced */
+void
+journal_remove(const struct state *state);
+
+/* UPDATE_JOURNAL_H */
+#endif
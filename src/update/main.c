@@ -9,20 +9,35 @@
 #include "fetch.h"
 #include "apply.h"
 #include "annul.h"
+#include "cache.h"
+#include "journal.h"
 #include "state.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <signal.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <stdnoreturn.h>
 
+/* Upper bound of the -j and -J options */
+#define UPDATE_JOBS_MAX 256
+
+/* Default of the -m option, in bytes */
+#define UPDATE_CACHE_BUDGET_DEFAULT (1ull << 30)
+
 struct update_args {
 	char *prefix;
 	char *snapshots;
+	char *spool;
+	char *cache;
+	unsigned long long cachebudget;
 	unsigned consistencyonly : 1;
+	unsigned reuse : 1;
 	int flags;
+	unsigned int jobs;
+	unsigned int hooksjobs;
 };
 
 static struct state state;
@@ -58,32 +73,41 @@ update_consistency(struct state *state) {
 
 	/* If pending snapshot hasn't been committed */
 	if(!check_pending(state)) {
-		struct set newgeister, newpackages;
+		struct set newgeister, newpackages, completed;
 
 		syslog(LOG_INFO, "Found previous pending snapshot, trying recovery...");
 
-		set_init(&newgeister, &pair_set_class);
-		set_init(&newpackages, &string_set_class);
-		state_diff(state, &newgeister, &newpackages);
-
-		/* Check if at least one of the new geister was installed, if not,
-		 * we cannot guarantee all packages where fetched,
-		 * and we should remove them all. */
-		const bool allnewpackagesfetched = check_new_geister(state, &newgeister);
-		annul_new_geister(state, &newgeister, &newpackages);
+		set_init(&newgeister, &pair_set_class, &state->atoms);
+		set_init(&newpackages, &string_set_class, &state->atoms);
+		set_init(&completed, &string_set_class, &state->atoms);
+		state_diff(state, &newgeister, &newpackages, NULL, NULL);
 
-		if(allnewpackagesfetched) {
-			syslog(LOG_INFO, "All packages were fetched, applying previous pending snapshot.");
-			apply_new_geister(state, &newgeister, &newpackages);
+		if(journal_load(state, &completed)) {
+			/* The journal tells which geister completed, only the others are done again */
+			syslog(LOG_INFO, "Applying was interrupted after %lu of %lu geister, resuming it.", completed.count, newgeister.count);
+			apply_resume_new_geister(state, &newgeister, &newpackages, &completed);
 			apply_pending(state);
 		} else {
-			/* Uncommitted packages will be removed during cleanup */
-			syslog(LOG_INFO, "No pending geist found, reverting pending snapshot.");
-			annul_pending(state);
+			/* Check if at least one of the new geister was installed, if not,
+			 * we cannot guarantee all packages where fetched,
+			 * and we should remove them all. */
+			const bool allnewpackagesfetched = check_new_geister(state, &newgeister);
+			annul_new_geister(state, &newgeister, &newpackages);
+
+			if(allnewpackagesfetched) {
+				syslog(LOG_INFO, "All packages were fetched, applying previous pending snapshot.");
+				apply_new_geister(state, &newgeister, &newpackages);
+				apply_pending(state);
+			} else {
+				/* Uncommitted packages will be removed during cleanup */
+				syslog(LOG_INFO, "No pending geist found, reverting pending snapshot.");
+				annul_pending(state);
+			}
 		}
 
 		set_deinit(&newgeister);
 		set_deinit(&newpackages);
+		set_deinit(&completed);
 	}
 
 	/* Remove all deprecated packages/geister,
@@ -95,7 +119,7 @@ update_consistency(struct state *state) {
 
 static void
 update_perform(struct state *state, const char *uri) {
-	struct set newgeister, newpackages;
+	struct set newgeister, newpackages, oldgeister, oldpackages;
 
 	/******************
 	 * Fetch sequence *
@@ -110,9 +134,11 @@ update_perform(struct state *state, const char *uri) {
 	fetch_snapshot(state);
 
 	/* Now that we have a pending snapshot, compute the difference between the updates */
-	set_init(&newgeister, &pair_set_class);
-	set_init(&newpackages, &string_set_class);
-	state_diff(state, &newgeister, &newpackages);
+	set_init(&newgeister, &pair_set_class, &state->atoms);
+	set_init(&newpackages, &string_set_class, &state->atoms);
+	set_init(&oldgeister, &pair_set_class, &state->atoms);
+	set_init(&oldpackages, &string_set_class, &state->atoms);
+	state_diff(state, &newgeister, &newpackages, &oldgeister, &oldpackages);
 
 	/* Newer packages are downloaded and installed at the same time */
 	fetch_new_packages(state, &newpackages);
@@ -135,16 +161,21 @@ update_perform(struct state *state, const char *uri) {
 	/* The pending snapshot is commited */
 	apply_pending(state);
 
-	/* The prefix is cleaned up if dirty */
-	apply_cleanup(state);
+	/* Deprecated geister/packages found by the diff are removed,
+	 * an interruption here is recovered by the next consistency cleanup */
+	apply_old_geister(state, &oldgeister, &oldpackages);
+
+	set_deinit(&oldgeister);
+	set_deinit(&oldpackages);
 
 	syslog(LOG_INFO, "Finished performing update.");
 }
 
 static void noreturn
 update_usage(const char *updatename, int status) {
-	fprintf(stderr, "usage: %s [-hb] [-p <prefix>] [-s <snapshots>] <uri>\n"
-	                "       %s -C [-hb] [-p <prefix>] [-s <snapshots>]\n",
+	fprintf(stderr, "usage: %s [-hbr] [-c <cache>] [-d <spool>] [-j <jobs>] [-J <hooks>] [-m <megabytes>] [-p <prefix>] [-s <snapshots>] <uri>\n"
+	                "       %s -C [-hbr] [-c <cache>] [-d <spool>] [-j <jobs>] [-J <hooks>] [-m <megabytes>] [-p <prefix>] [-s <snapshots>]\n"
+	                "Hooks of packages run one at a time, unless -J allows more to run concurrently.\n",
 		updatename, updatename);
 	exit(status);
 }
@@ -154,12 +185,18 @@ update_parse_args(int argc, char **argv) {
 	struct update_args args = {
 		.prefix = getenv("HNY_PREFIX"),
 		.snapshots = "/data/update",
+		.spool = NULL,
+		.cache = NULL,
+		.cachebudget = UPDATE_CACHE_BUDGET_DEFAULT,
 		.consistencyonly = 0,
+		.reuse = 0,
 		.flags = 0,
+		.jobs = 0,
+		.hooksjobs = 1,
 	};
 	int c;
 
-	while((c = getopt(argc, argv, ":hbCp:s:")) != -1) {
+	while((c = getopt(argc, argv, ":hbCc:d:j:J:m:p:rs:")) != -1) {
 		switch(c) {
 		case 'h':
 			update_usage(*argv, EXIT_SUCCESS);
@@ -169,9 +206,54 @@ update_parse_args(int argc, char **argv) {
 		case 'C':
 			args.consistencyonly = 1;
 			break;
+		case 'c':
+			args.cache = optarg;
+			break;
+		case 'd':
+			args.spool = optarg;
+			break;
+		case 'j': {
+			char *end;
+			const unsigned long jobs = strtoul(optarg, &end, 10);
+
+			if(jobs == 0 || jobs > UPDATE_JOBS_MAX || *end != '\0') {
+				fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+				update_usage(*argv, EXIT_FAILURE);
+			}
+
+			args.jobs = jobs;
+			break;
+		}
+		case 'J': {
+			char *end;
+			const unsigned long hooksjobs = strtoul(optarg, &end, 10);
+
+			if(hooksjobs == 0 || hooksjobs > UPDATE_JOBS_MAX || *end != '\0') {
+				fprintf(stderr, "Invalid number of hooks: %s\n", optarg);
+				update_usage(*argv, EXIT_FAILURE);
+			}
+
+			args.hooksjobs = hooksjobs;
+			break;
+		}
+		case 'm': {
+			char *end;
+			const unsigned long long megabytes = strtoull(optarg, &end, 10);
+
+			if(*optarg == '\0' || *end != '\0' || megabytes > ULLONG_MAX >> 20) {
+				fprintf(stderr, "Invalid cache size: %s\n", optarg);
+				update_usage(*argv, EXIT_FAILURE);
+			}
+
+			args.cachebudget = megabytes << 20;
+			break;
+		}
 		case 'p':
 			args.prefix = optarg;
 			break;
+		case 'r':
+			args.reuse = 1;
+			break;
 		case 's':
 			args.snapshots = optarg;
 			break;
@@ -188,6 +270,13 @@ update_parse_args(int argc, char **argv) {
 		args.prefix = "/hub";
 	}
 
+	/* One job per online processor by default */
+	if(args.jobs == 0) {
+		const long processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+		args.jobs = processors > 0 ? (processors < UPDATE_JOBS_MAX ? processors : UPDATE_JOBS_MAX) : 1;
+	}
+
 	if(argc - optind != !args.consistencyonly) {
 		update_usage(*argv, EXIT_FAILURE);
 	}
@@ -212,7 +301,12 @@ main(int argc, char **argv) {
 	update_protect_termination(isinteractive);
 
 	/* Create state context, if it encounters a pending snapshot, parses it as current or discards it */
-	state_init(&state, args.prefix, args.flags, args.snapshots);
+	state_init(&state, args.prefix, args.flags, args.snapshots, args.spool, args.jobs);
+	if(args.cache != NULL) {
+		cache_open(&state, args.cache, args.cachebudget);
+	}
+	state.isreusing = args.reuse;
+	state.hooksjobs = args.hooksjobs;
 	atexit(update_shutdown);
 
 	/* Annul or Apply previous unfinished update */
@@ -0,0 +1,489 @@
+/*
+	reuse.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "reuse.h"
+#include "digest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+/*
+ * Most updates of a package leave most of its files unchanged. Once a new package
+ * is extracted, each of its files is digested, and those unchanged since the previous
+ * version installed by the same geist are replaced by a clone of the previous file,
+ * sharing its blocks, or by a hard link to it where the filesystem cannot clone.
+ * Replacements are made aside and renamed over the extracted files right after the extraction,
+ * so filesystems delaying allocation drop the extracted pages before writing them back.
+ * Hard links share their inode, packages are never modified once extracted.
+ * The digests of the files of a package are stored in its manifest, so the previous
+ * version is not read again, an entry is trusted as long as the file still has the size
+ * and modification time it had when digested. Without a manifest, the file at the same path is compared.
+ */
+
+#define REUSE_MANIFESTS_DIRECTORY "manifests"
+#define REUSE_TEMPORARY           ".update-reuse"
+#define REUSE_FILE_SIZE_MIN       4096 /* Smaller files take a block at most, reusing them saves nothing */
+
+#ifdef __APPLE__
+#define REUSE_MTIME(st) ((st)->st_mtimespec.tv_sec * 1000000000ll + (st)->st_mtimespec.tv_nsec)
+#else
+#define REUSE_MTIME(st) ((st)->st_mtim.tv_sec * 1000000000ll + (st)->st_mtim.tv_nsec)
+#endif
+
+struct reuse_entry {
+	char digeststring[DIGEST_STRING_SIZE];
+	off_t size;
+	int64_t mtime; /* In nanoseconds */
+	const char *path; /* Relative to the package */
+};
+
+struct reuse_manifest {
+	char *contents;
+	struct reuse_entry *entries; /* Sorted by digest */
+	size_t count;
+};
+
+struct reuse_walk {
+	int previousdirfd; /* Of the previous package, or -1 */
+	const struct reuse_manifest *manifest;
+	FILE *output; /* Manifest of the new package */
+
+	size_t files, reused;
+	unsigned long long reusedsize;
+
+	char path[PATH_MAX]; /* Of the current file, relative to the package */
+};
+
+void
+reuse_prepare(struct state *state, const struct set *newpackages) {
+	struct set_iterator iterator;
+	struct set_element element;
+
+	set_empty(&state->previous);
+
+	if(!state->isreusing) {
+		return;
+	}
+
+	if(mkdirat(state->dirfd, REUSE_MANIFESTS_DIRECTORY, 0755) != 0 && errno != EEXIST) {
+		syslog(LOG_WARNING, "reuse_prepare: Unable to create " REUSE_MANIFESTS_DIRECTORY ": %m");
+	}
+
+	/* The first geist of a new package found installing something else wins */
+	set_iterator_init(&iterator, &state->pending);
+	while(pair_set_iterator_next(&iterator, &element)) {
+		const atom_t *currentpair;
+
+		if(string_set_find(newpackages, element.record + 1, NULL)
+			&& pair_set_find(&state->current, element.record, &currentpair)) {
+			const atom_t pair[] = { element.record[1], currentpair[1] };
+
+			pair_set_insert(&state->previous, pair);
+		}
+	}
+	set_iterator_deinit(&iterator);
+}
+
+/*************
+ * Manifests *
+ *************/
+
+static int
+reuse_entry_compare(const void *lhs, const void *rhs) {
+	return strcmp(((const struct reuse_entry *)lhs)->digeststring, ((const struct reuse_entry *)rhs)->digeststring);
+}
+
+/* Loads the manifest of package, lines are "<digest> <size> <mtime> <path>" */
+static bool
+reuse_manifest_load(const struct state *state, const char *package, struct reuse_manifest *manifest) {
+	char name[sizeof(REUSE_MANIFESTS_DIRECTORY) + strlen(package) + 1];
+	struct stat st;
+
+	snprintf(name, sizeof(name), REUSE_MANIFESTS_DIRECTORY "/%s", package);
+
+	const int fd = openat(state->dirfd, name, O_RDONLY);
+	if(fd < 0) {
+		return false;
+	}
+
+	if(fstat(fd, &st) != 0 || (manifest->contents = malloc(st.st_size + 1)) == NULL) {
+		close(fd);
+		return false;
+	}
+
+	const size_t size = st.st_size;
+	size_t length = 0;
+	while(length < size) {
+		const ssize_t readval = read(fd, manifest->contents + length, size - length);
+
+		if(readval <= 0) {
+			if(readval < 0 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		length += readval;
+	}
+	close(fd);
+	manifest->contents[length] = '\0';
+
+	size_t capacity = 0;
+	for(const char *current = manifest->contents; (current = strchr(current, '\n')) != NULL; current++) {
+		capacity++;
+	}
+
+	manifest->entries = malloc(capacity * sizeof(*manifest->entries) + 1); /* + 1 to never allocate zero bytes */
+	if(manifest->entries == NULL) {
+		free(manifest->contents);
+		return false;
+	}
+
+	char *line = manifest->contents, *end;
+	while((end = strchr(line, '\n')) != NULL) {
+		struct reuse_entry * const entry = manifest->entries + manifest->count;
+		char *field;
+
+		*end = '\0';
+
+		if(end - line > DIGEST_STRING_SIZE && line[DIGEST_STRING_SIZE - 1] == ' ') {
+			memcpy(entry->digeststring, line, DIGEST_STRING_SIZE - 1);
+			entry->digeststring[DIGEST_STRING_SIZE - 1] = '\0';
+
+			entry->size = strtoll(line + DIGEST_STRING_SIZE, &field, 10);
+			if(*field == ' ') {
+				entry->mtime = strtoll(field + 1, &field, 10);
+				if(*field == ' ' && field[1] != '\0') {
+					entry->path = field + 1;
+					manifest->count++;
+				}
+			}
+		}
+
+		line = end + 1;
+	}
+
+	qsort(manifest->entries, manifest->count, sizeof(*manifest->entries), reuse_entry_compare);
+
+	return true;
+}
+
+static void
+reuse_manifest_deinit(struct reuse_manifest *manifest) {
+	free(manifest->entries);
+	free(manifest->contents);
+}
+
+/*********
+ * Files *
+ *********/
+
+static bool
+reuse_digest(int fd, off_t size, char digeststring[DIGEST_STRING_SIZE]) {
+	uint8_t result[DIGEST_SIZE];
+	struct digest digest;
+
+	void * const mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(mapping == MAP_FAILED) {
+		return false;
+	}
+
+	madvise(mapping, size, MADV_SEQUENTIAL);
+	digest_init(&digest);
+	digest_update(&digest, mapping, size);
+	digest_final(&digest, result);
+	digest_string(result, digeststring);
+
+	munmap(mapping, size);
+
+	return true;
+}
+
+/* Opens the file of the previous package with the same contents, or returns -1 */
+static int
+reuse_find(const struct reuse_walk *walk, const char *digeststring, const struct stat *st, const char **pathp) {
+	const struct reuse_manifest * const manifest = walk->manifest;
+	struct stat previousst;
+
+	if(manifest->entries != NULL) {
+		struct reuse_entry key;
+
+		memcpy(key.digeststring, digeststring, DIGEST_STRING_SIZE);
+
+		const struct reuse_entry *entry = bsearch(&key, manifest->entries, manifest->count, sizeof(*manifest->entries), reuse_entry_compare);
+		if(entry == NULL) {
+			return -1;
+		}
+
+		/* Several files may share the digest, take any of them still as it was digested */
+		while(entry != manifest->entries && strcmp(entry[-1].digeststring, digeststring) == 0) {
+			entry--;
+		}
+
+		const struct reuse_entry * const end = manifest->entries + manifest->count;
+		for(; entry != end && strcmp(entry->digeststring, digeststring) == 0; entry++) {
+			const int fd = openat(walk->previousdirfd, entry->path, O_RDONLY | O_NOFOLLOW);
+
+			if(fd >= 0) {
+				if(fstat(fd, &previousst) == 0 && S_ISREG(previousst.st_mode)
+					&& previousst.st_size == st->st_size && entry->size == st->st_size
+					&& REUSE_MTIME(&previousst) == entry->mtime) {
+					*pathp = entry->path;
+					return fd;
+				}
+				close(fd);
+			}
+		}
+
+		return -1;
+	}
+
+	const int fd = openat(walk->previousdirfd, walk->path, O_RDONLY | O_NOFOLLOW);
+	if(fd >= 0) {
+		char previousdigeststring[DIGEST_STRING_SIZE];
+
+		if(fstat(fd, &previousst) == 0 && S_ISREG(previousst.st_mode) && previousst.st_size == st->st_size
+			&& reuse_digest(fd, previousst.st_size, previousdigeststring) && strcmp(previousdigeststring, digeststring) == 0) {
+			*pathp = walk->path;
+			return fd;
+		}
+		close(fd);
+	}
+
+	return -1;
+}
+
+/* Replaces name in dirfd, of status st, by a clone of, or a link to, the previous file */
+static bool
+reuse_replace(const struct reuse_walk *walk, int dirfd, const char *name, const struct stat *st, int previousfd, const char *previouspath) {
+	struct stat previousst;
+
+#ifdef FICLONE
+	/* The clone takes the metadata of the extracted file */
+	const int fd = openat(dirfd, REUSE_TEMPORARY, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if(fd >= 0) {
+		const struct timespec times[] = { st->st_atim, st->st_mtim };
+		const bool cloned = ioctl(fd, FICLONE, previousfd) == 0
+			&& fchown(fd, st->st_uid, st->st_gid) == 0
+			&& fchmod(fd, st->st_mode & 07777) == 0
+			&& futimens(fd, times) == 0;
+
+		close(fd);
+
+		if(cloned && renameat(dirfd, REUSE_TEMPORARY, dirfd, name) == 0) {
+			return true;
+		}
+
+		unlinkat(dirfd, REUSE_TEMPORARY, 0);
+	}
+#endif
+
+	/* A link shares the metadata of the previous file, only link those with the same */
+	if(fstat(previousfd, &previousst) == 0 && previousst.st_mode == st->st_mode
+		&& previousst.st_uid == st->st_uid && previousst.st_gid == st->st_gid) {
+
+		if(linkat(walk->previousdirfd, previouspath, dirfd, REUSE_TEMPORARY, 0) == 0) {
+			if(renameat(dirfd, REUSE_TEMPORARY, dirfd, name) == 0) {
+				return true;
+			}
+
+			unlinkat(dirfd, REUSE_TEMPORARY, 0);
+		}
+	}
+
+	return false;
+}
+
+static void
+reuse_file(struct reuse_walk *walk, int dirfd, const char *name, struct stat *st) {
+	char digeststring[DIGEST_STRING_SIZE];
+
+	const int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW);
+	if(fd < 0) {
+		return;
+	}
+
+	const bool isdigested = reuse_digest(fd, st->st_size, digeststring);
+	close(fd);
+
+	if(!isdigested) {
+		return;
+	}
+
+	walk->files++;
+
+	if(walk->previousdirfd >= 0) {
+		const char *previouspath;
+		const int previousfd = reuse_find(walk, digeststring, st, &previouspath);
+
+		if(previousfd >= 0) {
+			if(reuse_replace(walk, dirfd, name, st, previousfd, previouspath)
+				&& fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW) == 0) {
+				walk->reused++;
+				walk->reusedsize += st->st_size;
+			}
+			close(previousfd);
+		}
+	}
+
+	/* A newline would split the line of the path */
+	if(walk->output != NULL && strchr(walk->path, '\n') == NULL) {
+		fprintf(walk->output, "%s %lld %lld %s\n", digeststring,
+			(long long)st->st_size, (long long)REUSE_MTIME(st), walk->path);
+	}
+}
+
+/* Walks the directory fd, at path in the package, of length pathlength, and closes it */
+static void
+reuse_walk_directory(struct reuse_walk *walk, int fd, size_t pathlength) {
+	DIR * const dirp = fdopendir(fd);
+	const struct dirent *entry;
+
+	if(dirp == NULL) {
+		close(fd);
+		return;
+	}
+
+	while((entry = readdir(dirp)) != NULL) {
+		const size_t namelength = strlen(entry->d_name);
+		struct stat st;
+
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0
+			|| strcmp(entry->d_name, REUSE_TEMPORARY) == 0
+			|| pathlength + namelength + 2 > sizeof(walk->path)) {
+			continue;
+		}
+
+		memcpy(walk->path + pathlength, entry->d_name, namelength + 1);
+
+		if(fstatat(dirfd(dirp), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			continue;
+		}
+
+		if(S_ISDIR(st.st_mode)) {
+			const int subdirfd = openat(dirfd(dirp), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+
+			if(subdirfd >= 0) {
+				walk->path[pathlength + namelength] = '/';
+				reuse_walk_directory(walk, subdirfd, pathlength + namelength + 1);
+			}
+		} else if(S_ISREG(st.st_mode) && st.st_size >= REUSE_FILE_SIZE_MIN) {
+			reuse_file(walk, dirfd(dirp), entry->d_name, &st);
+		}
+	}
+
+	closedir(dirp);
+}
+
+void
+reuse_package(const struct state *state, const char *package) {
+	struct reuse_manifest manifest = { .contents = NULL };
+	struct reuse_walk walk = { .previousdirfd = -1, .manifest = &manifest };
+	const char *previous = NULL;
+
+	if(!state->isreusing) {
+		return;
+	}
+
+	const int dirfd = openat(state->prefixfd, package, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if(dirfd < 0) {
+		syslog(LOG_WARNING, "reuse_package: Unable to open '%s': %m", package);
+		return;
+	}
+
+	const atom_t atom = atoms_find_string(&state->atoms, package);
+	const atom_t *pair;
+	if(atom != ATOM_NONE && pair_set_find(&state->previous, &atom, &pair)) {
+		previous = atoms_string(&state->atoms, pair[1]);
+		walk.previousdirfd = openat(state->prefixfd, previous, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+
+		if(walk.previousdirfd >= 0) {
+			reuse_manifest_load(state, previous, &manifest);
+		}
+	}
+
+	/* The manifest is written aside, a manifest is either complete or absent */
+	const size_t packagelength = strlen(package);
+	char name[sizeof(REUSE_MANIFESTS_DIRECTORY) + packagelength + 1],
+		temporary[sizeof(REUSE_MANIFESTS_DIRECTORY) + packagelength + 2];
+
+	snprintf(name, sizeof(name), REUSE_MANIFESTS_DIRECTORY "/%s", package);
+	snprintf(temporary, sizeof(temporary), REUSE_MANIFESTS_DIRECTORY "/.%s", package);
+
+	const int outputfd = openat(state->dirfd, temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(outputfd >= 0 && (walk.output = fdopen(outputfd, "w")) == NULL) {
+		close(outputfd);
+	}
+
+	reuse_walk_directory(&walk, dirfd, 0);
+
+	if(walk.output != NULL) {
+		const bool iswritten = !ferror(walk.output);
+
+		if(fclose(walk.output) != 0 || !iswritten
+			|| renameat(state->dirfd, temporary, state->dirfd, name) != 0) {
+			syslog(LOG_WARNING, "reuse_package: Unable to write manifest of '%s': %m", package);
+			unlinkat(state->dirfd, temporary, 0);
+		}
+	}
+
+	if(walk.previousdirfd >= 0) {
+		syslog(LOG_INFO, "Reused %lu of %lu files of '%s' from '%s', %llu bytes",
+			walk.reused, walk.files, package, previous, walk.reusedsize);
+		close(walk.previousdirfd);
+	}
+
+	reuse_manifest_deinit(&manifest);
+}
+
+void
+reuse_prune(const struct state *state) {
+	const int manifestsfd = openat(state->dirfd, REUSE_MANIFESTS_DIRECTORY, O_RDONLY | O_DIRECTORY);
+	const struct dirent *entry;
+	DIR *dirp;
+
+	if(manifestsfd < 0) {
+		if(errno != ENOENT) {
+			syslog(LOG_WARNING, "reuse_prune: Unable to open " REUSE_MANIFESTS_DIRECTORY ": %m");
+		}
+		return;
+	}
+
+	dirp = fdopendir(manifestsfd);
+	if(dirp == NULL) {
+		syslog(LOG_WARNING, "reuse_prune: Unable to list " REUSE_MANIFESTS_DIRECTORY ": %m");
+		close(manifestsfd);
+		return;
+	}
+
+	/* The prefix is locked, temporaries were left by an interrupted run */
+	while((entry = readdir(dirp)) != NULL) {
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+
+		const atom_t package = atoms_find_string(&state->atoms, entry->d_name);
+		if(package == ATOM_NONE || !string_set_find(&state->packages, &package, NULL)) {
+			unlinkat(dirfd(dirp), entry->d_name, 0);
+		}
+	}
+
+	closedir(dirp);
+}
@@ -0,0 +1,28 @@
+/*
+	reuse.h
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#ifndef UPDATE_REUSE_H
+#define UPDATE_REUSE_H
+
+#include "set.h"
+#include "state.h"
+
+/* Pairs new packages with the package their geist installs in current, if reusing files. */
+void
+reuse_prepare(struct state *state, const struct set *newpackages);
+
+/* Replaces files of the freshly extracted package which are unchanged since its previous version
+ * by clones, or hard links, of the previous ones, and writes its manifest. Failing to reuse is never an error. */
+void
+reuse_package(const struct state *state, const char *package);
+
+/* Removes manifests of packages no longer in current. */
+void
+reuse_prune(const struct state *state);
+
+/* UPDATE_REUSE_H */
+#endif
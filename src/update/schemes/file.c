@@ -7,15 +7,29 @@
 */
 #include "file.h"
 
+#include "../cache.h"
+#include "../extract.h"
+#include "../jobs.h"
+#include "../reuse.h"
+#include "../spool.h"
+
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
-#include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #define FILE_SCHEME_SNAPSHOT_FILE      "snapshot"
 #define FILE_SCHEME_PACKAGES_DIRECTORY "packages"
+#define FILE_SCHEME_BUFFER_SIZE        65536
+#define FILE_SCHEME_EXTRACTION_WINDOW  (1 << 20)
+#define FILE_SCHEME_PIPELINE_DEPTH     4 /* Windows read ahead of extraction, per job */
 
 static struct {
 	const char *path;
@@ -39,7 +53,7 @@ file_scheme_open(const struct state *state, const char *uri) {
 }
 
 void
-file_scheme_snapshot(const struct state *state) {
+file_scheme_snapshot(const struct state *state, struct state_stream *stream) {
 	/* Open snapshot file */
 	int fd = openat(scheme.dirfd, FILE_SCHEME_SNAPSHOT_FILE, O_RDONLY);
 	if(fd < 0) {
@@ -47,142 +61,471 @@ file_scheme_snapshot(const struct state *state) {
 		exit(EXIT_FAILURE);
 	}
 
-	/* Determine size for read and allocation */
-	struct stat st;
-	if(fstat(fd, &st) != 0) {
-		syslog(LOG_ERR, "file_scheme_snapshot: Unable to stat snapshot file at %s/" FILE_SCHEME_SNAPSHOT_FILE ": %m", scheme.path);
-		exit(EXIT_FAILURE);
+	/* Stream the source file, a buffer at a time, memory doesn't depend on the snapshot size */
+	char buffer[FILE_SCHEME_BUFFER_SIZE];
+	size_t total = 0;
+	ssize_t readval;
+
+	while(readval = read(fd, buffer, sizeof(buffer)), readval > 0) {
+		state_stream_write(stream, buffer, readval);
+		total += readval;
 	}
 
-	if(st.st_size == 0) {
-		syslog(LOG_ERR, "file_scheme_snapshot: Invalid size for snapshot file at %s/" FILE_SCHEME_SNAPSHOT_FILE ": %m", scheme.path);
+	if(readval == -1) {
+		syslog(LOG_ERR, "file_scheme_snapshot: Unable to read snapshot file at %s/" FILE_SCHEME_SNAPSHOT_FILE ": %m", scheme.path);
 		exit(EXIT_FAILURE);
 	}
 
-	/* Allocate buffer for read/write */
-	char * const buffer = malloc(st.st_size);
-	if(buffer == NULL) {
-		syslog(LOG_ERR, "file_scheme_snapshot: Unable to allocate snapshot buffer file (%lu bytes): %m", st.st_size);
+	if(total == 0) {
+		syslog(LOG_ERR, "file_scheme_snapshot: Invalid size for snapshot file at %s/" FILE_SCHEME_SNAPSHOT_FILE, scheme.path);
 		exit(EXIT_FAILURE);
 	}
 
-	/* Read the whole source file */
-	size_t pagesize = getpagesize(), left = st.st_size;
-	char *current = buffer;
-	ssize_t readval;
+	close(fd);
+}
+
+/*
+ * Packages are extracted by a pool of jobs, largest first so the longest
+ * decompressions start early, then smaller ones fill the gaps.
+ * Each job is a pipeline of two threads: a reader takes packages from the queue
+ * and brings their windows in memory, into a ring, while an extractor uncompresses
+ * and unarchives the windows before it. So the reader is already faulting in
+ * the next windows, or the next package, while the extractor is busy, and
+ * the time each one spent waiting for the other tells which side is the bottleneck.
+ * A failing package stops readers from taking new packages, packages in the rings
+ * complete, then we exit as the sequential loop did. Packages left unextracted
+ * or partially extracted are what check_new_geister and annul_new_geister already recover from.
+ */
+
+struct file_scheme_package {
+	const char *name;
+	off_t size;
+};
+
+/* A window of a package, either in its mapping, or read in buffer */
+struct file_scheme_window {
+	const struct file_scheme_package *package; /* NULL once the reader is done */
+	const char *data;
+	size_t length;
+	char *buffer;
+	void *mapping;      /* To unmap after the last window, or MAP_FAILED */
+	size_t mappingsize;
+	bool isfirst, islast;
+	bool iserror;       /* The package could not be read up to its end, already reported */
+};
+
+struct file_scheme_pipeline {
+	struct file_scheme_extractions *extractions;
+	pthread_t reader, extractor;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t filled, emptied;
+	struct file_scheme_window ring[FILE_SCHEME_PIPELINE_DEPTH];
+	unsigned int first, count;
+
+	struct timespec readerblocked, extractorblocked;
+};
+
+struct file_scheme_extractions {
+	const struct state *state;
+	int packagesdirfd;
 
-	while(readval = read(fd, current, pagesize), readval > 0) {
-		current += readval;
-		left -= readval;
+	struct jobs jobs; /* Over packages */
+	struct file_scheme_package *packages;
+};
+
+static int
+file_scheme_package_compare(const void *lhs, const void *rhs) {
+	const off_t lhssize = ((const struct file_scheme_package *)lhs)->size,
+		rhssize = ((const struct file_scheme_package *)rhs)->size;
+
+	return (lhssize < rhssize) - (lhssize > rhssize);
+}
+
+/* Waits on cond, accumulating the time spent in blocked */
+static void
+file_scheme_pipeline_wait(struct file_scheme_pipeline *pipeline, pthread_cond_t *cond, struct timespec *blocked) {
+	struct timespec begin, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	pthread_cond_wait(cond, &pipeline->mutex);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	blocked->tv_sec += end.tv_sec - begin.tv_sec;
+	blocked->tv_nsec += end.tv_nsec - begin.tv_nsec;
+	if(blocked->tv_nsec < 0) {
+		blocked->tv_sec--;
+		blocked->tv_nsec += 1000000000;
+	} else if(blocked->tv_nsec >= 1000000000) {
+		blocked->tv_sec++;
+		blocked->tv_nsec -= 1000000000;
 	}
+}
 
-	if(readval == -1) {
-		syslog(LOG_ERR, "file_scheme_snapshot: Unable to read snapshot file at %s/" FILE_SCHEME_SNAPSHOT_FILE ": %m", scheme.path);
-		exit(EXIT_FAILURE);
+/* Next free window of the ring, for the reader to fill */
+static struct file_scheme_window *
+file_scheme_pipeline_acquire(struct file_scheme_pipeline *pipeline) {
+	struct file_scheme_window *window;
+
+	pthread_mutex_lock(&pipeline->mutex);
+	while(pipeline->count == FILE_SCHEME_PIPELINE_DEPTH) {
+		file_scheme_pipeline_wait(pipeline, &pipeline->emptied, &pipeline->readerblocked);
 	}
+	window = pipeline->ring + (pipeline->first + pipeline->count) % FILE_SCHEME_PIPELINE_DEPTH;
+	pthread_mutex_unlock(&pipeline->mutex);
 
-	close(fd);
+	window->package = NULL;
+	window->length = 0;
+	window->mapping = MAP_FAILED;
+	window->isfirst = false;
+	window->islast = false;
+	window->iserror = false;
 
-	/* Source file completely read in buffer, opening pending */
-	fd = openat(state->dirfd, STATE_SNAPSHOT_PENDING, O_CREAT | O_WRONLY | O_TRUNC);
-	if(fd < 0) {
-		syslog(LOG_ERR, "file_scheme_snapshot: Unable to create " STATE_SNAPSHOT_PENDING " snapshot file: %m");
-		exit(EXIT_FAILURE);
+	return window;
+}
+
+static void
+file_scheme_pipeline_fill(struct file_scheme_pipeline *pipeline) {
+	pthread_mutex_lock(&pipeline->mutex);
+	pipeline->count++;
+	pthread_cond_signal(&pipeline->filled);
+	pthread_mutex_unlock(&pipeline->mutex);
+}
+
+static void
+file_scheme_read_mapped(struct file_scheme_pipeline *pipeline, const struct file_scheme_package *package, char *mapping, size_t size) {
+	const size_t pagesize = getpagesize();
+	const char *current = mapping, * const end = mapping + size;
+
+	madvise(mapping, size, MADV_SEQUENTIAL);
+
+	while(current != end) {
+		struct file_scheme_window * const window = file_scheme_pipeline_acquire(pipeline);
+		const size_t length = end - current < FILE_SCHEME_EXTRACTION_WINDOW ? end - current : FILE_SCHEME_EXTRACTION_WINDOW;
+
+		/* Fault the window in here, so the extractor doesn't block on it */
+		for(size_t offset = 0; offset < length; offset += pagesize) {
+			(void)*(const volatile char *)(current + offset);
+		}
+
+		window->package = package;
+		window->data = current;
+		window->length = length;
+		window->isfirst = current == mapping;
+		current += length;
+		window->islast = current == end;
+		if(window->islast) {
+			window->mapping = mapping;
+			window->mappingsize = size;
+		}
+
+		file_scheme_pipeline_fill(pipeline);
 	}
+}
 
-	/* Write the pending snapshot, hoping the filesystem is transactional on writes */
-	const ssize_t writeval = write(fd, buffer, st.st_size);
-	if(writeval != st.st_size) {
-		if(writeval == -1) {
-			syslog(LOG_ERR, "file_scheme_snapshot: Unable to write " STATE_SNAPSHOT_PENDING " snapshot: %m");
-		exit(EXIT_FAILURE);
+/* Fallback when the package cannot be mapped, reads are large and hinted sequential */
+static void
+file_scheme_read_buffered(struct file_scheme_pipeline *pipeline, const struct file_scheme_package *package, int fd) {
+	bool isfirst = true, islast;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	do {
+		struct file_scheme_window * const window = file_scheme_pipeline_acquire(pipeline);
+		ssize_t readval = -1;
+
+		if(window->buffer != NULL || (window->buffer = malloc(FILE_SCHEME_EXTRACTION_WINDOW)) != NULL) {
+			readval = read(fd, window->buffer, FILE_SCHEME_EXTRACTION_WINDOW);
+		}
+
+		window->package = package;
+		window->data = window->buffer;
+		window->isfirst = isfirst;
+
+		if(readval < 0) {
+			syslog(LOG_ERR, "file_scheme_packages: Unable to read from package '%s': %m", package->name);
+			window->iserror = true;
+			islast = true;
 		} else {
-			syslog(LOG_ERR, "file_scheme_snapshot: Unable to write whole snapshot at %s/" FILE_SCHEME_SNAPSHOT_FILE " in " STATE_SNAPSHOT_PENDING " snapshot: %m", scheme.path);
-		exit(EXIT_FAILURE);
+			window->length = readval;
+			islast = readval == 0;
 		}
+
+		window->islast = islast;
+		isfirst = false;
+
+		file_scheme_pipeline_fill(pipeline);
+	} while(!islast);
+}
+
+static void *
+file_scheme_pipeline_read(void *arg) {
+	struct file_scheme_pipeline * const pipeline = arg;
+	struct file_scheme_extractions * const extractions = pipeline->extractions;
+	size_t index;
+
+	while(jobs_next(&extractions->jobs, &index)) {
+		const struct file_scheme_package * const package = extractions->packages + index;
+
+		/* Open package file, a complete one in the spool doesn't need to be read from the source */
+		int fd = spool_find(extractions->state, package->name);
+		if(fd < 0) {
+			fd = openat(extractions->packagesdirfd, package->name, O_RDONLY);
+		}
+
+		if(fd < 0) {
+			syslog(LOG_ERR, "file_scheme_packages: Unable to open package '%s' at %s/" FILE_SCHEME_PACKAGES_DIRECTORY ": %m", package->name, scheme.path);
+			jobs_fail(&extractions->jobs);
+			break;
+		}
+
+		/* Regular files are mapped, the kernel reads ahead without any copy to userspace */
+		struct stat st;
+		void *mapping = MAP_FAILED;
+
+		if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size != 0) {
+			mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+
+		if(mapping != MAP_FAILED) {
+			file_scheme_read_mapped(pipeline, package, mapping, st.st_size);
+		} else {
+			file_scheme_read_buffered(pipeline, package, fd);
+		}
+
+		close(fd);
 	}
 
-	close(fd);
+	/* Tell the extractor we're done */
+	file_scheme_pipeline_acquire(pipeline);
+	file_scheme_pipeline_fill(pipeline);
+
+	return NULL;
+}
+
+static void *
+file_scheme_pipeline_extract(void *arg) {
+	struct file_scheme_pipeline * const pipeline = arg;
+	struct file_scheme_extractions * const extractions = pipeline->extractions;
+	const struct state * const state = extractions->state;
+	struct hny_extraction *extraction = NULL;
+	enum hny_extraction_status status = HNY_EXTRACTION_STATUS_OK;
+	struct cache_entry cache;
+	int errcode = 0;
+
+	for(;;) {
+		struct file_scheme_window *window;
 
-	/* Don't forget to deallocate the buffer */
-	free(buffer);
+		pthread_mutex_lock(&pipeline->mutex);
+		while(pipeline->count == 0) {
+			file_scheme_pipeline_wait(pipeline, &pipeline->filled, &pipeline->extractorblocked);
+		}
+		window = pipeline->ring + pipeline->first;
+		pthread_mutex_unlock(&pipeline->mutex);
+
+		if(window->package == NULL) {
+			break;
+		}
+
+		const char * const package = window->package->name;
+
+		if(window->isfirst) {
+			/* Create extraction handler, incomplete until hny reports the end of the archive */
+			status = HNY_EXTRACTION_STATUS_OK;
+			errcode = hny_extraction_create(&extraction, state->hny, package);
+			if(errcode != 0) {
+				syslog(LOG_ERR, "file_scheme_packages: Unable to create extraction: %s", strerror(errcode));
+				jobs_fail(&extractions->jobs);
+				extraction = NULL;
+			} else {
+				cache_entry_create(state, package, &cache);
+			}
+		}
+
+		if(extraction != NULL && window->length != 0) {
+			if(status == HNY_EXTRACTION_STATUS_OK) {
+				status = hny_extraction_extract(extraction, window->data, window->length, &errcode);
+			}
+			cache_entry_write(state, &cache, window->data, window->length);
+		}
+
+		if(window->islast) {
+			if(extraction != NULL) {
+				const bool isextracted = !window->iserror && extract_status("file_scheme_packages", package, status, errcode);
+
+				if(isextracted) {
+					cache_entry_commit(state, package, &cache);
+				} else {
+					jobs_fail(&extractions->jobs);
+					cache_entry_abort(state, &cache);
+				}
+
+				/* Don't forget to close */
+				hny_extraction_destroy(extraction);
+				extraction = NULL;
+
+				if(isextracted) {
+					reuse_package(state, package);
+				}
+			} else if(window->iserror) {
+				jobs_fail(&extractions->jobs);
+			}
+
+			if(window->mapping != MAP_FAILED) {
+				munmap(window->mapping, window->mappingsize);
+			}
+		}
+
+		pthread_mutex_lock(&pipeline->mutex);
+		pipeline->first = (pipeline->first + 1) % FILE_SCHEME_PIPELINE_DEPTH;
+		pipeline->count--;
+		pthread_cond_signal(&pipeline->emptied);
+		pthread_mutex_unlock(&pipeline->mutex);
+	}
+
+	return NULL;
 }
 
 void
 file_scheme_packages(const struct state *state, const struct set *packages) {
+	struct file_scheme_extractions extractions = { .state = state };
+
 	/* Open packages directory */
-	int packagesdirfd = openat(scheme.dirfd, FILE_SCHEME_PACKAGES_DIRECTORY , O_RDONLY | O_DIRECTORY);
-	if(packagesdirfd < 0) {
+	extractions.packagesdirfd = openat(scheme.dirfd, FILE_SCHEME_PACKAGES_DIRECTORY , O_RDONLY | O_DIRECTORY);
+	if(extractions.packagesdirfd < 0) {
 		syslog(LOG_ERR, "file_scheme_packages: Unable to open packages directory at %s/" FILE_SCHEME_PACKAGES_DIRECTORY ": %m", scheme.path);
 		exit(EXIT_FAILURE);
 	}
 
-	/* Iterate every packages */
+	extractions.packages = malloc(packages->count * sizeof(*extractions.packages) + 1); /* + 1 to never allocate zero bytes */
+	if(extractions.packages == NULL) {
+		syslog(LOG_ERR, "file_scheme_packages: Unable to allocate %lu packages: %m", packages->count);
+		exit(EXIT_FAILURE);
+	}
+
+	/* List every packages with their size, a missing one is reported when read */
 	struct set_iterator packagesiterator;
+	struct set_element element;
+	size_t count = 0;
 
 	set_iterator_init(&packagesiterator, packages);
+	while(set_iterator_next(&packagesiterator, &element)) {
+		struct file_scheme_package * const package = extractions.packages + count++;
+		struct stat st;
 
-	const void *element;
-	size_t elementsize;
-	while(set_iterator_next(&packagesiterator, &element, &elementsize)) {
-		const char * const package = element;
-		/* Open package file */
-		const int fd = openat(packagesdirfd, package, O_RDONLY);
-		struct hny_extraction *extraction;
+		package->name = element.key;
+		package->size = fstatat(extractions.packagesdirfd, package->name, &st, 0) == 0 ? st.st_size : 0;
+	}
+	set_iterator_deinit(&packagesiterator);
 
-		if(packagesdirfd < 0) {
-			syslog(LOG_ERR, "file_scheme_packages: Unable to open packages directory at %s/" FILE_SCHEME_PACKAGES_DIRECTORY ": %m", scheme.path);
-		exit(EXIT_FAILURE);
-		}
+	qsort(extractions.packages, count, sizeof(*extractions.packages), file_scheme_package_compare);
+	jobs_init(&extractions.jobs, count);
 
-		/* Create extraction handler */
-		int errcode = hny_extraction_create(&extraction, state->hny, package);
-		if(errcode != 0) {
-			syslog(LOG_ERR, "file_scheme_packages: Unable to create extraction: %s", strerror(errcode));
-		exit(EXIT_FAILURE);
+	const unsigned int jobs = count < state->jobs ? count : state->jobs;
+	struct file_scheme_pipeline pipelines[jobs + 1];
+
+	for(unsigned int i = 0; i < jobs; i++) {
+		struct file_scheme_pipeline * const pipeline = pipelines + i;
+		int errcode;
+
+		*pipeline = (struct file_scheme_pipeline) {
+			.extractions = &extractions,
+			.mutex = PTHREAD_MUTEX_INITIALIZER,
+			.filled = PTHREAD_COND_INITIALIZER,
+			.emptied = PTHREAD_COND_INITIALIZER,
+		};
+
+		if((errcode = pthread_create(&pipeline->reader, NULL, file_scheme_pipeline_read, pipeline)) != 0
+			|| (errcode = pthread_create(&pipeline->extractor, NULL, file_scheme_pipeline_extract, pipeline)) != 0) {
+			syslog(LOG_ERR, "file_scheme_packages: Unable to create extraction thread: %s", strerror(errcode));
+			exit(EXIT_FAILURE);
 		}
+	}
 
-		/* Extract everything */
-		char buffer[getpagesize()];
-		enum hny_extraction_status status;
-		ssize_t readval;
-		while((readval = read(fd, buffer, sizeof(buffer))) > 0
-			&& (status = hny_extraction_extract(extraction, buffer, readval, &errcode))
-				== HNY_EXTRACTION_STATUS_OK);
+	struct timespec readerblocked = { 0 }, extractorblocked = { 0 };
+	for(unsigned int i = 0; i < jobs; i++) {
+		struct file_scheme_pipeline * const pipeline = pipelines + i;
 
-		/* Handle errors */
-		if(readval == -1) {
-			syslog(LOG_ERR, "file_scheme_packages: Unable to read from package '%s': %m", package);
-		exit(EXIT_FAILURE);
-		} else if(HNY_EXTRACTION_STATUS_IS_ERROR(status)) {
-			if(HNY_EXTRACTION_STATUS_IS_ERROR_XZ(status)) {
-				syslog(LOG_ERR, "file_scheme_packages: Unable to extract '%s', error while uncompressing", package);
-		exit(EXIT_FAILURE);
-			} else if(HNY_EXTRACTION_STATUS_IS_ERROR_CPIO(status)) {
-				if(HNY_EXTRACTION_STATUS_IS_ERROR_CPIO_SYSTEM(status)) {
-					syslog(LOG_ERR, "file_scheme_packages: Unable to extract '%s', system error while unarchiving: %s", package, strerror(errcode));
-		exit(EXIT_FAILURE);
-				} else {
-					syslog(LOG_ERR, "file_scheme_packages: Unable to extract '%s', error while unarchiving", package);
-		exit(EXIT_FAILURE);
-				}
-			} else {
-				syslog(LOG_ERR, "file_scheme_packages: Unable to extract '%s', archive not finished", package);
-		exit(EXIT_FAILURE);
-			}
+		pthread_join(pipeline->reader, NULL);
+		pthread_join(pipeline->extractor, NULL);
+
+		readerblocked.tv_sec += pipeline->readerblocked.tv_sec;
+		readerblocked.tv_nsec += pipeline->readerblocked.tv_nsec;
+		extractorblocked.tv_sec += pipeline->extractorblocked.tv_sec;
+		extractorblocked.tv_nsec += pipeline->extractorblocked.tv_nsec;
+
+		for(unsigned int j = 0; j < FILE_SCHEME_PIPELINE_DEPTH; j++) {
+			free(pipeline->ring[j].buffer);
 		}
+		pthread_cond_destroy(&pipeline->filled);
+		pthread_cond_destroy(&pipeline->emptied);
+		pthread_mutex_destroy(&pipeline->mutex);
+	}
 
-		/* Don't forget to close */
-		hny_extraction_destroy(extraction);
-		close(fd);
+	if(extractions.jobs.failed) {
+		exit(EXIT_FAILURE);
 	}
 
-	set_iterator_deinit(&packagesiterator);
+	syslog(LOG_INFO, "Extracted %lu packages with %u jobs, reads waited %.3fs on extractions, extractions waited %.3fs on reads",
+		count, jobs, readerblocked.tv_sec + readerblocked.tv_nsec / 1e9, extractorblocked.tv_sec + extractorblocked.tv_nsec / 1e9);
+
+	free(extractions.packages);
+	jobs_deinit(&extractions.jobs);
 
 	/* Don't forget to close packages directory */
-	close(packagesdirfd);
+	close(extractions.packagesdirfd);
+}
+
+/**********
+ * Chunks *
+ **********/
+
+/* Files are read from the source directory, there is nothing to connect to */
+static void *
+file_scheme_chunks_connect(const struct state *state) {
+	return &scheme;
 }
 
+static enum chunk_get_status
+file_scheme_chunks_get(void *connection, const char *file, chunk_sink_t sink, void *arg) {
+	const int fd = openat(scheme.dirfd, file, O_RDONLY);
+
+	if(fd < 0) {
+		if(errno == ENOENT) {
+			return CHUNK_GET_MISSING;
+		}
+		syslog(LOG_ERR, "file_scheme_chunks: Unable to open %s/%s: %m", scheme.path, file);
+		return CHUNK_GET_ERROR;
+	}
+
+	char buffer[FILE_SCHEME_BUFFER_SIZE];
+	ssize_t readval;
+	bool sunk = true;
+
+	while(sunk && (readval = read(fd, buffer, sizeof(buffer))) > 0) {
+		sunk = sink(arg, buffer, readval);
+	}
+
+	if(sunk && readval < 0) {
+		syslog(LOG_ERR, "file_scheme_chunks: Unable to read %s/%s: %m", scheme.path, file);
+	}
+
+	close(fd);
+
+	return sunk && readval == 0 ? CHUNK_GET_OK : CHUNK_GET_ERROR;
+}
+
+static void
+file_scheme_chunks_disconnect(void *connection) {
+}
+
+const struct chunk_source file_scheme_chunks = {
+	.jobsmax = UINT_MAX,
+	.connect = file_scheme_chunks_connect,
+	.get = file_scheme_chunks_get,
+	.disconnect = file_scheme_chunks_disconnect,
+};
+
 void
 file_scheme_close(const struct state *state) {
 	close(scheme.dirfd);
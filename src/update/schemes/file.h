@@ -8,6 +8,7 @@
 #ifndef UPDATE_SCHEMES_FILE_H
 #define UPDATE_SCHEMES_FILE_H
 
+#include "../chunk.h"
 #include "../set.h"
 #include "../state.h"
 
@@ -17,11 +18,13 @@ void
 file_scheme_open(const struct state *state, const char *uri);
 
 void
-file_scheme_snapshot(const struct state *state);
+file_scheme_snapshot(const struct state *state, struct state_stream *stream);
 
 void
 file_scheme_packages(const struct state *state, const struct set *packages);
 
+extern const struct chunk_source file_scheme_chunks;
+
 void
 file_scheme_close(const struct state *state);
 
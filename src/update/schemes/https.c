@@ -7,22 +7,877 @@
 */
 #include "https.h"
 
+#include "../cache.h"
+#include "../extract.h"
+#include "../jobs.h"
+#include "../reuse.h"
+#include "../spool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
 #define HTTPS_SCHEME_SNAPSHOT_FILE      "snapshot"
 #define HTTPS_SCHEME_PACKAGES_DIRECTORY "packages"
+#define HTTPS_SCHEME_DEFAULT_PORT       "443"
+#define HTTPS_SCHEME_CONNECTIONS_MAX    8  /* Concurrent transfers, whatever the number of jobs */
+#define HTTPS_SCHEME_TIMEOUT            30 /* Seconds a connection may stall before failing */
+#define HTTPS_SCHEME_BUFFER_SIZE        65536
+#define HTTPS_SCHEME_LINE_MAX           8192
+
+/*
+ * Minimal HTTP/1.1 client over TLS. Certificates are verified against the default
+ * trust store, which SSL_CERT_FILE and SSL_CERT_DIR override, eg. to test against
+ * a self-signed server. Connections are kept alive between requests, and each job
+ * fetching packages has its own, so several transfers are in flight.
+ * Response bodies are handed to a sink as they are received, nothing is spooled.
+ */
+
+static struct {
+	char *authority; /* As in the uri, for the Host header */
+	char *host;
+	char *port;
+	char *path;      /* Without trailing slash, so possibly empty */
+	SSL_CTX *context;
+	struct sigaction sigpipe; /* Disposition to restore on close, ignored ones are inherited by hooks */
+} scheme;
+
+struct https_connection {
+	int fd;
+	SSL *ssl;
+	unsigned long requests; /* Sent on this connection */
+	bool isreusable;        /* The previous response let us send another request */
+	bool isclosed;          /* The server closed the connection cleanly */
+	size_t begin, end;      /* Received but not yet consumed */
+	char buffer[HTTPS_SCHEME_BUFFER_SIZE];
+};
+
+/* Receives response bodies, returning false aborts the transfer */
+typedef bool (*https_sink_t)(void *arg, const char *data, size_t length);
+
+static const char *
+https_scheme_ssl_error(char *buffer, size_t size) {
+	const unsigned long error = ERR_get_error();
+
+	if(error == 0) {
+		snprintf(buffer, size, "%s", "Connection closed");
+	} else {
+		ERR_error_string_n(error, buffer, size);
+	}
+	ERR_clear_error();
+
+	return buffer;
+}
+
+static void
+https_connection_init(struct https_connection *connection) {
+	connection->fd = -1;
+	connection->ssl = NULL;
+	connection->requests = 0;
+	connection->isreusable = false;
+	connection->isclosed = false;
+	connection->begin = 0;
+	connection->end = 0;
+}
+
+static void
+https_connection_close(struct https_connection *connection) {
+	if(connection->ssl != NULL) {
+		SSL_free(connection->ssl);
+		connection->ssl = NULL;
+	}
+
+	if(connection->fd >= 0) {
+		close(connection->fd);
+		connection->fd = -1;
+	}
+
+	connection->requests = 0;
+	connection->isreusable = false;
+	connection->isclosed = false;
+	connection->begin = 0;
+	connection->end = 0;
+}
+
+static bool
+https_connection_connect(struct https_connection *connection) {
+	const struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct addrinfo *addresses;
+	char error[256];
+
+	const int errcode = getaddrinfo(scheme.host, scheme.port, &hints, &addresses);
+	if(errcode != 0) {
+		syslog(LOG_ERR, "https_scheme: Unable to resolve %s: %s", scheme.host, gai_strerror(errcode));
+		return false;
+	}
+
+	for(const struct addrinfo *address = addresses; address != NULL; address = address->ai_next) {
+		connection->fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+
+		if(connection->fd >= 0) {
+			if(connect(connection->fd, address->ai_addr, address->ai_addrlen) == 0) {
+				break;
+			}
+
+			close(connection->fd);
+			connection->fd = -1;
+		}
+	}
+
+	freeaddrinfo(addresses);
+
+	if(connection->fd < 0) {
+		syslog(LOG_ERR, "https_scheme: Unable to connect to %s: %m", scheme.authority);
+		return false;
+	}
+
+	/* Stalled servers fail transfers instead of hanging the update */
+	const struct timeval timeout = { .tv_sec = HTTPS_SCHEME_TIMEOUT };
+	setsockopt(connection->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(connection->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	connection->ssl = SSL_new(scheme.context);
+	if(connection->ssl == NULL || SSL_set_fd(connection->ssl, connection->fd) != 1) {
+		syslog(LOG_ERR, "https_scheme: Unable to create TLS session: %s", https_scheme_ssl_error(error, sizeof(error)));
+		https_connection_close(connection);
+		return false;
+	}
+
+	/* Addresses are checked against the certificate as such, names are also sent for virtual hosting */
+	unsigned char address[sizeof(struct in6_addr)];
+	if(inet_pton(AF_INET, scheme.host, address) == 1 || inet_pton(AF_INET6, scheme.host, address) == 1) {
+		X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(connection->ssl), scheme.host);
+	} else {
+		SSL_set_tlsext_host_name(connection->ssl, scheme.host);
+		SSL_set1_host(connection->ssl, scheme.host);
+	}
+
+	if(SSL_connect(connection->ssl) != 1) {
+		const long verification = SSL_get_verify_result(connection->ssl);
+
+		if(verification != X509_V_OK) {
+			syslog(LOG_ERR, "https_scheme: Unable to verify %s: %s", scheme.authority, X509_verify_cert_error_string(verification));
+		} else {
+			syslog(LOG_ERR, "https_scheme: Unable to establish TLS with %s: %s", scheme.authority, https_scheme_ssl_error(error, sizeof(error)));
+		}
+		https_connection_close(connection);
+		return false;
+	}
+
+	connection->isreusable = true;
+
+	return true;
+}
+
+/* Receives more data after what is buffered, returns false on error or closure */
+static bool
+https_connection_fill(struct https_connection *connection) {
+
+	if(connection->begin == connection->end) {
+		connection->begin = 0;
+		connection->end = 0;
+	} else if(connection->end == sizeof(connection->buffer)) {
+		memmove(connection->buffer, connection->buffer + connection->begin, connection->end - connection->begin);
+		connection->end -= connection->begin;
+		connection->begin = 0;
+	}
+
+	const int received = SSL_read(connection->ssl, connection->buffer + connection->end,
+		sizeof(connection->buffer) - connection->end);
+
+	if(received <= 0) {
+		connection->isclosed = SSL_get_error(connection->ssl, received) == SSL_ERROR_ZERO_RETURN;
+		return false;
+	}
+
+	connection->end += received;
+
+	return true;
+}
+
+static bool
+https_connection_line(struct https_connection *connection, char *line, size_t capacity) {
+	const char *newline;
+
+	while(newline = memchr(connection->buffer + connection->begin, '\n', connection->end - connection->begin),
+		newline == NULL) {
+		if(connection->end - connection->begin >= capacity || !https_connection_fill(connection)) {
+			return false;
+		}
+	}
+
+	size_t length = newline - (connection->buffer + connection->begin);
+	if(length >= capacity) {
+		return false;
+	}
+
+	memcpy(line, connection->buffer + connection->begin, length);
+	connection->begin += length + 1;
+
+	if(length != 0 && line[length - 1] == '\r') {
+		length--;
+	}
+	line[length] = '\0';
+
+	return true;
+}
+
+/* Hands length bytes to the sink, straight from the receive buffer */
+static bool
+https_connection_body(struct https_connection *connection, size_t length, https_sink_t sink, void *arg, bool *sunk) {
+
+	while(length != 0) {
+		if(connection->begin == connection->end && !https_connection_fill(connection)) {
+			return false;
+		}
+
+		const size_t available = connection->end - connection->begin,
+			sinklength = available < length ? available : length;
+
+		if(!sink(arg, connection->buffer + connection->begin, sinklength)) {
+			*sunk = false;
+			return false;
+		}
+
+		connection->begin += sinklength;
+		length -= sinklength;
+	}
+
+	return true;
+}
+
+static bool
+https_connection_body_chunked(struct https_connection *connection, https_sink_t sink, void *arg, bool *sunk) {
+	char line[HTTPS_SCHEME_LINE_MAX];
+
+	for(;;) {
+		char *end;
+
+		if(!https_connection_line(connection, line, sizeof(line))) {
+			return false;
+		}
+
+		/* Chunk extensions, after a semicolon, are ignored */
+		const unsigned long long length = strtoull(line, &end, 16);
+		if(end == line || (*end != '\0' && *end != ';' && *end != ' ')) {
+			return false;
+		}
+
+		if(length == 0) {
+			break;
+		}
+
+		if(!https_connection_body(connection, length, sink, arg, sunk)
+			|| !https_connection_line(connection, line, sizeof(line)) || *line != '\0') {
+			return false;
+		}
+	}
+
+	/* Trailer fields, until the empty line */
+	do {
+		if(!https_connection_line(connection, line, sizeof(line))) {
+			return false;
+		}
+	} while(*line != '\0');
+
+	return true;
+}
+
+/* Without length nor chunks, the body ends with the connection */
+static bool
+https_connection_body_closed(struct https_connection *connection, https_sink_t sink, void *arg, bool *sunk) {
+
+	connection->isreusable = false;
+
+	for(;;) {
+		if(connection->begin != connection->end) {
+			if(!sink(arg, connection->buffer + connection->begin, connection->end - connection->begin)) {
+				*sunk = false;
+				return false;
+			}
+			connection->begin = connection->end;
+		}
+
+		if(!https_connection_fill(connection)) {
+			return connection->isclosed;
+		}
+	}
+}
+
+static bool
+https_connection_send(struct https_connection *connection, const char *file, off_t offset) {
+	char request[HTTPS_SCHEME_LINE_MAX], range[64] = "";
+
+	if(offset != 0) {
+		snprintf(range, sizeof(range), "Range: bytes=%lld-\r\n", (long long)offset);
+	}
+
+	const int length = snprintf(request, sizeof(request),
+		"GET %s/%s HTTP/1.1\r\n"
+		"Host: %s\r\n"
+		"User-Agent: update\r\n"
+		"Accept-Encoding: identity\r\n"
+		"%s"
+		"\r\n", scheme.path, file, scheme.authority, range);
+
+	if(length < 0 || (size_t)length >= sizeof(request)) {
+		return false;
+	}
+
+	connection->requests++;
+
+	return SSL_write(connection->ssl, request, length) == length;
+}
+
+/* Whether the comma separated list of a header field has token */
+static bool
+https_scheme_has_token(const char *value, const char *token) {
+	const size_t tokenlength = strlen(token);
+
+	while(*value != '\0') {
+		const size_t length = strcspn(value, ", \t");
+
+		if(length == tokenlength && strncasecmp(value, token, length) == 0) {
+			return true;
+		}
+
+		value += length;
+		value += strspn(value, ", \t");
+	}
+
+	return false;
+}
+
+struct https_response {
+	int status;
+	bool ischunked;
+	long long contentlength; /* Or -1 */
+	long long rangestart;    /* First byte of a partial content, or -1 */
+};
+
+/* Reads the status line and header fields, returns false on error */
+static bool
+https_connection_head(struct https_connection *connection, struct https_response *response) {
+	char line[HTTPS_SCHEME_LINE_MAX];
+	int minor;
+
+	if(!https_connection_line(connection, line, sizeof(line))
+		|| sscanf(line, "HTTP/1.%d %d", &minor, &response->status) != 2) {
+		return false;
+	}
+
+	connection->isreusable = minor != 0;
+	response->ischunked = false;
+	response->contentlength = -1;
+	response->rangestart = -1;
+
+	while(https_connection_line(connection, line, sizeof(line))) {
+		char * const colon = strchr(line, ':');
+
+		if(*line == '\0') {
+			return true;
+		}
+
+		if(colon == NULL) {
+			continue;
+		}
+
+		const char *value = colon + 1;
+		*colon = '\0';
+		while(*value == ' ' || *value == '\t') {
+			value++;
+		}
+
+		if(strcasecmp(line, "Content-Length") == 0) {
+			response->contentlength = strtoll(value, NULL, 10);
+		} else if(strcasecmp(line, "Content-Range") == 0) {
+			if(sscanf(value, "bytes %lld-", &response->rangestart) != 1) {
+				response->rangestart = -1;
+			}
+		} else if(strcasecmp(line, "Transfer-Encoding") == 0) {
+			response->ischunked = https_scheme_has_token(value, "chunked");
+		} else if(strcasecmp(line, "Connection") == 0) {
+			if(https_scheme_has_token(value, "close")) {
+				connection->isreusable = false;
+			} else if(https_scheme_has_token(value, "keep-alive")) {
+				connection->isreusable = true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/* Requests file, relative to the uri, and reads the head of the response. Reuses the connection
+ * if it is still open, and retries once on a new one if the server closed it since the previous request.
+ * If offset isn't NULL, the file is requested from it, and requested again whole if nothing is left past it. */
+static bool
+https_connection_request(struct https_connection *connection, const char *file, off_t *offset, struct https_response *response) {
+	for(;;) {
+		if(connection->fd >= 0 && !connection->isreusable) {
+			https_connection_close(connection);
+		}
+
+		if(connection->fd < 0 && !https_connection_connect(connection)) {
+			return false;
+		}
+
+		const bool isreused = connection->requests != 0;
+
+		if(https_connection_send(connection, file, offset != NULL ? *offset : 0)
+			&& https_connection_head(connection, response)) {
+
+			/* Nothing left past offset, the file was received but not committed, or changed since */
+			if(response->status == 416 && offset != NULL && *offset != 0) {
+				*offset = 0;
+				https_connection_close(connection);
+				continue;
+			}
+
+			return true;
+		}
+
+		https_connection_close(connection);
+
+		if(!isreused) {
+			syslog(LOG_ERR, "https_scheme: Invalid response from %s for %s", scheme.authority, file);
+			return false;
+		}
+	}
+}
+
+/* Receives the body of the response to the request of file into sink */
+static bool
+https_connection_receive(struct https_connection *connection, const char *file, const struct https_response *response, https_sink_t sink, void *arg) {
+	bool sunk = true, received;
+
+	if(response->ischunked) {
+		received = https_connection_body_chunked(connection, sink, arg, &sunk);
+	} else if(response->contentlength >= 0) {
+		received = https_connection_body(connection, response->contentlength, sink, arg, &sunk);
+	} else {
+		received = https_connection_body_closed(connection, sink, arg, &sunk);
+	}
+
+	if(!received) {
+		/* The sink reports why it aborted */
+		if(sunk) {
+			syslog(LOG_ERR, "https_scheme: Unable to receive %s%s/%s: Transfer interrupted", scheme.authority, scheme.path, file);
+		}
+		https_connection_close(connection);
+		return false;
+	}
+
+	return true;
+}
+
+/* Fetches file, relative to the uri, into sink.
+ * If offset isn't NULL, the file is resumed from it, and it is set to where the body
+ * actually starts from, zero if the server sends the whole file instead. */
+static bool
+https_connection_get(struct https_connection *connection, const char *file, off_t *offset, https_sink_t sink, void *arg) {
+	struct https_response response;
+
+	if(!https_connection_request(connection, file, offset, &response)) {
+		return false;
+	}
+
+	if(response.status == 200) {
+		if(offset != NULL) {
+			*offset = 0;
+		}
+	} else if(response.status != 206 || offset == NULL || response.rangestart != *offset) {
+		syslog(LOG_ERR, "https_scheme: Unable to fetch %s%s/%s: HTTP status %d", scheme.authority, scheme.path, file, response.status);
+		https_connection_close(connection);
+		return false;
+	}
+
+	return https_connection_receive(connection, file, &response, sink, arg);
+}
 
 void
 https_scheme_open(const struct state *state, const char *uri) {
+	static const char authorityprefix[] = "https://";
+	if(strncasecmp(authorityprefix, uri, sizeof(authorityprefix) - 1) != 0) {
+		syslog(LOG_ERR, "https_scheme_open: Invalid uri for https scheme, between scheme and authority: %s", uri);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Split authority and path, and the authority in host and port */
+	const char * const authority = uri + sizeof(authorityprefix) - 1;
+	const size_t authoritylength = strcspn(authority, "/?#");
+	const char *path = authority + authoritylength;
+	size_t pathlength = strcspn(path, "?#");
+
+	while(pathlength != 0 && path[pathlength - 1] == '/') {
+		pathlength--;
+	}
+
+	scheme.authority = strndup(authority, authoritylength);
+	scheme.path = strndup(path, pathlength);
+	if(scheme.authority == NULL || scheme.path == NULL) {
+		syslog(LOG_ERR, "https_scheme_open: Unable to allocate uri: %m");
+		exit(EXIT_FAILURE);
+	}
+
+	const char *host = scheme.authority, *hostend, *port;
+	if(*host == '[') {
+		hostend = strchr(++host, ']');
+		port = hostend != NULL && hostend[1] == ':' ? hostend + 2 : NULL;
+	} else {
+		hostend = strchr(host, ':');
+		port = hostend != NULL ? hostend + 1 : NULL;
+	}
+
+	if(hostend == NULL) {
+		hostend = host + strlen(host);
+	}
+
+	scheme.host = strndup(host, hostend - host);
+	scheme.port = strdup(port != NULL && *port != '\0' ? port : HTTPS_SCHEME_DEFAULT_PORT);
+	if(scheme.host == NULL || scheme.port == NULL || *scheme.host == '\0') {
+		syslog(LOG_ERR, "https_scheme_open: Invalid host in uri %s", uri);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Servers closing a connection mustn't kill us while we're writing to it */
+	const struct sigaction ignore = { .sa_handler = SIG_IGN };
+	if(sigaction(SIGPIPE, &ignore, &scheme.sigpipe) != 0) {
+		syslog(LOG_ERR, "https_scheme_open: Unable to ignore SIGPIPE: %m");
+		exit(EXIT_FAILURE);
+	}
+
+	scheme.context = SSL_CTX_new(TLS_client_method());
+	if(scheme.context == NULL
+		|| SSL_CTX_set_min_proto_version(scheme.context, TLS1_2_VERSION) != 1
+		|| SSL_CTX_set_default_verify_paths(scheme.context) != 1) {
+		char error[256];
+		syslog(LOG_ERR, "https_scheme_open: Unable to create TLS context: %s", https_scheme_ssl_error(error, sizeof(error)));
+		exit(EXIT_FAILURE);
+	}
+
+	SSL_CTX_set_verify(scheme.context, SSL_VERIFY_PEER, NULL);
+	SSL_CTX_set_mode(scheme.context, SSL_MODE_AUTO_RETRY);
+}
+
+struct https_scheme_snapshot_sink {
+	struct state_stream *stream;
+	size_t total;
+};
+
+static bool
+https_scheme_snapshot_write(void *arg, const char *data, size_t length) {
+	struct https_scheme_snapshot_sink * const sink = arg;
+
+	state_stream_write(sink->stream, data, length);
+	sink->total += length;
+
+	return true;
 }
 
 void
-https_scheme_snapshot(const struct state *state) {
+https_scheme_snapshot(const struct state *state, struct state_stream *stream) {
+	struct https_connection * const connection = malloc(sizeof(*connection));
+	struct https_scheme_snapshot_sink sink = { .stream = stream };
+
+	if(connection == NULL) {
+		syslog(LOG_ERR, "https_scheme_snapshot: Unable to allocate connection: %m");
+		exit(EXIT_FAILURE);
+	}
+
+	https_connection_init(connection);
+
+	if(!https_connection_get(connection, HTTPS_SCHEME_SNAPSHOT_FILE, NULL, https_scheme_snapshot_write, &sink)) {
+		exit(EXIT_FAILURE);
+	}
+
+	if(sink.total == 0) {
+		syslog(LOG_ERR, "https_scheme_snapshot: Invalid size for snapshot at %s%s/" HTTPS_SCHEME_SNAPSHOT_FILE, scheme.authority, scheme.path);
+		exit(EXIT_FAILURE);
+	}
+
+	https_connection_close(connection);
+	free(connection);
+}
+
+/*
+ * Packages are fetched by a pool of jobs, each with its own connection,
+ * and extracted as they are received. As with the file scheme, a failing package
+ * stops jobs from taking new packages, transfers in progress complete,
+ * then we exit, for the consistency check to recover.
+ */
+
+struct https_scheme_extractions {
+	const struct state *state;
+
+	struct jobs jobs; /* Over iterator */
+	struct set_iterator iterator;
+};
+
+struct https_scheme_extraction_sink {
+	const struct state *state;
+	struct hny_extraction *extraction;
+	enum hny_extraction_status status;
+	int errcode;
+	struct cache_entry cache;
+};
+
+static bool
+https_scheme_extract(void *arg, const char *data, size_t length) {
+	struct https_scheme_extraction_sink * const sink = arg;
+
+	/* Anything received after the end of the archive is ignored, like trailing bytes of package files */
+	if(sink->status == HNY_EXTRACTION_STATUS_OK) {
+		sink->status = hny_extraction_extract(sink->extraction, data, length, &sink->errcode);
+	}
+
+	cache_entry_write(sink->state, &sink->cache, data, length);
+
+	return !HNY_EXTRACTION_STATUS_IS_ERROR(sink->status);
+}
+
+/* Package received in the spool, resumed from where the previous run stopped */
+struct https_scheme_spool_sink {
+	struct spool_part part;
+	off_t from;    /* Offset the part was resumed from */
+	off_t resumed; /* Offset the server resumed from */
+};
+
+/* The server sent the whole package rather than what we missed */
+static bool
+https_scheme_spool_restart(struct https_scheme_spool_sink *sink) {
+
+	if(sink->resumed != sink->from) {
+		sink->from = sink->resumed;
+		return spool_part_restart(&sink->part);
+	}
+
+	return true;
+}
+
+static bool
+https_scheme_spool_write(void *arg, const char *data, size_t length) {
+	struct https_scheme_spool_sink * const sink = arg;
+
+	return https_scheme_spool_restart(sink) && spool_part_write(&sink->part, data, length);
+}
+
+/* With a spool, packages are received whole before being extracted, so an interrupted
+ * update extracts again from the spool, and only fetches what it didn't receive */
+static bool
+https_scheme_package_spooled(const struct state *state, struct https_connection *connection,
+	const char *package, const char *file, struct https_scheme_extraction_sink *extraction) {
+	int fd = spool_find(state, package);
+
+	if(fd < 0) {
+		struct https_scheme_spool_sink sink;
+
+		if(!spool_part_open(state, package, &sink.part)) {
+			return false;
+		}
+
+		if(sink.part.offset != 0) {
+			syslog(LOG_INFO, "Resuming %s from byte %lld", package, (long long)sink.part.offset);
+		}
+
+		sink.from = sink.part.offset;
+		sink.resumed = sink.part.offset;
+
+		if(https_connection_get(connection, file, &sink.resumed, https_scheme_spool_write, &sink)
+			&& https_scheme_spool_restart(&sink)) {
+			fd = spool_part_complete(state, package, &sink.part);
+		}
+
+		spool_part_close(&sink.part);
+
+		if(fd < 0) {
+			return false;
+		}
+	}
+
+	char buffer[HTTPS_SCHEME_BUFFER_SIZE];
+	ssize_t readval;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	while((readval = read(fd, buffer, sizeof(buffer))) > 0
+		&& https_scheme_extract(extraction, buffer, readval));
+
+	if(readval < 0) {
+		syslog(LOG_ERR, "https_scheme_packages: Unable to read spooled package '%s': %m", package);
+	}
+
+	close(fd);
+
+	return readval >= 0;
+}
+
+static bool
+https_scheme_package(struct https_scheme_extractions *extractions, struct https_connection *connection, const char *package) {
+	const struct state * const state = extractions->state;
+	char file[HTTPS_SCHEME_LINE_MAX];
+	struct https_scheme_extraction_sink sink = { .state = state, .status = HNY_EXTRACTION_STATUS_OK };
+
+	snprintf(file, sizeof(file), HTTPS_SCHEME_PACKAGES_DIRECTORY "/%s", package);
+
+	/* Create extraction handler */
+	const int errcode = hny_extraction_create(&sink.extraction, state->hny, package);
+	if(errcode != 0) {
+		syslog(LOG_ERR, "https_scheme_packages: Unable to create extraction: %s", strerror(errcode));
+		return false;
+	}
+
+	cache_entry_create(state, package, &sink.cache);
+
+	/* Transfer errors are reported when receiving, extraction ones here */
+	const bool received = state->spooldirfd >= 0
+		? https_scheme_package_spooled(state, connection, package, file, &sink)
+		: https_connection_get(connection, file, NULL, https_scheme_extract, &sink);
+	const bool extracted = extract_status("https_scheme_packages", package, sink.status, sink.errcode);
+
+	if(received && extracted) {
+		cache_entry_commit(state, package, &sink.cache);
+	} else {
+		cache_entry_abort(state, &sink.cache);
+	}
+
+	/* Don't forget to close */
+	hny_extraction_destroy(sink.extraction);
+
+	if(received && extracted) {
+		reuse_package(state, package);
+	}
+
+	return received && extracted;
+}
+
+static void *
+https_scheme_packages_run(void *arg) {
+	struct https_scheme_extractions * const extractions = arg;
+	struct https_connection * const connection = malloc(sizeof(*connection));
+
+	if(connection == NULL) {
+		syslog(LOG_ERR, "https_scheme_packages: Unable to allocate connection: %m");
+		jobs_fail(&extractions->jobs);
+		return NULL;
+	}
+
+	https_connection_init(connection);
+
+	struct set_element element;
+	while(jobs_next_element(&extractions->jobs, &extractions->iterator, &element)) {
+		if(!https_scheme_package(extractions, connection, element.key)) {
+			jobs_fail(&extractions->jobs);
+		}
+	}
+
+	https_connection_close(connection);
+	free(connection);
+
+	return NULL;
 }
 
 void
 https_scheme_packages(const struct state *state, const struct set *packages) {
+	struct https_scheme_extractions extractions = { .state = state };
+
+	unsigned int jobs = packages->count < state->jobs ? packages->count : state->jobs;
+	if(jobs > HTTPS_SCHEME_CONNECTIONS_MAX) {
+		jobs = HTTPS_SCHEME_CONNECTIONS_MAX;
+	}
+
+	jobs_init(&extractions.jobs, 0);
+	set_iterator_init(&extractions.iterator, packages);
+
+	jobs_run("https_scheme_packages", jobs, https_scheme_packages_run, &extractions, 0);
+
+	set_iterator_deinit(&extractions.iterator);
+
+	if(extractions.jobs.failed) {
+		exit(EXIT_FAILURE);
+	}
+
+	jobs_deinit(&extractions.jobs);
+}
+
+/**********
+ * Chunks *
+ **********/
+
+static void *
+https_scheme_chunks_connect(const struct state *state) {
+	struct https_connection * const connection = malloc(sizeof(*connection));
+
+	if(connection == NULL) {
+		syslog(LOG_ERR, "https_scheme_chunks: Unable to allocate connection: %m");
+		return NULL;
+	}
+
+	https_connection_init(connection);
+
+	return connection;
 }
 
+static bool
+https_scheme_chunks_discard(void *arg, const char *data, size_t length) {
+	return true;
+}
+
+static enum chunk_get_status
+https_scheme_chunks_get(void *connection, const char *file, chunk_sink_t sink, void *arg) {
+	struct https_response response;
+
+	if(!https_connection_request(connection, file, NULL, &response)) {
+		return CHUNK_GET_ERROR;
+	}
+
+	/* The body of the error is read so the connection stays usable */
+	if(response.status == 404) {
+		return https_connection_receive(connection, file, &response, https_scheme_chunks_discard, NULL)
+			? CHUNK_GET_MISSING : CHUNK_GET_ERROR;
+	}
+
+	if(response.status != 200) {
+		syslog(LOG_ERR, "https_scheme: Unable to fetch %s%s/%s: HTTP status %d", scheme.authority, scheme.path, file, response.status);
+		https_connection_close(connection);
+		return CHUNK_GET_ERROR;
+	}
+
+	return https_connection_receive(connection, file, &response, sink, arg) ? CHUNK_GET_OK : CHUNK_GET_ERROR;
+}
+
+static void
+https_scheme_chunks_disconnect(void *connection) {
+	https_connection_close(connection);
+	free(connection);
+}
+
+const struct chunk_source https_scheme_chunks = {
+	.jobsmax = HTTPS_SCHEME_CONNECTIONS_MAX,
+	.connect = https_scheme_chunks_connect,
+	.get = https_scheme_chunks_get,
+	.disconnect = https_scheme_chunks_disconnect,
+};
+
 void
 https_scheme_close(const struct state *state) {
+	SSL_CTX_free(scheme.context);
+	sigaction(SIGPIPE, &scheme.sigpipe, NULL);
+	free(scheme.authority);
+	free(scheme.host);
+	free(scheme.port);
+	free(scheme.path);
 }
-
@@ -8,6 +8,7 @@
 #ifndef UPDATE_SCHEMES_HTTPS_H
 #define UPDATE_SCHEMES_HTTPS_H
 
+#include "../chunk.h"
 #include "../set.h"
 #include "../state.h"
 
@@ -17,11 +18,13 @@ void
 https_scheme_open(const struct state *state, const char *uri);
 
 void
-https_scheme_snapshot(const struct state *state);
+https_scheme_snapshot(const struct state *state, struct state_stream *stream);
 
 void
 https_scheme_packages(const struct state *state, const struct set *packages);
 
+extern const struct chunk_source https_scheme_chunks;
+
 void
 https_scheme_close(const struct state *state);
 
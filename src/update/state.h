@@ -13,37 +13,93 @@
 
 #include <hny.h>
 
+#include "atoms.h"
+#include "digest.h"
 #include "set.h"
 
 #define STATE_SNAPSHOT_CURRENT "current"
 #define STATE_SNAPSHOT_PENDING "pending"
+#define STATE_SNAPSHOT_INDEX   "index"
+#define STATE_JOURNAL          "journal"
+
+/* Parser of a snapshot, fed line by line */
+struct state_parser {
+	struct set *snapshot;
+	struct atoms *atoms;
+	const char *filename;
+	int parsing;    /* State of the parsing automaton */
+	atom_t pair[2]; /* Entry being parsed */
+	size_t lineno;
+};
+
+/* Pending snapshot being received, see state_stream_open */
+struct state_stream {
+	int fd;
+	struct state_parser parser;
+	size_t linecapacity;
+	size_t linelength;
+	char *line; /* Line split between two writes */
+};
 
 struct state {
 	bool shouldexit; /* Used when receiving sigterm interruption to avoid corruption */
 
 	struct hny *hny;   /* Honey prefix of system */
+	int prefixfd;      /* File descriptor for directory of the prefix, entries are accessed relative to it */
 	int dirfd;         /* File descriptor for directory of snapshot and pending */
+	int spooldirfd;    /* File descriptor for directory of packages being received, or -1 */
+	int cachedirfd;    /* File descriptor for directory of cached packages, or -1, see cache_open */
+	unsigned long long cachebudget; /* Size the cache may grow to, in bytes */
+	bool isreusing;    /* Reuse unchanged files of previous versions of new packages, see reuse_package */
+	unsigned int jobs; /* Maximum number of parallel jobs */
+	unsigned int hooksjobs; /* Maximum number of hooks running at once, see hooks_init */
+
+	struct atoms atoms; /* Strings of all sets, interned once per run */
 
 	struct set current; /* Current state geister */
 	struct set pending; /* Pending state geister */
 
 	struct set packages; /* Packages of current */
+	struct set previous; /* New packages paired with the package their geist installs in current, see reuse_prepare */
+
+	void *index;      /* Mapping of the index of current, tables may borrow from it, or NULL */
+	size_t indexsize;
+
+	bool hascurrentdigest; /* Known once the index of current is loaded or stored */
+	uint8_t currentdigest[DIGEST_SIZE];
 };
 
 void
-state_init(struct state *state, const char *prefix, int flags, const char *snapshots);
+state_init(struct state *state, const char *prefix, int flags, const char *snapshots, const char *spool, unsigned int jobs);
 
 void
 state_deinit(struct state *state);
 
 void
-state_diff(const struct state *state, struct set *newgeister, struct set *newpackages);
+state_diff(const struct state *state, struct set *newgeister, struct set *newpackages,
+	struct set *oldgeister, struct set *oldpackages);
 
 void
 state_parse_pending(struct state *state);
 
+void
+state_stream_open(struct state *state, struct state_stream *stream);
+
+void
+state_stream_write(struct state_stream *stream, const void *data, size_t length);
+
+void
+state_stream_close(struct state_stream *stream);
+
+void
+state_write_pending(const struct state *state, uint8_t digest[DIGEST_SIZE]);
+
 void
 state_parse_current(struct state *state);
 
+/* Pending was renamed to current, its set becomes current without parsing it again. */
+void
+state_current_from_pending(struct state *state);
+
 /* UPDATE_STATE_H */
 #endif
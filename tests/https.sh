@@ -0,0 +1,65 @@
+#!/bin/sh
+#	https.sh
+#	Copyright (c) 2021, Valentin Debon
+#
+#	This file is part of the update program
+#	subject the BSD 3-Clause License, see LICENSE
+#
+# Fetches a snapshot and its packages through https://localhost,
+# served by openssl s_server with a self-signed certificate.
+# usage: https.sh <update> [port]
+
+UPDATE="$1"
+PORT="${2:-8443}"
+
+if [ -z "${UPDATE}" ]
+then printf 'usage: %s <update> [port]\n' "$0" >&2 ; exit 1
+fi
+
+case "${UPDATE}" in
+/*) ;;
+*) UPDATE="`pwd`/${UPDATE}" ;;
+esac
+
+ROOT="`mktemp -d`" || exit 1
+SERVER=
+trap '[ -n "${SERVER}" ] && kill "${SERVER}" ; rm -rf "${ROOT}"' EXIT
+
+fail() {
+	printf 'https: %s\n' "$*" >&2
+	exit 1
+}
+
+mkdir -p "${ROOT}/prefix" "${ROOT}/snapshots" "${ROOT}/remote/packages" || fail "Unable to create ${ROOT}"
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost -addext subjectAltName=DNS:localhost \
+	-keyout "${ROOT}/key.pem" -out "${ROOT}/cert.pem" 2>/dev/null || fail "Unable to generate certificate"
+
+# Packages are xz compressed archives of their content
+for package in alpha-1.0 beta-2.1
+do
+	mkdir -p "${ROOT}/build/${package}/hny"
+	printf '%s\n' "${package}" > "${ROOT}/build/${package}/${package}.txt"
+	tar -cf - -C "${ROOT}/build/${package}" . | xz > "${ROOT}/remote/packages/${package}" || fail "Unable to create ${package}"
+done
+
+printf 'alpha\nalpha-1.0\nbeta\nbeta-2.1\n' > "${ROOT}/remote/snapshot"
+: > "${ROOT}/snapshots/current"
+
+# -WWW serves files relative to the working directory
+(cd "${ROOT}" && exec openssl s_server -quiet -WWW -accept "${PORT}" -cert cert.pem -key key.pem >/dev/null 2>&1) &
+SERVER=$!
+sleep 1
+
+SSL_CERT_FILE="${ROOT}/cert.pem" "${UPDATE}" -p "${ROOT}/prefix" -s "${ROOT}/snapshots" "https://localhost:${PORT}/remote" \
+	|| fail "update exited with status $?"
+
+cmp -s "${ROOT}/remote/snapshot" "${ROOT}/snapshots/current" || fail "Snapshot not committed"
+
+for geist in alpha:alpha-1.0 beta:beta-2.1
+do
+	[ "`readlink "${ROOT}/prefix/${geist%%:*}"`" = "${geist#*:}" ] || fail "Geist ${geist%%:*} not shifted to ${geist#*:}"
+	[ -d "${ROOT}/prefix/${geist#*:}" ] || fail "Package ${geist#*:} not extracted"
+done
+
+printf 'https: OK\n'